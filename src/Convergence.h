@@ -0,0 +1,132 @@
+//
+// Steady state detection - residual fused into the sweep, combined across ranks without blocking
+//
+
+#ifndef LAB1_CONVERGENCE_H
+#define LAB1_CONVERGENCE_H
+
+#include <atomic>
+#include "shared.h"
+#include "NonCopyable.h"
+
+/**
+ * Sweeps announced with begin_sweep() which cover a check step (every conf.checkEvery-th) are measured: their
+ * row kernels report max |new - old| via add(). end_sweep() starts MPI_Iallreduce of that value and only waits for
+ * it at the end of the following sweep, so the check never adds a synchronisation point - the price is stopping
+ * one sweep later than strictly necessary.
+ *
+ * add() may be called from any thread, everything else only from the thread which owns MPI. With
+ * comm == MPI_COMM_NULL (seq) local residual is the global one.
+ */
+class ConvergenceCheck : private NonCopyable {
+public:
+	ConvergenceCheck(const Config& conf, const MPI_Comm comm = MPI_COMM_NULL)
+			: tolerance(conf.tolerance), checkEvery(conf.checkEvery), comm(comm), local(0), measuring_(false),
+			  measured(false), pending(false), converged(false), rq(MPI_REQUEST_NULL), sent(0), received(0),
+			  sentAt(0), residual(0), residualAt(0), stoppedAt(0) {}
+
+	~ConvergenceCheck() {
+		complete_reduction();
+	}
+
+	bool enabled() const {
+		return tolerance > 0;
+	}
+
+	/**
+	 * Next sweep advances the field to time steps [from, to] (counted from 0)
+	 */
+	void begin_sweep(const TimeStepCount from, const TimeStepCount to) {
+		measuring_ = enabled() && (to + 1)/checkEvery > from/checkEvery;
+		measured = measured || measuring_;
+	}
+
+	bool measuring() const {
+		return measuring_;
+	}
+
+	void add(const AccType residual) {
+		auto current = local.load(std::memory_order_relaxed);
+		while(residual > current && !local.compare_exchange_weak(current, residual, std::memory_order_relaxed)) {}
+	}
+
+	/**
+	 * @param stepsDone time steps computed so far, including this sweep
+	 * @return true once the field converged - caller should stop after this sweep
+	 */
+	bool end_sweep(const TimeStepCount stepsDone) {
+		measuring_ = false;
+
+		if(complete_reduction() && residual <= tolerance) {
+			converged = true;
+			stoppedAt = stepsDone;
+			return true;
+		}
+
+		if(measured) {
+			sent = local.exchange(0);
+			if(comm != MPI_COMM_NULL) {
+				MPI_Iallreduce(&sent, &received, 1, ACC_MPI_DT, MPI_MAX, comm, &rq);
+			} else {
+				received = sent;
+			}
+			pending = true;
+			measured = false;
+			sentAt = stepsDone;
+		}
+
+		return false;
+	}
+
+	void report(std::ostream& os) {
+		complete_reduction();
+
+		if(converged) {
+			os << "Converged: residual " << residual << " after " << residualAt << " steps, stopped after "
+			   << stoppedAt << std::endl;
+		} else if(enabled()) {
+			os << "Not converged: residual " << residual << " after " << residualAt << " steps" << std::endl;
+		}
+	}
+
+private:
+	const AccType tolerance;
+	const TimeStepCount checkEvery;
+	const MPI_Comm comm;
+
+	std::atomic<AccType> local;
+	bool measuring_;
+	/* some sweep since last end_sweep() was measured */
+	bool measured;
+	bool pending;
+	bool converged;
+
+	MPI_Request rq;
+	AccType sent;
+	AccType received;
+	TimeStepCount sentAt;
+
+	/* last residual known on all ranks */
+	AccType residual;
+	TimeStepCount residualAt;
+	TimeStepCount stoppedAt;
+
+	/**
+	 * @return true if there was a reduction in flight
+	 */
+	bool complete_reduction() {
+		if(!pending) {
+			return false;
+		}
+
+		if(comm != MPI_COMM_NULL) {
+			MPI_Wait(&rq, MPI_STATUS_IGNORE);
+		}
+		pending = false;
+		residual = received;
+		residualAt = sentAt;
+		return true;
+	}
+};
+
+#endif //LAB1_CONVERGENCE_H
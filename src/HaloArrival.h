@@ -0,0 +1,77 @@
+//
+// Outies computed in whichever order their halos arrive - shared by workspaces which receive halos of every
+// neighbour separately
+//
+
+#ifndef LAB1_HALOARRIVAL_H
+#define LAB1_HALOARRIVAL_H
+
+#include <vector>
+#include "Progress.h"
+
+/**
+ * Base of workspace W (CRTP), which has to provide
+ * - unsigned arrived_halos() - bitmask of neighbours whose halo has already arrived, never blocks
+ * - unsigned halo_dependencies(area) - bitmask of neighbours whose halo the area reads
+ * - void wait_some_halos() - blocks until another halo may have arrived
+ * - overlap - OverlapStats the waiting is counted in
+ * (W may keep the last three private, befriending HaloArrival<W>)
+ */
+template <typename W>
+class HaloArrival {
+public:
+	/**
+	 * Blocks until arrived_halos() reports more than known
+	 */
+	unsigned wait_for_more_halos(const unsigned known) {
+		auto& w = self();
+		unsigned arrived = known;
+		w.overlap.wait(OverlapStats::RECEIVES, [&w, &arrived, known]() {
+			while(arrived == known) {
+				w.wait_some_halos();
+				arrived = w.arrived_halos();
+			}
+		});
+		return arrived;
+	}
+
+	/**
+	 * Calls iterate(area) for every area as soon as all halos it reads have arrived, blocking only when none of
+	 * the remaining ones can proceed - one late neighbour holds back only outies next to it
+	 */
+	template <typename A, typename I>
+	void iterate_as_halos_arrive(const A& areas, I iterate) {
+		const unsigned DONE = ~0u;
+		auto& w = self();
+
+		std::vector<unsigned> deps;
+		for(const auto& a: areas) {
+			deps.push_back(w.halo_dependencies(a));
+		}
+
+		auto remaining = deps.size();
+		auto arrived = w.arrived_halos();
+		while(remaining > 0) {
+			bool progressed = false;
+			for(size_t i = 0; i < deps.size(); i++) {
+				if(deps[i] != DONE && (deps[i] & arrived) == deps[i]) {
+					iterate(areas[i]);
+					deps[i] = DONE;
+					remaining--;
+					progressed = true;
+				}
+			}
+
+			if(remaining > 0) {
+				arrived = progressed ? w.arrived_halos() : wait_for_more_halos(arrived);
+			}
+		}
+	}
+
+private:
+	W& self() {
+		return static_cast<W&>(*this);
+	}
+};
+
+#endif //LAB1_HALOARRIVAL_H
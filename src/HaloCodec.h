@@ -0,0 +1,384 @@
+//
+// Halo messages packed by Workspace: values in full or reduced precision (HaloPrecision), optionally with a lossless
+// codec (HaloExchange::COMPRESSED) - XOR with the previous value, leading zero bytes dropped - and the policy
+// turning the codec off when it doesn't pay
+//
+
+#ifndef LAB1_HALOCODEC_H
+#define LAB1_HALOCODEC_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "shared.h"
+
+/**
+ * How a value travels: bit pattern of NumType, float or bfloat16 (top half of a float, rounded to nearest even),
+ * in the low bytes() bytes of a uint64_t
+ */
+class HaloWireFormat {
+public:
+	HaloWireFormat(const HaloPrecision precision) : precision(precision) {}
+
+	/* values lose precision on the way */
+	bool lossy() const {
+		return bytes() < static_cast<int>(sizeof(NumType));
+	}
+
+	int bytes() const {
+		switch(precision) {
+			case HaloPrecision::FLOAT: return sizeof(float);
+			case HaloPrecision::BF16: return sizeof(uint16_t);
+			default: return sizeof(NumType);
+		}
+	}
+
+	uint64_t encode(const NumType v) const {
+		switch(precision) {
+			case HaloPrecision::FLOAT: return float_bits(static_cast<float>(v));
+			case HaloPrecision::BF16: {
+				const auto u = float_bits(static_cast<float>(v));
+				return (u + 0x7fff + ((u >> 16) & 1)) >> 16;
+			}
+			default: {
+				uint64_t bits = 0;
+				std::memcpy(&bits, &v, sizeof(v));
+				return bits;
+			}
+		}
+	}
+
+	NumType decode(const uint64_t bits) const {
+		switch(precision) {
+			case HaloPrecision::FLOAT: return bits_float(static_cast<uint32_t>(bits));
+			case HaloPrecision::BF16: return bits_float(static_cast<uint32_t>(bits) << 16);
+			default: {
+				NumType v;
+				std::memcpy(&v, &bits, sizeof(v));
+				return v;
+			}
+		}
+	}
+
+private:
+	const HaloPrecision precision;
+
+	static uint32_t float_bits(const float f) {
+		uint32_t u;
+		std::memcpy(&u, &f, sizeof(u));
+		return u;
+	}
+
+	static float bits_float(const uint32_t u) {
+		float f;
+		std::memcpy(&f, &u, sizeof(f));
+		return f;
+	}
+};
+
+/**
+ * Count of leading zero bytes of the low `bytes` bytes of x
+ */
+inline int leading_zero_bytes(const uint64_t x, const int bytes) {
+	return x ? __builtin_clzll(x)/8 - (8 - bytes) : bytes;
+}
+
+/**
+ * Neighbouring points of a smooth field share sign, exponent and top of the mantissa, so XOR of a value with the
+ * previous one starts with zero bytes. Every value is stored as count of those bytes (4 bits, two counts share
+ * a byte which precedes both values) followed by the rest of the XOR, most significant byte first.
+ */
+class XorEncoder {
+public:
+	XorEncoder(uint8_t* out, const int bytes) : out(out), bytes(bytes), pos(0), header(0), prev(0), odd(false) {}
+
+	void put(const uint64_t bits) {
+		const uint64_t x = bits ^ prev;
+		prev = bits;
+
+		const int zeros = leading_zero_bytes(x, bytes);
+		if(!odd) {
+			header = pos++;
+			out[header] = static_cast<uint8_t>(zeros);
+		} else {
+			out[header] |= static_cast<uint8_t>(zeros << 4);
+		}
+		odd = !odd;
+
+		for(int b = bytes - zeros - 1; b >= 0; b--) {
+			out[pos++] = static_cast<uint8_t>(x >> (8*b));
+		}
+	}
+
+	Coord size() const {
+		return pos;
+	}
+
+private:
+	uint8_t* out;
+	const int bytes;
+	Coord pos;
+	Coord header;
+	uint64_t prev;
+	bool odd;
+};
+
+class XorDecoder {
+public:
+	XorDecoder(const uint8_t* in, const int bytes) : in(in), bytes(bytes), pos(0), header(0), prev(0), odd(false) {}
+
+	uint64_t get() {
+		if(!odd) {
+			header = pos++;
+		}
+		const int zeros = odd ? in[header] >> 4 : in[header] & 0xf;
+		odd = !odd;
+
+		uint64_t x = 0;
+		for(int b = bytes - zeros - 1; b >= 0; b--) {
+			x |= static_cast<uint64_t>(in[pos++]) << (8*b);
+		}
+		prev ^= x;
+		return prev;
+	}
+
+private:
+	const uint8_t* in;
+	const int bytes;
+	Coord pos;
+	Coord header;
+	uint64_t prev;
+	bool odd;
+};
+
+/* first byte of every halo message */
+enum HaloMessageKind : uint8_t {
+	RAW_HALO = 0,
+	XOR_HALO = 1,
+};
+
+/**
+ * Message of count values stored as they are
+ */
+inline Coord halo_message_raw(const Coord count, const HaloWireFormat& wire) {
+	return 1 + count*wire.bytes();
+}
+
+/**
+ * Longest message encode_halo_message() produces for count values
+ */
+inline Coord halo_message_bound(const Coord count, const HaloWireFormat& wire) {
+	return halo_message_raw(count, wire) + (count + 1)/2;
+}
+
+/**
+ * each(put) has to call put(bits) for every one of count values (HaloWireFormat::encode()). Values are XOR encoded
+ * if compress is set and that comes out shorter, stored as they are otherwise (little endian).
+ * @return message length
+ */
+template <typename E>
+Coord encode_halo_message(uint8_t* out, const Coord count, const HaloWireFormat& wire, const bool compress,
+                          E each) {
+	const int bytes = wire.bytes();
+	const Coord raw = halo_message_raw(count, wire);
+
+	if(compress) {
+		XorEncoder enc(out + 1, bytes);
+		each([&enc](const uint64_t bits) { enc.put(bits); });
+		if(1 + enc.size() < raw) {
+			out[0] = XOR_HALO;
+			return 1 + enc.size();
+		}
+	}
+
+	out[0] = RAW_HALO;
+	uint8_t* p = out + 1;
+	each([&p, bytes](const uint64_t bits) {
+		for(int b = 0; b < bytes; b++) {
+			*p++ = static_cast<uint8_t>(bits >> (8*b));
+		}
+	});
+	return raw;
+}
+
+/**
+ * each(get) has to call get() for every value, in the order they were encoded - it returns bits for
+ * HaloWireFormat::decode()
+ */
+template <typename D>
+void decode_halo_message(const uint8_t* in, const HaloWireFormat& wire, D each) {
+	const int bytes = wire.bytes();
+
+	if(in[0] == XOR_HALO) {
+		XorDecoder dec(in + 1, bytes);
+		each([&dec]() { return dec.get(); });
+	} else {
+		const uint8_t* p = in + 1;
+		each([&p, bytes]() {
+			uint64_t bits = 0;
+			for(int b = 0; b < bytes; b++) {
+				bits |= static_cast<uint64_t>(*p++) << (8*b);
+			}
+			return bits;
+		});
+	}
+}
+
+/**
+ * Per neighbour: a message which didn't shrink below MAX_RATIO of its raw size isn't worth the encoder time, so
+ * the next `backoff` messages go raw without trying. Backoff doubles (up to MAX_BACKOFF) with every such try and
+ * drops back with a successful one - a field which becomes compressible later still gets noticed. Receivers
+ * don't care, every message says how it's encoded.
+ *
+ * Neighbours may be handled by different threads, counters of each are touched only by the one handling it.
+ */
+class HaloCompression {
+public:
+	HaloCompression(const int neighbours) : policies(neighbours), total{} {}
+
+	bool should_try(const int n) {
+		auto& p = policies[n];
+		if(p.skip > 0) {
+			p.skip--;
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * @param raw length of the message stored without the codec (halo_message_raw())
+	 */
+	void sent(const int n, const Coord raw, const Coord length, const bool tried) {
+		auto& p = policies[n];
+
+		p.counters.messages++;
+		p.counters.rawBytes += raw;
+		p.counters.sentBytes += length;
+		if(length < raw) {
+			p.counters.compressed++;
+		}
+
+		if(tried) {
+			if(length > MAX_RATIO*raw) {
+				p.skip = p.backoff;
+				p.backoff = p.backoff < MAX_BACKOFF ? 2*p.backoff : MAX_BACKOFF;
+			} else {
+				p.backoff = 1;
+			}
+		}
+	}
+
+	/**
+	 * Collective - sums counters of all ranks into root's report
+	 */
+	void reduce(const MPI_Comm comm, const int root = 0) {
+		Counters local{};
+		for(auto& p: policies) {
+			local.messages += p.counters.messages;
+			local.compressed += p.counters.compressed;
+			local.rawBytes += p.counters.rawBytes;
+			local.sentBytes += p.counters.sentBytes;
+		}
+		MPI_Reduce(&local, &total, 4, MPI_DOUBLE, MPI_SUM, root, comm);
+	}
+
+	void report(std::ostream& os) const {
+		os << "Halo compression: " << total.compressed << "/" << total.messages << " messages compressed, sent "
+		   << total.sentBytes << " of " << total.rawBytes << " bytes ("
+		   << (total.rawBytes > 0 ? total.sentBytes/total.rawBytes : 1.0) << ")" << std::endl;
+	}
+
+private:
+	constexpr static double MAX_RATIO = 0.875;
+	const static int MAX_BACKOFF = 64;
+
+	struct Counters {
+		double messages;
+		double compressed;
+		double rawBytes;
+		double sentBytes;
+	};
+
+	struct Policy {
+		int skip = 0;
+		int backoff = 1;
+		Counters counters{};
+	};
+
+	std::vector<Policy> policies;
+	Counters total;
+};
+
+/**
+ * How far reduced precision halos moved the field away from a full precision run - measured, not modelled: the
+ * variant repeats the steps on a shadow workspace configured by shadow_config() and compare()s final fields point by
+ * point. Costs a second workspace and run, so it's done only when halo precision isn't full, after the timed run.
+ */
+class HaloPrecisionError {
+public:
+	HaloPrecisionError(const HaloPrecision precision, const TimeStepCount steps)
+			: precision(precision), steps(steps), local{}, total{} {}
+
+	/**
+	 * Config of the shadow run - steps time steps of conf (no convergence check to stop it elsewhere), full
+	 * precision halos sent point-to-point one exchange at a time, no output and no progress thread
+	 */
+	static Config shadow_config(Config conf, const TimeStepCount steps) {
+		conf.timeSteps = steps;
+		conf.tolerance = 0;
+		conf.outputEnabled = false;
+		conf.scheduledTiles = false;
+		conf.haloExchange = HaloExchange::P2P;
+		conf.haloPrecision = HaloPrecision::FULL;
+		conf.haloDepth = 1;
+		conf.progress = Progress::NONE;
+		return conf;
+	}
+
+	/**
+	 * A point ended up with value, the shadow run with reference
+	 */
+	void compare(const NumType value, const NumType reference) {
+		local.error = std::max<double>(local.error, std::abs(value - reference));
+		local.scale = std::max<double>(local.scale, std::abs(reference));
+	}
+
+	/**
+	 * Largest change of a halo value the wire format caused
+	 */
+	void rounding(const NumType r) {
+		local.rounding = std::max<double>(local.rounding, r);
+	}
+
+	/**
+	 * Collective - maxima of all ranks into root's report
+	 */
+	void reduce(const MPI_Comm comm, const int root = 0) {
+		MPI_Reduce(&local, &total, 3, MPI_DOUBLE, MPI_MAX, root, comm);
+	}
+
+	void report(std::ostream& os) const {
+		os << "Halo precision " << halo_precision_name(precision) << ": values rounded by up to " << total.rounding;
+		if(total.scale > 0) {
+			os << ", field off full precision by " << total.error << " (relative " << total.error/total.scale
+			   << ") after " << steps << " steps";
+		}
+		os << std::endl;
+	}
+
+private:
+	struct Maxima {
+		double rounding;
+		double error;
+		double scale;
+	};
+
+	const HaloPrecision precision;
+	const TimeStepCount steps;
+	Maxima local;
+	Maxima total;
+};
+
+#endif //LAB1_HALOCODEC_H
@@ -0,0 +1,321 @@
+//
+// Strided halos (columns, corners) copied to and from contiguous staging buffers by hand - scalar fallback plus
+// AVX2/AVX-512 gather (and AVX-512 scatter) variants, picked at startup - as an alternative to MPI derived datatypes
+//
+
+#ifndef LAB1_HALOPACK_H
+#define LAB1_HALOPACK_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <ostream>
+#include <vector>
+#include "shared.h"
+#include "NonCopyable.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+	#define HALO_PACK_X86
+#endif
+
+/**
+ * count blocks of blockLen contiguous points, stride points apart - what MPI_Type_vector(count, blockLen, stride)
+ * describes
+ */
+struct StridedLayout {
+	Coord count;
+	Coord blockLen;
+	Coord stride;
+
+	Coord points() const {
+		return count*blockLen;
+	}
+
+	/* points from the first to past the last one */
+	Coord extent() const {
+		return (count - 1)*stride + blockLen;
+	}
+};
+
+/**
+ * Copies the strided points at src into contiguous dst (gather) or the other way round (scatter)
+ */
+using StridedKernel = void (*)(NumType* __restrict__ dst, const NumType* __restrict__ src, const StridedLayout& l);
+
+inline void gather_strided_scalar(NumType* __restrict__ dst, const NumType* __restrict__ src,
+                                  const StridedLayout& l) {
+	if(l.blockLen == 1) {
+		for(Coord i = 0; i < l.count; i++) {
+			dst[i] = src[i*l.stride];
+		}
+		return;
+	}
+	for(Coord i = 0; i < l.count; i++) {
+		std::memcpy(dst + i*l.blockLen, src + i*l.stride, l.blockLen*sizeof(NumType));
+	}
+}
+
+inline void scatter_strided_scalar(NumType* __restrict__ dst, const NumType* __restrict__ src,
+                                   const StridedLayout& l) {
+	if(l.blockLen == 1) {
+		for(Coord i = 0; i < l.count; i++) {
+			dst[i*l.stride] = src[i];
+		}
+		return;
+	}
+	for(Coord i = 0; i < l.count; i++) {
+		std::memcpy(dst + i*l.stride, src + i*l.blockLen, l.blockLen*sizeof(NumType));
+	}
+}
+
+#ifdef HALO_PACK_X86
+
+/*
+ * Vector variants only help single point wide columns - wider blocks are contiguous runs already, memcpy does them
+ * fine. Indices of a vector of lanes are stride apart; 32 bit ones (float lanes) cover any workspace that fits
+ * in memory of a single rank.
+ */
+
+#if defined(PRECISION_FLOAT) || defined(PRECISION_MIXED)
+
+__attribute__((target("avx2")))
+void gather_strided_avx2(NumType* __restrict__ dst, const NumType* __restrict__ src, const StridedLayout& l) {
+	if(l.blockLen != 1) {
+		gather_strided_scalar(dst, src, l);
+		return;
+	}
+	const auto s = static_cast<int>(l.stride);
+	const __m256i idx = _mm256_setr_epi32(0, s, 2*s, 3*s, 4*s, 5*s, 6*s, 7*s);
+	Coord i = 0;
+	for(; i + 8 <= l.count; i += 8) {
+		_mm256_storeu_ps(dst + i, _mm256_i32gather_ps(src + i*l.stride, idx, sizeof(NumType)));
+	}
+	gather_strided_scalar(dst + i, src + i*l.stride, StridedLayout{l.count - i, 1, l.stride});
+}
+
+__attribute__((target("avx512f")))
+void gather_strided_avx512(NumType* __restrict__ dst, const NumType* __restrict__ src, const StridedLayout& l) {
+	if(l.blockLen != 1) {
+		gather_strided_scalar(dst, src, l);
+		return;
+	}
+	const auto idx = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+	                                    _mm512_set1_epi32(static_cast<int>(l.stride)));
+	Coord i = 0;
+	for(; i + 16 <= l.count; i += 16) {
+		_mm512_storeu_ps(dst + i, _mm512_i32gather_ps(idx, src + i*l.stride, sizeof(NumType)));
+	}
+	gather_strided_scalar(dst + i, src + i*l.stride, StridedLayout{l.count - i, 1, l.stride});
+}
+
+__attribute__((target("avx512f")))
+void scatter_strided_avx512(NumType* __restrict__ dst, const NumType* __restrict__ src, const StridedLayout& l) {
+	if(l.blockLen != 1) {
+		scatter_strided_scalar(dst, src, l);
+		return;
+	}
+	const auto idx = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+	                                    _mm512_set1_epi32(static_cast<int>(l.stride)));
+	Coord i = 0;
+	for(; i + 16 <= l.count; i += 16) {
+		_mm512_i32scatter_ps(dst + i*l.stride, idx, _mm512_loadu_ps(src + i), sizeof(NumType));
+	}
+	scatter_strided_scalar(dst + i*l.stride, src + i, StridedLayout{l.count - i, 1, l.stride});
+}
+
+#else
+
+__attribute__((target("avx2")))
+void gather_strided_avx2(NumType* __restrict__ dst, const NumType* __restrict__ src, const StridedLayout& l) {
+	if(l.blockLen != 1) {
+		gather_strided_scalar(dst, src, l);
+		return;
+	}
+	const auto s = static_cast<long long>(l.stride);
+	const __m256i idx = _mm256_setr_epi64x(0, s, 2*s, 3*s);
+	Coord i = 0;
+	for(; i + 4 <= l.count; i += 4) {
+		_mm256_storeu_pd(dst + i, _mm256_i64gather_pd(src + i*l.stride, idx, sizeof(NumType)));
+	}
+	gather_strided_scalar(dst + i, src + i*l.stride, StridedLayout{l.count - i, 1, l.stride});
+}
+
+__attribute__((target("avx512f")))
+void gather_strided_avx512(NumType* __restrict__ dst, const NumType* __restrict__ src, const StridedLayout& l) {
+	if(l.blockLen != 1) {
+		gather_strided_scalar(dst, src, l);
+		return;
+	}
+	const auto s = static_cast<long long>(l.stride);
+	const __m512i idx = _mm512_setr_epi64(0, s, 2*s, 3*s, 4*s, 5*s, 6*s, 7*s);
+	Coord i = 0;
+	for(; i + 8 <= l.count; i += 8) {
+		_mm512_storeu_pd(dst + i, _mm512_i64gather_pd(idx, src + i*l.stride, sizeof(NumType)));
+	}
+	gather_strided_scalar(dst + i, src + i*l.stride, StridedLayout{l.count - i, 1, l.stride});
+}
+
+__attribute__((target("avx512f")))
+void scatter_strided_avx512(NumType* __restrict__ dst, const NumType* __restrict__ src, const StridedLayout& l) {
+	if(l.blockLen != 1) {
+		scatter_strided_scalar(dst, src, l);
+		return;
+	}
+	const auto s = static_cast<long long>(l.stride);
+	const __m512i idx = _mm512_setr_epi64(0, s, 2*s, 3*s, 4*s, 5*s, 6*s, 7*s);
+	Coord i = 0;
+	for(; i + 8 <= l.count; i += 8) {
+		_mm512_i64scatter_pd(dst + i*l.stride, idx, _mm512_loadu_pd(src + i), sizeof(NumType));
+	}
+	scatter_strided_scalar(dst + i*l.stride, src + i, StridedLayout{l.count - i, 1, l.stride});
+}
+
+#endif
+
+#endif
+
+struct StridedKernels {
+	StridedKernel gather;
+	StridedKernel scatter;
+};
+
+/**
+ * Picks the widest variant current CPU (and OS) supports - AVX2 has no scatter, it stays scalar there
+ */
+StridedKernels select_strided_kernels() {
+	const char* name = "scalar";
+	StridedKernels k = {gather_strided_scalar, scatter_strided_scalar};
+
+	#ifdef HALO_PACK_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f")) {
+		name = "avx512";
+		k = {gather_strided_avx512, scatter_strided_avx512};
+	} else if(__builtin_cpu_supports("avx2")) {
+		name = "avx2";
+		k = {gather_strided_avx2, scatter_strided_scalar};
+	}
+	#endif
+
+	std::cerr << "Halo pack kernel: " << name << std::endl;
+	return k;
+}
+
+const StridedKernels selected_strided_kernels = select_strided_kernels();
+
+/**
+ * Cache line aligned contiguous copy of a strided message - what goes to MPI (as plain NumTypes) instead of the
+ * workspace buffer with a derived datatype. Type signatures match either way, so each side may stage or not.
+ */
+class HaloStage : private NonCopyable {
+public:
+	HaloStage() : layout{0, 0, 0}, buffer(nullptr) {}
+
+	~HaloStage() {
+		std::free(buffer);
+	}
+
+	void init(const StridedLayout& l) {
+		layout = l;
+		const size_t bytes = (l.points()*sizeof(NumType) + ALIGNMENT - 1)/ALIGNMENT*ALIGNMENT;
+		void* p;
+		if(posix_memalign(&p, ALIGNMENT, bytes) != 0) {
+			throw std::bad_alloc();
+		}
+		buffer = static_cast<NumType*>(p);
+	}
+
+	bool active() const {
+		return buffer != nullptr;
+	}
+
+	Coord points() const {
+		return layout.points();
+	}
+
+	NumType* data() {
+		return buffer;
+	}
+
+	/**
+	 * Copies the message starting at src in, returns the staging buffer
+	 */
+	NumType* gather(const NumType* src) {
+		selected_strided_kernels.gather(buffer, src, layout);
+		return buffer;
+	}
+
+	/**
+	 * Copies received message out to its place starting at dst
+	 */
+	void scatter(NumType* dst) {
+		selected_strided_kernels.scatter(dst, buffer, layout);
+	}
+
+private:
+	const static size_t ALIGNMENT = 64;
+
+	StridedLayout layout;
+	NumType* buffer;
+};
+
+/**
+ * Startup micro-benchmark for a message of given datatype and layout: MPI_Pack + MPI_Unpack (what the library does
+ * to a non-contiguous message on both ends) against gather + scatter of the selected kernels. Collective - slowest
+ * rank's timings decide, so that all ranks agree.
+ * @return true if manual packing should be used (always/never unless HaloPacking::AUTO)
+ */
+bool choose_manual_packing(const HaloPacking packing, const MPI_Datatype type, const StridedLayout& l,
+                           const char* name, const MPI_Comm comm, std::ostream& log) {
+	if(packing != HaloPacking::AUTO) {
+		return packing == HaloPacking::MANUAL;
+	}
+
+	/* enough repetitions to take well over the timer resolution, even for corners */
+	const int reps = static_cast<int>(std::max<Coord>(16, (1 << 20)/l.points()));
+
+	std::vector<NumType> field(l.extent());
+	for(Coord i = 0; i < l.extent(); i++) {
+		field[i] = static_cast<NumType>(i);
+	}
+	HaloStage stage;
+	stage.init(l);
+	int packedSize;
+	MPI_Pack_size(1, type, comm, &packedSize);
+	std::vector<char> packed(packedSize);
+
+	auto time = [reps](auto f) {
+		f();
+		const auto start = std::chrono::steady_clock::now();
+		for(int r = 0; r < reps; r++) {
+			f();
+		}
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()/reps;
+	};
+
+	double local[2];
+	local[0] = time([&]() {
+		int pos = 0;
+		MPI_Pack(field.data(), 1, type, packed.data(), packedSize, &pos, comm);
+		pos = 0;
+		MPI_Unpack(packed.data(), packedSize, &pos, field.data(), 1, type, comm);
+	});
+	local[1] = time([&]() {
+		stage.gather(field.data());
+		stage.scatter(field.data());
+	});
+
+	double slowest[2];
+	MPI_Allreduce(local, slowest, 2, MPI_DOUBLE, MPI_MAX, comm);
+
+	const bool manual = slowest[1] < slowest[0];
+	log << "Halo packing of " << name << " (" << l.count << "x" << l.blockLen << "): " << (manual ? "manual" : "datatype")
+	    << ", pack + unpack takes " << slowest[0]*1e6 << " us with datatype, " << slowest[1]*1e6 << " us manual"
+	    << std::endl;
+	return manual;
+}
+
+#endif //LAB1_HALOPACK_H
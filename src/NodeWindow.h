@@ -0,0 +1,139 @@
+//
+// Workspace buffers of ranks sharing a host in one MPI shared memory window - halos copied without MPI messages
+//
+
+#ifndef LAB1_NODEWINDOW_H
+#define LAB1_NODEWINDOW_H
+
+#include <atomic>
+#include <new>
+#include <thread>
+#include <vector>
+#include "shared.h"
+#include "NonCopyable.h"
+
+/**
+ * Every rank allocates its segment of an MPI_Win_allocate_shared window on the communicator of its host
+ * (MPI_Comm_split_type(MPI_COMM_TYPE_SHARED)): two counters followed by `buffers` buffers of bufferLen points.
+ * Peers on the same host can then read each other's buffers directly - bufferLen may differ between ranks.
+ *
+ * Handshake per exchange e (counted from 1 by the caller): producer calls publish(e) once the points its peers
+ * read are written, consumer waits until ready(producer) >= e, copies and calls consume(e); producer must not
+ * overwrite those points before consumed(consumer) >= e. Counters are lock-free std::atomic, so acquire/release
+ * orders buffer accesses across processes as well.
+ */
+class NodeWindow : private NonCopyable {
+public:
+	NodeWindow(const MPI_Comm comm, const Coord bufferLen, const int buffers) : bufferLen(bufferLen) {
+		MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &nodeComm);
+
+		MPI_Group group;
+		MPI_Comm_group(comm, &group);
+		MPI_Group nodeGroup;
+		MPI_Comm_group(nodeComm, &nodeGroup);
+		int size;
+		MPI_Comm_size(comm, &size);
+		std::vector<int> ranks(size);
+		for(int i = 0; i < size; i++) {
+			ranks[i] = i;
+		}
+		nodeRank.resize(size);
+		MPI_Group_translate_ranks(group, size, ranks.data(), nodeGroup, nodeRank.data());
+		MPI_Group_free(&nodeGroup);
+		MPI_Group_free(&group);
+
+		void* base;
+		MPI_Win_allocate_shared(HEADER_SIZE + buffers*bufferLen*sizeof(NumType), 1, MPI_INFO_NULL, nodeComm,
+		                        &base, &win);
+		own = static_cast<char*>(base);
+		new (own) Counters();
+
+		segments.resize(size, nullptr);
+		peerLen.resize(size, 0);
+		for(int r = 0; r < size; r++) {
+			if(on_node(r)) {
+				MPI_Aint segSize;
+				int dispUnit;
+				MPI_Win_shared_query(win, nodeRank[r], &segSize, &dispUnit, &base);
+				segments[r] = static_cast<char*>(base);
+				peerLen[r] = (segSize - HEADER_SIZE)/buffers/sizeof(NumType);
+			}
+		}
+		MPI_Barrier(nodeComm);
+	}
+
+	~NodeWindow() {
+		MPI_Win_free(&win);
+		MPI_Comm_free(&nodeComm);
+	}
+
+	bool on_node(const int rank) const {
+		return nodeRank[rank] != MPI_UNDEFINED;
+	}
+
+	NumType* buffer(const int i) {
+		return buffer_of(own, bufferLen, i);
+	}
+
+	const NumType* peer_buffer(const int rank, const int i) {
+		return buffer_of(segments[rank], peerLen[rank], i);
+	}
+
+	void publish(const long long e) {
+		counters(own).ready.store(e, std::memory_order_release);
+	}
+
+	void consume(const long long e) {
+		counters(own).consumed.store(e, std::memory_order_release);
+	}
+
+	long long ready(const int rank) {
+		return counters(segments[rank]).ready.load(std::memory_order_acquire);
+	}
+
+	long long consumed(const int rank) {
+		return counters(segments[rank]).consumed.load(std::memory_order_acquire);
+	}
+
+	/**
+	 * Spins (yielding - peers may share cores) until pred() holds
+	 */
+	template <typename P>
+	static void wait_until(P pred) {
+		while(!pred()) {
+			std::this_thread::yield();
+		}
+	}
+
+private:
+	struct Counters {
+		std::atomic<long long> ready{0};
+		std::atomic<long long> consumed{0};
+	};
+
+	static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "counters in shared memory must be lock-free");
+
+	/* keeps buffers cache line aligned */
+	const static size_t HEADER_SIZE = 64;
+	static_assert(sizeof(Counters) <= HEADER_SIZE, "counters don't fit the header");
+
+	const Coord bufferLen;
+	MPI_Comm nodeComm;
+	MPI_Win win;
+	char* own;
+	/* rank in comm -> rank in nodeComm, MPI_UNDEFINED if on another host */
+	std::vector<int> nodeRank;
+	/* rank in comm -> its segment mapped into this process (nullptr if on another host) and its bufferLen */
+	std::vector<char*> segments;
+	std::vector<Coord> peerLen;
+
+	Counters& counters(char* seg) {
+		return *reinterpret_cast<Counters*>(seg);
+	}
+
+	NumType* buffer_of(char* seg, const Coord len, const int i) {
+		return reinterpret_cast<NumType*>(seg + HEADER_SIZE) + i*len;
+	}
+};
+
+#endif //LAB1_NODEWINDOW_H
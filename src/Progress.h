@@ -0,0 +1,225 @@
+//
+// MPI progress during the innies sweep - polled by the sweep itself or by a helper thread - and how much of halo
+// transfers it actually hid behind computation
+//
+
+#ifndef LAB1_PROGRESS_H
+#define LAB1_PROGRESS_H
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include "shared.h"
+#include "NonCopyable.h"
+
+/**
+ * Many MPI implementations move a message only inside MPI calls, so halos posted at the end of a step could sit
+ * idle through the whole innies sweep and the overlap would only be apparent. Between begin_overlap() and
+ * end_overlap() this makes sure poll() (non-blocking MPI tests) keeps being called:
+ *  - Progress::POLL - by tick(), which the thread owning MPI calls between rows it computed,
+ *  - Progress::THREAD - by a helper thread every threadInterval. Owning thread makes no MPI call until
+ *    end_overlap() returns, so MPI_THREAD_SERIALIZED is enough.
+ */
+class ProgressEngine : private NonCopyable {
+public:
+	ProgressEngine(const Progress mode, std::function<void()> poll)
+			: mode(mode), poll(poll), sincePoll(0), overlapping(false), polling(false), stopping(false) {
+		if(mode == Progress::THREAD) {
+			helper = std::thread([this]() { helper_loop(); });
+		}
+	}
+
+	~ProgressEngine() {
+		if(helper.joinable()) {
+			{
+				std::lock_guard<std::mutex> lk(m);
+				stopping = true;
+			}
+			cv.notify_all();
+			helper.join();
+		}
+	}
+
+	Progress get_mode() const {
+		return mode;
+	}
+
+	void begin_overlap() {
+		sincePoll = 0;
+
+		if(mode == Progress::THREAD) {
+			{
+				std::lock_guard<std::mutex> lk(m);
+				overlapping = true;
+			}
+			cv.notify_all();
+		}
+	}
+
+	/**
+	 * Returns once the helper thread is out of MPI
+	 */
+	void end_overlap() {
+		if(mode == Progress::THREAD) {
+			std::unique_lock<std::mutex> lk(m);
+			overlapping = false;
+			cv.notify_all();
+			cv.wait(lk, [this]() { return !polling; });
+		}
+	}
+
+	/**
+	 * Thread owning MPI computed another `points` points
+	 */
+	void tick(const Coord points) {
+		if(mode != Progress::POLL) {
+			return;
+		}
+
+		sincePoll += points;
+		if(sincePoll >= POLL_POINTS) {
+			sincePoll = 0;
+			poll();
+		}
+	}
+
+private:
+	/* a few microseconds of stencil work - MPI_Test* costs well below that */
+	const static Coord POLL_POINTS = 4096;
+
+	const Progress mode;
+	const std::function<void()> poll;
+	const std::chrono::microseconds threadInterval{20};
+	Coord sincePoll;
+
+	std::thread helper;
+	std::mutex m;
+	std::condition_variable cv;
+	bool overlapping;
+	bool polling;
+	bool stopping;
+
+	void helper_loop() {
+		std::unique_lock<std::mutex> lk(m);
+
+		while(!stopping) {
+			if(!overlapping) {
+				cv.wait(lk);
+				continue;
+			}
+
+			polling = true;
+			lk.unlock();
+			poll();
+			lk.lock();
+			polling = false;
+			cv.notify_all();
+
+			cv.wait_for(lk, threadInterval, [this]() {
+				return stopping || !overlapping;
+			});
+		}
+	}
+};
+
+/**
+ * MPI_Init_thread() at the thread level progress mode needs - workspace sweeps may be split across a ThreadPool,
+ * but MPI is called only from the main thread, and with Progress::THREAD also from ProgressEngine's helper, which
+ * needs MPI_THREAD_SERIALIZED. If the library doesn't provide that, progress falls back to Progress::POLL.
+ * @return thread level provided
+ */
+inline int init_mpi_for_progress(Progress& progress) {
+	const int required = progress == Progress::THREAD ? MPI_THREAD_SERIALIZED : MPI_THREAD_FUNNELED;
+	int provided;
+	MPI_Init_thread(nullptr, nullptr, required, &provided);
+
+	if(progress == Progress::THREAD && provided < MPI_THREAD_SERIALIZED) {
+		std::cerr << "WARN: MPI library doesn't support MPI_THREAD_SERIALIZED, polling for progress instead" << std::endl;
+		progress = Progress::POLL;
+	}
+	return provided;
+}
+
+/**
+ * Counts exchanges whose receives (sends) were already complete when computation needed them, and time spent
+ * waiting for the rest. Every exchange is: any number of wait() calls, then done().
+ */
+class OverlapStats {
+public:
+	enum Transfer {
+		RECEIVES = 0,
+		SENDS = 1,
+	};
+
+	OverlapStats() : counters{} {}
+
+	/**
+	 * f() blocks until (part of) the transfer completes
+	 */
+	template <typename F>
+	void wait(const Transfer t, F f) {
+		const auto start = std::chrono::steady_clock::now();
+		f();
+		auto& c = counters[t];
+		c.waited += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		c.blocked = true;
+	}
+
+	void done(const Transfer t) {
+		auto& c = counters[t];
+		c.exchanges++;
+		if(!c.blocked) {
+			c.hidden++;
+		}
+		c.blocked = false;
+	}
+
+	/**
+	 * Collective - sums counters of all ranks into root's report
+	 */
+	void reduce(const MPI_Comm comm, const int root = 0) {
+		for(auto& c: counters) {
+			double local[3] = {c.exchanges, c.hidden, c.waited};
+			double total[3];
+			MPI_Reduce(local, total, 3, MPI_DOUBLE, MPI_SUM, root, comm);
+			MPI_Reduce(&c.waited, &c.maxWaited, 1, MPI_DOUBLE, MPI_MAX, root, comm);
+			c.totalExchanges = total[0];
+			c.totalHidden = total[1];
+			c.totalWaited = total[2];
+		}
+		MPI_Comm_size(comm, &ranks);
+	}
+
+	void report(std::ostream& os) const {
+		const char* names[] = {"receives", "sends"};
+
+		os << "Overlap:";
+		for(int t = 0; t < 2; t++) {
+			const auto& c = counters[t];
+			os << " " << names[t] << " hidden in " << c.totalHidden << "/" << c.totalExchanges << " exchanges, waited "
+			   << c.totalWaited/ranks << " s per rank (max " << c.maxWaited << " s);";
+		}
+		os << std::endl;
+	}
+
+private:
+	struct Counters {
+		double exchanges;
+		double hidden;
+		double waited;
+		bool blocked;
+
+		double totalExchanges;
+		double totalHidden;
+		double totalWaited;
+		double maxWaited;
+	};
+
+	Counters counters[2];
+	int ranks = 1;
+};
+
+#endif //LAB1_PROGRESS_H
@@ -0,0 +1,156 @@
+//
+// Fixed size pool of compute threads sharing one rank's workspace sweeps
+//
+
+#ifndef LAB1_THREADPOOL_H
+#define LAB1_THREADPOOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <functional>
+#include "NonCopyable.h"
+
+/**
+ * Calling thread counts as one of the workers, so ThreadPool(1) spawns nothing and runs everything inline.
+ * Workers never call MPI - only the thread which called MPI_Init_thread does (MPI_THREAD_FUNNELED is enough).
+ */
+class ThreadPool : private NonCopyable {
+public:
+	ThreadPool(const int threads)
+			: generation(0), stopping(false), active(0), job(nullptr), jobTasks(0), nextTask(0), pending(0)
+	{
+		for(int i = 1; i < threads; i++) {
+			workers.emplace_back([this]() { worker_loop(); });
+		}
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lk(m);
+			stopping = true;
+		}
+		wake_cv.notify_all();
+
+		for(auto& t: workers) {
+			t.join();
+		}
+	}
+
+	int size() const {
+		return static_cast<int>(workers.size()) + 1;
+	}
+
+	/**
+	 * Runs f(i) for every i from [0, tasks) and returns once all of them finished. f(0) always runs on the calling
+	 * thread, so that task may call MPI.
+	 */
+	template <typename F>
+	void run(const int tasks, F f) {
+		if(workers.empty() || tasks <= 1) {
+			for(int i = 0; i < tasks; i++) {
+				f(i);
+			}
+			return;
+		}
+
+		std::function<void(int)> job_f = [&f](const int i) { f(i); };
+		{
+			std::lock_guard<std::mutex> lk(m);
+			job = &job_f;
+			jobTasks = tasks;
+			pending = tasks;
+			nextTask = 1;
+			generation++;
+		}
+		wake_cv.notify_all();
+
+		run_task(0);
+		work_on_current_job();
+
+		/* workers still inside work_on_current_job() would pick up tasks of the next job with stale counters */
+		std::unique_lock<std::mutex> lk(m);
+		done_cv.wait(lk, [this]() { return pending == 0 && active == 0; });
+		job = nullptr;
+	}
+
+	/**
+	 * Splits [from, to] (inclusive) into one contiguous band per thread and runs f(band_from, band_to) for each
+	 */
+	template <typename F>
+	void run_bands(const long long from, const long long to, F f) {
+		const long long len = to - from + 1;
+		const int bands = static_cast<int>(std::max(std::min<long long>(size(), len), 1LL));
+
+		run(bands, [=, &f](const int b) {
+			f(from + len*b/bands, from + len*(b+1)/bands - 1);
+		});
+	}
+
+private:
+	std::vector<std::thread> workers;
+
+	std::mutex m;
+	std::condition_variable wake_cv;
+	std::condition_variable done_cv;
+	unsigned long generation;
+	bool stopping;
+	int active;
+
+	std::function<void(int)>* job;
+	int jobTasks;
+	std::atomic<int> nextTask;
+	std::atomic<int> pending;
+
+	void worker_loop() {
+		unsigned long seen = 0;
+
+		while(true) {
+			{
+				std::unique_lock<std::mutex> lk(m);
+				wake_cv.wait(lk, [this, seen]() { return stopping || generation != seen; });
+				if(stopping) {
+					return;
+				}
+				seen = generation;
+				/* woke up after the job was already done */
+				if(job == nullptr) {
+					continue;
+				}
+				active++;
+			}
+
+			work_on_current_job();
+
+			{
+				std::lock_guard<std::mutex> lk(m);
+				active--;
+			}
+			done_cv.notify_all();
+		}
+	}
+
+	void work_on_current_job() {
+		while(true) {
+			const int i = nextTask.fetch_add(1);
+			if(i >= jobTasks) {
+				break;
+			}
+
+			run_task(i);
+		}
+	}
+
+	void run_task(const int i) {
+		(*job)(i);
+
+		if(pending.fetch_sub(1) == 1) {
+			std::lock_guard<std::mutex> lk(m);
+			done_cv.notify_all();
+		}
+	}
+};
+
+#endif //LAB1_THREADPOOL_H
@@ -0,0 +1,151 @@
+//
+// Work-stealing scheduler for tiles of a single time step - interior tiles first, edge tiles as their halos arrive
+//
+
+#ifndef LAB1_TILESCHEDULER_H
+#define LAB1_TILESCHEDULER_H
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "NonCopyable.h"
+#include "ThreadPool.h"
+
+/**
+ * Does 5-point stencil evaluated over [x0,x1]x[y0,y1] read anything from [bx0,bx1]x[by0,by1]?
+ * (corners of the one point wide frame around the area are never read)
+ */
+inline bool stencil_reads(const long long x0, const long long x1, const long long y0, const long long y1,
+                          const long long bx0, const long long bx1, const long long by0, const long long by1) {
+	auto overlaps = [=](long long ax0, long long ax1, long long ay0, long long ay1) {
+		return ax0 <= bx1 && bx0 <= ax1 && ay0 <= by1 && by0 <= ay1;
+	};
+
+	return overlaps(x0-1, x1+1, y0, y1) || overlaps(x0, x1, y0-1, y1+1);
+}
+
+/**
+ * Every thread of the pool owns a deque of tasks without dependencies (interior tiles, handed out in contiguous
+ * blocks to keep locality); it pops from its back and, once empty, steals from the front of other deques. Tasks
+ * with dependencies (edge tiles) wait until poll() reports all their bits, then go to a shared ready queue which
+ * idle threads check before stealing.
+ *
+ * poll() is invoked only by the thread which called run() (pool task 0), so it may call MPI - between tiles
+ * and whenever that thread has nothing to do.
+ */
+class TileScheduler : private NonCopyable {
+public:
+	TileScheduler(ThreadPool& pool) : pool(pool), queues(pool.size()) {}
+
+	/**
+	 * Runs f(i) for every task; task i becomes ready once (poll() & deps[i]) == deps[i]
+	 */
+	template <typename F, typename P>
+	void run(const std::vector<unsigned>& deps, F f, P poll) {
+		const int threads = static_cast<int>(queues.size());
+
+		std::vector<int> interior;
+		waiting.clear();
+		for(int i = 0; i < static_cast<int>(deps.size()); i++) {
+			if(deps[i] == 0) {
+				interior.push_back(i);
+			} else {
+				waiting.push_back(i);
+			}
+		}
+
+		const auto n = interior.size();
+		for(int t = 0; t < threads; t++) {
+			auto& q = queues[t];
+			std::lock_guard<std::mutex> lk(q.m);
+			q.tasks.assign(interior.begin() + n*t/threads, interior.begin() + n*(t+1)/threads);
+		}
+
+		remaining = static_cast<int>(deps.size());
+
+		pool.run(threads, [&](const int self) {
+			while(remaining > 0) {
+				if(self == 0 && !waiting.empty()) {
+					release(deps, poll());
+				}
+
+				int task;
+				if(pop_own(self, task) || pop_ready(task) || steal(self, task)) {
+					f(task);
+					remaining--;
+				} else {
+					std::this_thread::yield();
+				}
+			}
+		});
+	}
+
+private:
+	struct TaskQueue {
+		std::mutex m;
+		std::deque<int> tasks;
+	};
+
+	ThreadPool& pool;
+	std::vector<TaskQueue> queues;
+	TaskQueue ready;
+	/* touched only by the polling thread */
+	std::vector<int> waiting;
+	std::atomic<int> remaining;
+
+	void release(const std::vector<unsigned>& deps, const unsigned arrived) {
+		std::lock_guard<std::mutex> lk(ready.m);
+
+		for(auto it = waiting.begin(); it != waiting.end();) {
+			if((deps[*it] & arrived) == deps[*it]) {
+				ready.tasks.push_back(*it);
+				it = waiting.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	bool pop_own(const int self, int& task) {
+		auto& q = queues[self];
+		std::lock_guard<std::mutex> lk(q.m);
+		if(q.tasks.empty()) {
+			return false;
+		}
+
+		task = q.tasks.back();
+		q.tasks.pop_back();
+		return true;
+	}
+
+	bool pop_ready(int& task) {
+		std::lock_guard<std::mutex> lk(ready.m);
+		if(ready.tasks.empty()) {
+			return false;
+		}
+
+		task = ready.tasks.front();
+		ready.tasks.pop_front();
+		return true;
+	}
+
+	bool steal(const int self, int& task) {
+		const int threads = static_cast<int>(queues.size());
+
+		for(int i = 1; i < threads; i++) {
+			auto& q = queues[(self + i) % threads];
+			std::lock_guard<std::mutex> lk(q.m);
+			if(!q.tasks.empty()) {
+				task = q.tasks.front();
+				q.tasks.pop_front();
+				return true;
+			}
+		}
+
+		return false;
+	}
+};
+
+#endif //LAB1_TILESCHEDULER_H
@@ -0,0 +1,298 @@
+//
+// Row kernels for equation() - scalar fallback plus SSE2/AVX2/AVX-512 variants, picked at startup
+//
+
+#ifndef LAB1_KERNELS_H
+#define LAB1_KERNELS_H
+
+#include <cstring>
+#include "shared.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+	#define KERNELS_X86
+#endif
+
+/**
+ * Applies equation() to a contiguous span of len points
+ *
+ * dst points into front buffer, src into back buffer, both at the first point of the span. Neighbours
+ * within the span are at +-1, neighbours from adjacent spans at +-stride. Stencil is symmetric, so it
+ * doesn't matter whether x or y is the contiguous dimension.
+ */
+using RowKernel = void (*)(NumType* __restrict__ dst, const NumType* __restrict__ src, const Coord stride,
+                           const Coord len);
+
+/**
+ * Same as RowKernel, but also returns max |new - old| over the span (see ConvergenceCheck)
+ */
+using ResidualKernel = AccType (*)(NumType* __restrict__ dst, const NumType* __restrict__ src, const Coord stride,
+                                   const Coord len);
+
+inline void equation_row_scalar(NumType* __restrict__ dst, const NumType* __restrict__ src, const Coord stride,
+                                const Coord len) {
+	for(Coord i = 0; i < len; i++) {
+		dst[i] = equation(src[i-1], src[i-stride], src[i+1], src[i+stride]);
+	}
+}
+
+inline AccType equation_residual_scalar(NumType* __restrict__ dst, const NumType* __restrict__ src,
+                                        const Coord stride, const Coord len) {
+	AccType res = 0;
+	for(Coord i = 0; i < len; i++) {
+		dst[i] = equation(src[i-1], src[i-stride], src[i+1], src[i+stride]);
+		res = std::max<AccType>(res, std::abs(static_cast<AccType>(dst[i]) - src[i]));
+	}
+	return res;
+}
+
+#ifdef KERNELS_X86
+
+/*
+ * Per precision building blocks: V128/V256/V512 hold AccType lanes, `*_load` / `*_store` convert them from/to NumType in
+ * memory (mixed precision widens floats to doubles and narrows them back), *_stencil is equation() on whole vectors,
+ * *_absmax(acc, a, b) is lanewise max(acc, |a - b|).
+ */
+
+#ifdef PRECISION_FLOAT
+
+using V128 = __m128;
+using V256 = __m256;
+using V512 = __m512;
+
+__attribute__((target("sse2"))) inline V128 sse2_stencil(V128 l, V128 r, V128 d, V128 u) {
+	return _mm_mul_ps(_mm_set1_ps(0.25f), _mm_add_ps(_mm_add_ps(_mm_add_ps(l, r), d), u));
+}
+__attribute__((target("avx2"))) inline V256 avx2_stencil(V256 l, V256 r, V256 d, V256 u) {
+	return _mm256_mul_ps(_mm256_set1_ps(0.25f), _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(l, r), d), u));
+}
+__attribute__((target("avx512f"))) inline V512 avx512_stencil(V512 l, V512 r, V512 d, V512 u) {
+	return _mm512_mul_ps(_mm512_set1_ps(0.25f), _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(l, r), d), u));
+}
+
+__attribute__((target("sse2"))) inline V128 sse2_zero() { return _mm_setzero_ps(); }
+__attribute__((target("avx2"))) inline V256 avx2_zero() { return _mm256_setzero_ps(); }
+__attribute__((target("avx512f"))) inline V512 avx512_zero() { return _mm512_setzero_ps(); }
+
+__attribute__((target("sse2"))) inline V128 sse2_absmax(V128 acc, V128 a, V128 b) {
+	return _mm_max_ps(acc, _mm_max_ps(_mm_sub_ps(a, b), _mm_sub_ps(b, a)));
+}
+__attribute__((target("avx2"))) inline V256 avx2_absmax(V256 acc, V256 a, V256 b) {
+	return _mm256_max_ps(acc, _mm256_max_ps(_mm256_sub_ps(a, b), _mm256_sub_ps(b, a)));
+}
+__attribute__((target("avx512f"))) inline V512 avx512_absmax(V512 acc, V512 a, V512 b) {
+	return _mm512_max_ps(acc, _mm512_max_ps(_mm512_sub_ps(a, b), _mm512_sub_ps(b, a)));
+}
+
+__attribute__((target("sse2"))) inline V128 sse2_load(const NumType* p) { return _mm_loadu_ps(p); }
+__attribute__((target("avx2"))) inline V256 avx2_load(const NumType* p) { return _mm256_loadu_ps(p); }
+__attribute__((target("avx512f"))) inline V512 avx512_load(const NumType* p) { return _mm512_loadu_ps(p); }
+
+__attribute__((target("sse2"))) inline void sse2_store(NumType* p, V128 v) { _mm_storeu_ps(p, v); }
+__attribute__((target("avx2"))) inline void avx2_store(NumType* p, V256 v) { _mm256_storeu_ps(p, v); }
+__attribute__((target("avx512f"))) inline void avx512_store(NumType* p, V512 v) { _mm512_storeu_ps(p, v); }
+
+#else
+
+using V128 = __m128d;
+using V256 = __m256d;
+using V512 = __m512d;
+
+__attribute__((target("sse2"))) inline V128 sse2_stencil(V128 l, V128 r, V128 d, V128 u) {
+	return _mm_mul_pd(_mm_set1_pd(0.25), _mm_add_pd(_mm_add_pd(_mm_add_pd(l, r), d), u));
+}
+__attribute__((target("avx2"))) inline V256 avx2_stencil(V256 l, V256 r, V256 d, V256 u) {
+	return _mm256_mul_pd(_mm256_set1_pd(0.25), _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(l, r), d), u));
+}
+__attribute__((target("avx512f"))) inline V512 avx512_stencil(V512 l, V512 r, V512 d, V512 u) {
+	return _mm512_mul_pd(_mm512_set1_pd(0.25), _mm512_add_pd(_mm512_add_pd(_mm512_add_pd(l, r), d), u));
+}
+
+__attribute__((target("sse2"))) inline V128 sse2_zero() { return _mm_setzero_pd(); }
+__attribute__((target("avx2"))) inline V256 avx2_zero() { return _mm256_setzero_pd(); }
+__attribute__((target("avx512f"))) inline V512 avx512_zero() { return _mm512_setzero_pd(); }
+
+__attribute__((target("sse2"))) inline V128 sse2_absmax(V128 acc, V128 a, V128 b) {
+	return _mm_max_pd(acc, _mm_max_pd(_mm_sub_pd(a, b), _mm_sub_pd(b, a)));
+}
+__attribute__((target("avx2"))) inline V256 avx2_absmax(V256 acc, V256 a, V256 b) {
+	return _mm256_max_pd(acc, _mm256_max_pd(_mm256_sub_pd(a, b), _mm256_sub_pd(b, a)));
+}
+__attribute__((target("avx512f"))) inline V512 avx512_absmax(V512 acc, V512 a, V512 b) {
+	return _mm512_max_pd(acc, _mm512_max_pd(_mm512_sub_pd(a, b), _mm512_sub_pd(b, a)));
+}
+
+#ifdef PRECISION_MIXED
+
+__attribute__((target("sse2"))) inline V128 sse2_load(const NumType* p) {
+	return _mm_cvtps_pd(_mm_loadl_pi(_mm_setzero_ps(), reinterpret_cast<const __m64*>(p)));
+}
+__attribute__((target("avx2"))) inline V256 avx2_load(const NumType* p) { return _mm256_cvtps_pd(_mm_loadu_ps(p)); }
+__attribute__((target("avx512f"))) inline V512 avx512_load(const NumType* p) {
+	return _mm512_cvtps_pd(_mm256_loadu_ps(p));
+}
+
+__attribute__((target("sse2"))) inline void sse2_store(NumType* p, V128 v) {
+	_mm_storel_pi(reinterpret_cast<__m64*>(p), _mm_cvtpd_ps(v));
+}
+__attribute__((target("avx2"))) inline void avx2_store(NumType* p, V256 v) { _mm_storeu_ps(p, _mm256_cvtpd_ps(v)); }
+__attribute__((target("avx512f"))) inline void avx512_store(NumType* p, V512 v) {
+	_mm256_storeu_ps(p, _mm512_cvtpd_ps(v));
+}
+
+#else
+
+__attribute__((target("sse2"))) inline V128 sse2_load(const NumType* p) { return _mm_loadu_pd(p); }
+__attribute__((target("avx2"))) inline V256 avx2_load(const NumType* p) { return _mm256_loadu_pd(p); }
+__attribute__((target("avx512f"))) inline V512 avx512_load(const NumType* p) { return _mm512_loadu_pd(p); }
+
+__attribute__((target("sse2"))) inline void sse2_store(NumType* p, V128 v) { _mm_storeu_pd(p, v); }
+__attribute__((target("avx2"))) inline void avx2_store(NumType* p, V256 v) { _mm256_storeu_pd(p, v); }
+__attribute__((target("avx512f"))) inline void avx512_store(NumType* p, V512 v) { _mm512_storeu_pd(p, v); }
+
+#endif
+
+#endif
+
+/*
+ * All vector variants add neighbours in the same order as equation() does (along the span first), so
+ * results are bit-identical with the scalar version when the span runs along x. Unaligned loads are used
+ * everywhere - spans start at arbitrary points of the workspace.
+ */
+
+#define ROW_KERNEL_BODY(ISA, V, TAIL) \
+	const Coord lanes = sizeof(V)/sizeof(AccType); \
+	Coord i = 0; \
+	for(; i + lanes <= len; i += lanes) { \
+		auto l = ISA##_load(src + i - 1); \
+		auto r = ISA##_load(src + i + 1); \
+		auto d = ISA##_load(src + i - stride); \
+		auto u = ISA##_load(src + i + stride); \
+		ISA##_store(dst + i, ISA##_stencil(l, r, d, u)); \
+	} \
+	TAIL(dst + i, src + i, stride, len - i);
+
+#define RESIDUAL_KERNEL_BODY(ISA, V, TAIL) \
+	const Coord lanes = sizeof(V)/sizeof(AccType); \
+	V res = ISA##_zero(); \
+	Coord i = 0; \
+	for(; i + lanes <= len; i += lanes) { \
+		auto l = ISA##_load(src + i - 1); \
+		auto r = ISA##_load(src + i + 1); \
+		auto d = ISA##_load(src + i - stride); \
+		auto u = ISA##_load(src + i + stride); \
+		auto v = ISA##_stencil(l, r, d, u); \
+		res = ISA##_absmax(res, v, ISA##_load(src + i)); \
+		ISA##_store(dst + i, v); \
+	} \
+	AccType lane[sizeof(V)/sizeof(AccType)]; \
+	memcpy(lane, &res, sizeof(res)); \
+	AccType tail = TAIL(dst + i, src + i, stride, len - i); \
+	for(Coord j = 0; j < lanes; j++) { \
+		tail = std::max(tail, lane[j]); \
+	} \
+	return tail;
+
+__attribute__((target("sse2")))
+void equation_row_sse2(NumType* __restrict__ dst, const NumType* __restrict__ src, const Coord stride,
+                       const Coord len) {
+	ROW_KERNEL_BODY(sse2, V128, equation_row_scalar)
+}
+
+__attribute__((target("avx2")))
+void equation_row_avx2(NumType* __restrict__ dst, const NumType* __restrict__ src, const Coord stride,
+                       const Coord len) {
+	ROW_KERNEL_BODY(avx2, V256, equation_row_sse2)
+}
+
+__attribute__((target("avx512f")))
+void equation_row_avx512(NumType* __restrict__ dst, const NumType* __restrict__ src, const Coord stride,
+                         const Coord len) {
+	ROW_KERNEL_BODY(avx512, V512, equation_row_avx2)
+}
+
+__attribute__((target("sse2")))
+AccType equation_residual_sse2(NumType* __restrict__ dst, const NumType* __restrict__ src, const Coord stride,
+                               const Coord len) {
+	RESIDUAL_KERNEL_BODY(sse2, V128, equation_residual_scalar)
+}
+
+__attribute__((target("avx2")))
+AccType equation_residual_avx2(NumType* __restrict__ dst, const NumType* __restrict__ src, const Coord stride,
+                               const Coord len) {
+	RESIDUAL_KERNEL_BODY(avx2, V256, equation_residual_sse2)
+}
+
+__attribute__((target("avx512f")))
+AccType equation_residual_avx512(NumType* __restrict__ dst, const NumType* __restrict__ src, const Coord stride,
+                                 const Coord len) {
+	RESIDUAL_KERNEL_BODY(avx512, V512, equation_residual_avx2)
+}
+
+#undef ROW_KERNEL_BODY
+#undef RESIDUAL_KERNEL_BODY
+
+#endif
+
+struct RowKernels {
+	RowKernel row;
+	ResidualKernel residual;
+};
+
+/**
+ * Picks the widest variant current CPU (and OS) supports
+ */
+RowKernels select_row_kernels() {
+	const char* name = "scalar";
+	RowKernels k = {equation_row_scalar, equation_residual_scalar};
+
+	#ifdef KERNELS_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f")) {
+		name = "avx512";
+		k = {equation_row_avx512, equation_residual_avx512};
+	} else if(__builtin_cpu_supports("avx2")) {
+		name = "avx2";
+		k = {equation_row_avx2, equation_residual_avx2};
+	} else if(__builtin_cpu_supports("sse2")) {
+		name = "sse2";
+		k = {equation_row_sse2, equation_residual_sse2};
+	}
+	#endif
+
+	std::cerr << "Row kernel: " << name << std::endl;
+	return k;
+}
+
+const RowKernels selected_row_kernels = select_row_kernels();
+
+/**
+ * Red-black SOR update of a single colour along a row: v[0], v[2], ... v[len-1] are relaxed in place (all their
+ * neighbours, at +-1 and +-stride, are of the other colour)
+ * @return max |new - old| over updated points
+ */
+inline AccType sor_row(NumType* v, const Coord stride, const Coord len, const AccType omega) {
+	AccType res = 0;
+	for(Coord i = 0; i < len; i += 2) {
+		const AccType old = v[i];
+		const AccType delta = omega*(static_cast<AccType>(equation(v[i-1], v[i-stride], v[i+1], v[i+stride])) - old);
+		v[i] = old + delta;
+		res = std::max<AccType>(res, std::abs(delta));
+	}
+	return res;
+}
+
+inline void equation_row(NumType* __restrict__ dst, const NumType* __restrict__ src, const Coord stride,
+                         const Coord len) {
+	selected_row_kernels.row(dst, src, stride, len);
+}
+
+/**
+ * equation_row() which also returns max |new - old| over the span
+ */
+inline AccType equation_row_residual(NumType* __restrict__ dst, const NumType* __restrict__ src, const Coord stride,
+                                     const Coord len) {
+	return selected_row_kernels.residual(dst, src, stride, len);
+}
+
+#endif //LAB1_KERNELS_H
@@ -5,6 +5,9 @@
 #include <cmath>
 #include <cstring>
 #include "shared.h"
+#include "kernels.h"
+#include "Convergence.h"
+#include "ThreadPool.h"
 
 /**
  * ToDo
@@ -22,15 +25,23 @@ enum Neighbour {
 
 class ClusterManager {
 public:
-	ClusterManager(const Coord N) : bitBucket(0) {
-		MPI_Init(nullptr, nullptr);
+	ClusterManager(const Coord N, const Decomposition decomposition, const Placement placement) : bitBucket(0) {
+		/* workspace sweeps may be split across a ThreadPool, but MPI is called only from the main thread */
+		int threadSupport;
+		MPI_Init_thread(nullptr, nullptr, MPI_THREAD_FUNNELED, &threadSupport);
+		MPI_Comm_size(MPI_COMM_WORLD, &nodeCount);
+
+		partitioner = new Partitioner(nodeCount, 0.0, 1.0, N, decomposition);
+		gridRows = partitioner->get_nodes_grid_rows();
+		gridColumns = partitioner->get_nodes_grid_columns();
+		comm = placed_comm(placement, gridRows, gridColumns, std::cerr);
 		MPI_Comm_rank(comm, &nodeId);
-		MPI_Comm_size(comm, &nodeCount);
-
-		partitioner = new Partitioner(nodeCount, 0.0, 1.0, N);
-		sideLen = partitioner->get_nodes_grid_dimm();
 		std::tie(row, column) = partitioner->node_id_to_grid_pos(nodeId);
 
+		if(threadSupport < MPI_THREAD_FUNNELED) {
+			err_log() << "WARN: MPI library doesn't support MPI_THREAD_FUNNELED, use single thread per rank" << std::endl;
+		}
+
 		initNeighbours();
 
 		err_log() << "Cluster initialized successfully. I'm (" << row << "," << column << ")" << std::endl;
@@ -38,6 +49,7 @@ public:
 
 	~ClusterManager() {
 		delete partitioner;
+		MPI_Comm_free(&comm);
 		MPI_Finalize();
 	}
 
@@ -46,6 +58,10 @@ public:
 	int getNodeCount() { return nodeCount; }
 	int getNodeId() { return nodeId; }
 	std::pair<NumType, NumType> getOffsets() { return partitioner->get_math_offset_node(row, column); };
+	/* points of this node along x and y */
+	std::pair<Coord, Coord> getInnerSize() {
+		return std::make_pair(partitioner->get_n_columns(column), partitioner->get_n_rows(row));
+	}
 	MPI_Comm getComm() { return comm; }
 
 	std::ostream& err_log() {
@@ -68,7 +84,8 @@ public:
 
 
 private:
-	const static auto comm = MPI_COMM_WORLD;
+	/* ranks renumbered so that rank is the node id, see placed_comm() */
+	MPI_Comm comm;
 
 	int nodeId;
 	int nodeCount;
@@ -77,22 +94,23 @@ private:
 
 	Partitioner *partitioner;
 
-	int sideLen;
+	int gridRows;
+	int gridColumns;
 	int neighbours[4];
 
 	std::ostream bitBucket;
 
 	void initNeighbours() {
 		if(row == 0) { neighbours[Neighbour::BOTTOM] = N_INVALID; }
-		else { neighbours[Neighbour::BOTTOM] = nodeId-sideLen; }
+		else { neighbours[Neighbour::BOTTOM] = nodeId-gridColumns; }
 
-		if(row == sideLen-1) { neighbours[Neighbour::TOP] = N_INVALID; }
-		else { neighbours[Neighbour::TOP] = nodeId+sideLen; }
+		if(row == gridRows-1) { neighbours[Neighbour::TOP] = N_INVALID; }
+		else { neighbours[Neighbour::TOP] = nodeId+gridColumns; }
 
 		if(column == 0) { neighbours[Neighbour::LEFT] = N_INVALID; }
 		else { neighbours[Neighbour::LEFT] = nodeId-1; }
 
-		if(column == sideLen-1) { neighbours[Neighbour::RIGHT] = N_INVALID; }
+		if(column == gridColumns-1) { neighbours[Neighbour::RIGHT] = N_INVALID; }
 		else { neighbours[Neighbour::RIGHT] = nodeId+1; }
 
 		err_log() << "Neighbours: "
@@ -103,20 +121,47 @@ private:
 	}
 };
 
+/**
+ * With HaloExchange::PERSISTENT exchange() only records the requests - built on the first step, as neighbours and
+ * edge buffers never change - and wait() starts them all at once
+ */
 class Comms {
 public:
-	Comms(const Coord innerLength) : innerLength(innerLength) {
+	Comms(const MPI_Comm comm, const HaloExchange mode)
+			: comm(comm), persistent(mode == HaloExchange::PERSISTENT), initialized(0) {
+		require_halo_exchange(mode, {HaloExchange::P2P, HaloExchange::PERSISTENT});
+
+		for(int i = 0; i < RQ_COUNT; i++) {
+			rq[i] = MPI_REQUEST_NULL;
+		}
 		reset();
 	}
 
-	void exchange(int targetId, NumType* sendBuffer, NumType* receiveBuffer) {
-		MPI_Isend(sendBuffer, innerLength, NUM_MPI_DT, targetId, 1, MPI_COMM_WORLD, rq + nextId);
-		MPI_Irecv(receiveBuffer, innerLength, NUM_MPI_DT, targetId, MPI_ANY_TAG, MPI_COMM_WORLD, rq + nextId + 1);
+	~Comms() {
+		for(int i = 0; i < initialized; i++) {
+			MPI_Request_free(rq + i);
+		}
+	}
+
+	void exchange(int targetId, NumType* sendBuffer, NumType* receiveBuffer, const Coord length) {
+		if(!persistent) {
+			MPI_Isend(sendBuffer, length, NUM_MPI_DT, targetId, 1, comm, rq + nextId);
+			MPI_Irecv(receiveBuffer, length, NUM_MPI_DT, targetId, MPI_ANY_TAG, comm, rq + nextId + 1);
+		} else if(nextId == initialized) {
+			MPI_Send_init(sendBuffer, length, NUM_MPI_DT, targetId, 1, comm, rq + nextId);
+			MPI_Recv_init(receiveBuffer, length, NUM_MPI_DT, targetId, MPI_ANY_TAG, comm,
+			              rq + nextId + 1);
+			initialized += 2;
+		}
 
 		nextId += 2;
 	}
 
 	void wait() {
+		if(persistent) {
+			MPI_Startall(nextId, rq);
+		}
+
 		DL( "NextId: " << nextId )
 		for(int i = 0; i < nextId; i++) {
 			int finished;
@@ -127,24 +172,31 @@ public:
 	}
 
 	void reset() {
-		for(int i = 0; i < RQ_COUNT; i++) {
-			rq[i] = MPI_REQUEST_NULL;
+		if(!persistent) {
+			for(int i = 0; i < RQ_COUNT; i++) {
+				rq[i] = MPI_REQUEST_NULL;
+			}
 		}
 		nextId = 0;
 	}
 
 private:
 	const static int RQ_COUNT = 8;
-	const Coord innerLength;
+	const MPI_Comm comm;
+	const bool persistent;
 	MPI_Request rq[RQ_COUNT];
 	int nextId;
+	/* persistent requests built so far */
+	int initialized;
 };
 
 
 class Workspace {
 public:
-	Workspace(const Coord innerSize, const NumType borderCond, ClusterManager& cm, Comms& comm)
-			: innerLength(innerSize), actualSize(innerSize*innerSize), cm(cm), borderCond(borderCond), comm(comm)
+	Workspace(const Coord innerWidth, const Coord innerHeight, const NumType borderCond, ClusterManager& cm,
+	          Comms& comm, const TileShape& tile, ThreadPool& pool)
+			: innerWidth(innerWidth), innerHeight(innerHeight), actualSize(innerWidth*innerHeight), cm(cm),
+			  borderCond(borderCond), comm(comm), tile(tile), pool(pool)
 	{
 		neigh = cm.getNeighbours();
 		fillBuffers();
@@ -156,7 +208,7 @@ public:
 
 	void set_elf(const Coord x, const Coord y, const NumType value) {
 		// copying to send buffers occurs during comms phase
-		front[x*innerLength+y] = value;
+		front[x*innerHeight+y] = value;
 	}
 
 	NumType elb(const Coord x, const Coord y) {
@@ -164,7 +216,7 @@ public:
 			if(y == -1) {
 				// conrner - invalid query, we never ask about it
 				throw std::runtime_error("corner access!");
-			} else if (y == innerLength) {
+			} else if (y == innerHeight) {
 				// corner - invalid query
 				throw std::runtime_error("corner access!");
 			} else {
@@ -175,11 +227,11 @@ public:
 					return borderCond;
 				}
 			}	
-		} else if (x == innerLength) {
+		} else if (x == innerWidth) {
 			if(y == -1) {
 				// conrner - invalid query, we never ask about it
 				throw std::runtime_error("corner access!");
-			} else if (y == innerLength) {
+			} else if (y == innerHeight) {
 				// corner - invalid query
 				throw std::runtime_error("corner access!");
 			} else {
@@ -197,7 +249,7 @@ public:
 				} else {
 					return borderCond;
 				}
-			} else if (y == innerLength) {
+			} else if (y == innerHeight) {
 				if(neigh[TOP] != N_INVALID) {
 					return outerEdge[TOP][x];
 				} else {
@@ -205,12 +257,27 @@ public:
 				}
 			} else {
 				// coords within main area
-				return back[x*innerLength+y];
+				return back[x*innerHeight+y];
 			}
 		}
 	}
 
-	Coord getInnerLength() {return innerLength;}
+	Coord getInnerWidth() {return innerWidth;}
+	Coord getInnerHeight() {return innerHeight;}
+
+	/**
+	 * Calls k(dst, src, stride, len) for every column of the work area (tile after tile), skipping the outermost
+	 * points - their neighbours live in outerEdge buffers, so they must go through elb()
+	 */
+	template <typename K>
+	void iterate_over_inner_spans(K k) {
+		pool.run_bands(1, innerWidth-2, [this, &k](const Coord x_from, const Coord x_to) {
+			iterate_over_tiled_spans(1, innerHeight-2, x_from, x_to, tile,
+				[this, &k](const Coord y_idx, const Coord x_idx, const Coord len) {
+					k(elAddress(x_idx, y_idx, front), elAddress(x_idx, y_idx, back), innerHeight, len);
+				});
+		});
+	}
 
 	void swap(bool comms = true) {
 		if(comms) {
@@ -220,7 +287,7 @@ public:
 			for(int i = 0; i < 4; i++) {
 				auto iThNeigh = neigh[i];
 				if(iThNeigh != N_INVALID) {
-					comm.exchange(iThNeigh, innerEdge[i], outerEdge[i]);
+					comm.exchange(iThNeigh, innerEdge[i], outerEdge[i], edge_length(i));
 				}
 			}
 			comm.wait();
@@ -234,15 +301,19 @@ private:
 	Comms& comm;
 	int* neigh;
 
-	const Coord innerLength;
+	const Coord innerWidth;
+	const Coord innerHeight;
 	const Coord actualSize;
 
 	const NumType borderCond;
+	const TileShape tile;
+	ThreadPool& pool;
 
 	/* horizontal could be stored with main buffer, but for convenience both horizontals and
 	 * verticals are allocated separatelly (and writes mirrored) */
 	NumType* innerEdge[4];
-	/* all outer edges are allocated separatelly; their length is innerLength, not innerLength + 2 */
+	/* all outer edges are allocated separatelly; their length is innerHeight (left, right) or innerWidth (top,
+	 * bottom), without corners */
 	NumType* outerEdge[4];
 	NumType *front;
 	NumType *back;
@@ -253,8 +324,8 @@ private:
 
 		for(int i = 0; i < 4; i++) {
 			if(neigh[i] != N_INVALID) {
-				innerEdge[i] = new NumType[innerLength];
-				outerEdge[i] = new NumType[innerLength];
+				innerEdge[i] = new NumType[edge_length(i)];
+				outerEdge[i] = new NumType[edge_length(i)];
 			} else {
 				innerEdge[i] = nullptr;
 				outerEdge[i] = nullptr;
@@ -278,7 +349,11 @@ private:
 	}
 
 	NumType* elAddress(const Coord x, const Coord y, NumType* base) {
-		return base + innerLength*x + y;
+		return base + innerHeight*x + y;
+	}
+
+	Coord edge_length(const int edge) {
+		return (edge == LEFT || edge == RIGHT) ? innerHeight : innerWidth;
 	}
 
 	void swapBuffers() {
@@ -290,15 +365,15 @@ private:
 	void copyInnerEdgesToBuffers() {
 		#define LOOP(EDGE, X, Y, BUFF) \
 		if(neigh[EDGE] != N_INVALID) { \
-			for(Coord i = 0; i < innerLength; i++) { \
+			for(Coord i = 0; i < edge_length(EDGE); i++) { \
 				innerEdge[EDGE][i] = *elAddress(X,Y,BUFF); \
 			} \
 		}
 
-		LOOP(TOP, i, innerLength-1, front)
+		LOOP(TOP, i, innerHeight-1, front)
 		LOOP(BOTTOM, i, 0, front)
 		LOOP(LEFT, 0, i, front)
-		LOOP(RIGHT, innerLength-1, i, front)
+		LOOP(RIGHT, innerWidth-1, i, front)
 
 		#undef LOOP
 	}
@@ -315,17 +390,21 @@ int main(int argc, char **argv) {
 
 	auto conf = parse_cli(argc, argv);
 
-	ClusterManager cm(conf.N);
-	auto n_slice = cm.getPartitioner().get_n_slice();
+	ClusterManager cm(conf.N, conf.decomposition, conf.placement);
+	Coord width, height;
+	std::tie(width, height) = cm.getInnerSize();
 	NumType x_offset, y_offset;
 	std::tie(x_offset, y_offset) = cm.getOffsets();
 	auto h = cm.getPartitioner().get_h();
 
-	Comms comm(n_slice);
-	Workspace w(n_slice, 0.0, cm, comm);
+	require_halo_depth(conf.haloDepth, 1);
+	require_fixed_partition(conf.rebalanceEvery);
+	Comms comm(cm.getComm(), conf.haloExchange);
+	ThreadPool pool(conf.threads);
+	Workspace w(width, height, 0.0, cm, comm, conf.tile, pool);
 
 	FileDumper<Workspace> d(filenameGenerator(cm.getNodeId()),
-	                        n_slice,
+	                        width,
 	                        x_offset,
 	                        y_offset,
 	                        h,
@@ -336,8 +415,8 @@ int main(int argc, char **argv) {
 	MPI_Barrier(cm.getComm());
 	timer.start();
 
-	for(Coord x_idx = 0; x_idx < n_slice; x_idx++) {
-		for(Coord y_idx = 0; y_idx < n_slice; y_idx++) {
+	for(Coord x_idx = 0; x_idx < width; x_idx++) {
+		for(Coord y_idx = 0; y_idx < height; y_idx++) {
 			auto x = x_offset + x_idx*h;
 			auto y = y_offset + y_idx*h;
 			auto val = f(x,y);
@@ -353,24 +432,43 @@ int main(int argc, char **argv) {
 
 	w.swap();
 
+	ConvergenceCheck conv(conf, cm.getComm());
+	auto row_f = [&conv](NumType* dst, const NumType* src, const Coord stride, const Coord len) {
+		if(conv.measuring()) {
+			conv.add(equation_row_residual(dst, src, stride, len));
+		} else {
+			equation_row(dst, src, stride, len);
+		}
+	};
+
+	auto eq_f = [&w, &conv](const Coord x_idx, const Coord y_idx) {
+		auto eq_val = equation(
+				w.elb(x_idx - 1, y_idx),
+				w.elb(x_idx, y_idx - 1),
+				w.elb(x_idx + 1, y_idx),
+				w.elb(x_idx, y_idx + 1)
+		);
+
+		if(conv.measuring()) {
+			conv.add(std::abs(static_cast<AccType>(eq_val) - w.elb(x_idx, y_idx)));
+		}
+		w.set_elf(x_idx, y_idx, eq_val);
+	};
+
 	for(TimeStepCount ts = 0; ts < conf.timeSteps; ts++) {
 		DL( "Entering timestep loop, ts = " << ts )
 
-		for(Coord x_idx = 0; x_idx < n_slice; x_idx++) {
-			DL( "Entering X loop, x = " << x_idx )
-
-			for(Coord y_idx = 0; y_idx < n_slice; y_idx++) {
-				DL( "Entering Y loop, x y " << y_idx )
-
-				auto eq_val = equation(
-						w.elb(x_idx - 1, y_idx),
-						w.elb(x_idx, y_idx - 1),
-						w.elb(x_idx + 1, y_idx),
-						w.elb(x_idx, y_idx + 1)
-				);
+		conv.begin_sweep(ts, ts);
+		w.iterate_over_inner_spans(row_f);
 
-				w.set_elf(x_idx, y_idx, eq_val);
-			}
+		/* remaining one point wide frame */
+		for(Coord i = 0; i < height; i++) {
+			eq_f(0, i);
+			eq_f(width - 1, i);
+		}
+		for(Coord i = 1; i < width - 1; i++) {
+			eq_f(i, 0);
+			eq_f(i, height - 1);
 		}
 
 		DL( "Before swap, ts = " << ts )
@@ -384,6 +482,10 @@ int main(int argc, char **argv) {
 		}
 
 		DL( "After dump, ts = " << ts )
+
+		if(conv.end_sweep(ts + 1)) {
+			break;
+		}
 	}
 
 	MPI_Barrier(cm.getComm());
@@ -391,6 +493,7 @@ int main(int argc, char **argv) {
 
 	if(cm.getNodeId() == 0) {
 		print_result("parallel", cm.getNodeCount(), duration, conf);
+		conv.report(std::cerr);
 		std::cerr << ((double)duration)/1000000000 << " s" << std::endl;
 	}
 
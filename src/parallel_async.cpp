@@ -4,7 +4,15 @@
 #include <iostream>
 #include <cmath>
 #include <cstring>
+#include <map>
+#include <tuple>
 #include "shared.h"
+#include "kernels.h"
+#include "Convergence.h"
+#include "ThreadPool.h"
+#include "TileScheduler.h"
+#include "HaloArrival.h"
+#include "Progress.h"
 
 const int N_INVALID = -1;
 
@@ -15,17 +23,32 @@ enum Neighbour {
 	BOTTOM = 3,
 };
 
+/* [n][0] - x, [n][1] - y direction in which neighbour n (and its halo) lies */
+const int neighbourDirection[4][2] = {
+		{-1, +0}, // LEFT
+		{+0, +1}, // TOP
+		{+1, +0}, // RIGHT
+		{+0, -1}, // BOTTOM
+};
+
 class ClusterManager : private NonCopyable {
 public:
-	ClusterManager(const Coord N) : bitBucket(0) {
-		MPI_Init(nullptr, nullptr);
+	ClusterManager(const Coord N, const Decomposition decomposition, const Placement placement,
+	               Progress& progress) : bitBucket(0) {
+		const int threadSupport = init_mpi_for_progress(progress);
+		MPI_Comm_size(MPI_COMM_WORLD, &nodeCount);
+
+		partitioner = new Partitioner(nodeCount, 0.0, 1.0, N, decomposition);
+		gridRows = partitioner->get_nodes_grid_rows();
+		gridColumns = partitioner->get_nodes_grid_columns();
+		comm = placed_comm(placement, gridRows, gridColumns, std::cerr);
 		MPI_Comm_rank(comm, &nodeId);
-		MPI_Comm_size(comm, &nodeCount);
-
-		partitioner = new Partitioner(nodeCount, 0.0, 1.0, N);
-		sideLen = partitioner->get_nodes_grid_dimm();
 		std::tie(row, column) = partitioner->node_id_to_grid_pos(nodeId);
 
+		if(threadSupport < MPI_THREAD_FUNNELED) {
+			err_log() << "WARN: MPI library doesn't support MPI_THREAD_FUNNELED, use single thread per rank" << std::endl;
+		}
+
 		initNeighbours();
 
 		err_log() << "Cluster initialized successfully. I'm (" << row << "," << column << ")" << std::endl;
@@ -33,6 +56,7 @@ public:
 
 	~ClusterManager() {
 		delete partitioner;
+		MPI_Comm_free(&comm);
 		MPI_Finalize();
 	}
 
@@ -41,6 +65,10 @@ public:
 	int getNodeCount() { return nodeCount; }
 	int getNodeId() { return nodeId; }
 	std::pair<NumType, NumType> getOffsets() { return partitioner->get_math_offset_node(row, column); };
+	/* points of this node along x and y */
+	std::pair<Coord, Coord> getInnerSize() {
+		return std::make_pair(partitioner->get_n_columns(column), partitioner->get_n_rows(row));
+	}
 	MPI_Comm getComm() { return comm; }
 
 	std::ostream& err_log() {
@@ -61,7 +89,8 @@ public:
 
 
 private:
-	const static auto comm = MPI_COMM_WORLD;
+	/* ranks renumbered so that rank is the node id, see placed_comm() */
+	MPI_Comm comm;
 
 	int nodeId;
 	int nodeCount;
@@ -70,22 +99,23 @@ private:
 
 	Partitioner *partitioner;
 
-	int sideLen;
+	int gridRows;
+	int gridColumns;
 	int neighbours[4];
 
 	std::ostream bitBucket;
 
 	void initNeighbours() {
 		if(row == 0) { neighbours[Neighbour::BOTTOM] = N_INVALID; }
-		else { neighbours[Neighbour::BOTTOM] = nodeId-sideLen; }
+		else { neighbours[Neighbour::BOTTOM] = nodeId-gridColumns; }
 
-		if(row == sideLen-1) { neighbours[Neighbour::TOP] = N_INVALID; }
-		else { neighbours[Neighbour::TOP] = nodeId+sideLen; }
+		if(row == gridRows-1) { neighbours[Neighbour::TOP] = N_INVALID; }
+		else { neighbours[Neighbour::TOP] = nodeId+gridColumns; }
 
 		if(column == 0) { neighbours[Neighbour::LEFT] = N_INVALID; }
 		else { neighbours[Neighbour::LEFT] = nodeId-1; }
 
-		if(column == sideLen-1) { neighbours[Neighbour::RIGHT] = N_INVALID; }
+		if(column == gridColumns-1) { neighbours[Neighbour::RIGHT] = N_INVALID; }
 		else { neighbours[Neighbour::RIGHT] = nodeId+1; }
 
 		err_log() << "Neighbours: "
@@ -131,9 +161,16 @@ private:
  *
  */
 
+/**
+ * With HaloExchange::PERSISTENT every distinct (buffer, peer, datatype) gets MPI_Send_init/MPI_Recv_init request
+ * once, schedule_* only queue them and start_scheduled() starts the queue with MPI_Startall
+ */
 class Comms : private NonCopyable {
 public:
-	Comms(const Coord innerLength) : innerLength(innerLength) {
+	Comms(const MPI_Comm comm, const HaloExchange mode)
+			: comm(comm), persistent(mode == HaloExchange::PERSISTENT) {
+		require_halo_exchange(mode, {HaloExchange::P2P, HaloExchange::PERSISTENT});
+
 		reset_rqb(send_rqb, false);
 		reset_rqb(recv_rqb, false);
 	}
@@ -141,44 +178,111 @@ public:
 	~Comms() {
 		// cancel outstanding receives
 		reset_rqb(recv_rqb, true);
+
+		for(auto& p: persistentRq) {
+			MPI_Request_free(&p.second);
+		}
 	}
 
 	void wait_for_send() {
 		wait_for_rqb(send_rqb);
 	}
 
+	/**
+	 * Doesn't block, but lets MPI move outstanding sends forward
+	 * @return true once all of them completed
+	 */
+	bool test_sends() {
+		int flag;
+		MPI_Testall(send_rqb.second, send_rqb.first, &flag, MPI_STATUSES_IGNORE);
+		return flag;
+	}
+
 	void wait_for_receives() {
 		wait_for_rqb(recv_rqb);
+		recv_completed = 0;
+	}
+
+	/**
+	 * Doesn't block
+	 * @return bitmask of receives (in order they were scheduled) which have already completed
+	 */
+	unsigned test_receives() {
+		int count;
+		int indices[RQ_COUNT];
+		MPI_Testsome(recv_rqb.second, recv_rqb.first, &count, indices, MPI_STATUSES_IGNORE);
+		record_completed(count, indices);
+
+		return recv_completed;
+	}
+
+	/**
+	 * Blocks until at least one more receive completes (returns right away if none is outstanding)
+	 * @return same as test_receives()
+	 */
+	unsigned wait_some_receives() {
+		int count;
+		int indices[RQ_COUNT];
+		MPI_Waitsome(recv_rqb.second, recv_rqb.first, &count, indices, MPI_STATUSES_IGNORE);
+		record_completed(count, indices);
+
+		return recv_completed;
 	}
 
-	#define SCHEDULE_OP(OP, RQB) \
+	#define SCHEDULE_OP(OP, INIT_OP, RQB) \
 		auto idx = RQB.second; \
 		auto* rq = RQB.first + idx; \
-		OP(buffer, innerLength, NUM_MPI_DT, nodeId, 1, MPI_COMM_WORLD, rq); \
+		if(persistent) { \
+			auto key = std::make_tuple(&RQB == &send_rqb, buffer, nodeId, NUM_MPI_DT, size); \
+			auto it = persistentRq.find(key); \
+			if(it == persistentRq.end()) { \
+				it = persistentRq.emplace(key, MPI_REQUEST_NULL).first; \
+				INIT_OP(buffer, size, NUM_MPI_DT, nodeId, 1, comm, &it->second); \
+			} \
+			*rq = toStart[toStartCount++] = it->second; \
+		} else { \
+			OP(buffer, size, NUM_MPI_DT, nodeId, 1, comm, rq); \
+		} \
 		RQB.second++;
 	
-	void schedule_send(int nodeId, NumType* buffer) {
+	void schedule_send(int nodeId, NumType* buffer, Coord size) {
 		//DL( "schedule send to " << nodeId )
-		SCHEDULE_OP(MPI_Isend, send_rqb)
+		SCHEDULE_OP(MPI_Isend, MPI_Send_init, send_rqb)
 		//DL( "rqb afterwards" << send_rqb.second )
 	}
 
-	void schedule_recv(int nodeId, NumType* buffer) {
+	void schedule_recv(int nodeId, NumType* buffer, Coord size) {
 		//DL( "schedule receive from " << nodeId )
-		SCHEDULE_OP(MPI_Irecv, recv_rqb)
+		SCHEDULE_OP(MPI_Irecv, MPI_Recv_init, recv_rqb)
 		//DL( "rqb afterwards" << recv_rqb.second )
 	}
 
 	#undef SCHEDULE_OP
 
+	/**
+	 * Starts persistent requests scheduled since the last call, no-op for HaloExchange::P2P
+	 */
+	void start_scheduled() {
+		if(toStartCount > 0) {
+			MPI_Startall(toStartCount, toStart);
+			toStartCount = 0;
+		}
+	}
+
 private:
 	const static int RQ_COUNT = 4;
 	using RqBuffer = std::pair<MPI_Request[RQ_COUNT], int>; 
 	
-	const Coord innerLength;
-	
 	RqBuffer send_rqb;
 	RqBuffer recv_rqb;
+	unsigned recv_completed = 0;
+
+	const MPI_Comm comm;
+	const bool persistent;
+	/* (is send, buffer, peer, datatype, count) -> inactive persistent request */
+	std::map<std::tuple<bool, NumType*, int, MPI_Datatype, Coord>, MPI_Request> persistentRq;
+	MPI_Request toStart[2*RQ_COUNT];
+	int toStartCount = 0;
 
 	void reset_rqb(RqBuffer& b, bool pendingWarn) {
 		for(int i = 0; i < RQ_COUNT; i++) {
@@ -191,7 +295,8 @@ private:
 				// MPI_Cancel(b.first + i);
 				b.first[i] = MPI_REQUEST_NULL;
 
-				if(pendingWarn) {
+				/* completed persistent requests stay allocated, only inactive */
+				if(pendingWarn && !persistent) {
 					std::cerr << "WARN: pending request left in the queue, cancelling it!" << std::endl;
 				}
 			}
@@ -199,6 +304,14 @@ private:
 		b.second = 0;
 	}
 	
+	void record_completed(const int count, const int* indices) {
+		if(count != MPI_UNDEFINED) {
+			for(int i = 0; i < count; i++) {
+				recv_completed |= 1u << indices[i];
+			}
+		}
+	}
+
 	void wait_for_rqb(RqBuffer& b) {
 		//DL( "waiting for rqb" )
 		for(int i = 0; i < b.second;  i++) {
@@ -254,8 +367,8 @@ struct AreaCoords {
  */
 class WorkspaceMetainfo : private NonCopyable {
 public:
-	WorkspaceMetainfo(const Coord innerSize, const Coord boundaryWidth) {
-		precalculate(innerSize, boundaryWidth);
+	WorkspaceMetainfo(const Coord innerWidth, const Coord innerHeight, const Coord boundaryWidth) {
+		precalculate(innerWidth, innerHeight, boundaryWidth);
 	}
 
 	const AreaCoords& working_workspace_area() const { return wwa; }
@@ -272,36 +385,56 @@ public:
 	 * |_|_______|_|
 	 */
 	const std::array<AreaCoords, 4>& shared_areas() const { return sha; }
+
+	/**
+	 * Same points as shared_areas(), but left and right edges without corners - so every edge reads halo of
+	 * its own neighbour only and corners (last four) of the neighbours around them
+	 */
+	const std::array<AreaCoords, 8>& outie_areas() const { return oa; }
 	
 private:
 	AreaCoords wwa;
 	AreaCoords isa;
 	std::array<AreaCoords, 4> sha;
+	std::array<AreaCoords, 8> oa;
 	
-	void precalculate(const Coord innerSize, const Coord boundaryWidth) {
-		const auto lid = innerSize-1;
+	void precalculate(const Coord innerWidth, const Coord innerHeight, const Coord boundaryWidth) {
+		const auto lidx = innerWidth-1;
+		const auto lidy = innerHeight-1;
 		
 		wwa.bottomLeft.x = 0;
 		wwa.bottomLeft.y = 0;
-		wwa.upperRight.x = lid;
-		wwa.upperRight.y = lid;
+		wwa.upperRight.x = lidx;
+		wwa.upperRight.y = lidy;
 
 		isa.bottomLeft.x = boundaryWidth;
 		isa.bottomLeft.y = boundaryWidth;
-		isa.upperRight.x = lid - boundaryWidth;
-		isa.upperRight.y = lid - boundaryWidth;
+		isa.upperRight.x = lidx - boundaryWidth;
+		isa.upperRight.y = lidy - boundaryWidth;
 		
 		sha = {
-			AreaCoords(CSet(0, 0), CSet(boundaryWidth-1, lid)), // left
-			AreaCoords(CSet(innerSize - boundaryWidth, 0), CSet(lid, lid)), // right
-			AreaCoords(CSet(boundaryWidth, innerSize-boundaryWidth), CSet(lid-boundaryWidth, lid)), // top
-			AreaCoords(CSet(boundaryWidth, 0), CSet(lid-boundaryWidth, boundaryWidth-1)), // bottom
+			AreaCoords(CSet(0, 0), CSet(boundaryWidth-1, lidy)), // left
+			AreaCoords(CSet(innerWidth - boundaryWidth, 0), CSet(lidx, lidy)), // right
+			AreaCoords(CSet(boundaryWidth, innerHeight-boundaryWidth), CSet(lidx-boundaryWidth, lidy)), // top
+			AreaCoords(CSet(boundaryWidth, 0), CSet(lidx-boundaryWidth, boundaryWidth-1)), // bottom
+		};
+
+		const auto bw = boundaryWidth;
+		oa = {
+			AreaCoords(CSet(0, bw), CSet(bw-1, lidy-bw)), // left
+			AreaCoords(CSet(innerWidth-bw, bw), CSet(lidx, lidy-bw)), // right
+			sha[2],
+			sha[3],
+			AreaCoords(CSet(0, 0), CSet(bw-1, bw-1)), // corners
+			AreaCoords(CSet(0, innerHeight-bw), CSet(bw-1, lidy)),
+			AreaCoords(CSet(innerWidth-bw, 0), CSet(lidx, bw-1)),
+			AreaCoords(CSet(innerWidth-bw, innerHeight-bw), CSet(lidx, lidy)),
 		};
 	}
 };
 
 void test_wmi() {
-	WorkspaceMetainfo wmi(9, 2);
+	WorkspaceMetainfo wmi(9, 9, 2);
 
 	auto work_area = wmi.working_workspace_area();
 	auto innie = wmi.innies_space_area();
@@ -332,7 +465,12 @@ void test_wmi() {
 	#undef STR
 }
 
-void iterate_over_area(AreaCoords area, std::function<void(const Coord, const Coord)> f) {
+/**
+ * Calls f(x,y) for every point of the area; x is the outer loop, because y is the contiguous dimension
+ * of Workspace (see Workspace::elAddress)
+ */
+template <typename F>
+inline void iterate_over_area(const AreaCoords& area, F f) {
 	for(Coord x_idx = area.bottomLeft.x; x_idx <= area.upperRight.x; x_idx++) {
 		for(Coord y_idx = area.bottomLeft.y; y_idx <= area.upperRight.y; y_idx++) {
 			f(x_idx, y_idx);
@@ -340,13 +478,17 @@ void iterate_over_area(AreaCoords area, std::function<void(const Coord, const Co
 	}
 }
 
-class Workspace : private NonCopyable {
+class Workspace : private NonCopyable, public HaloArrival<Workspace> {
+	friend class HaloArrival<Workspace>;
 public:
-	Workspace(const Coord innerSize, const Coord borderWidth, ClusterManager& cm, Comms& comm)
-			: innerSize(innerSize), cm(cm), comm(comm), borderWidth(borderWidth)
+	Workspace(const Coord innerWidth, const Coord innerHeight, const Coord borderWidth, ClusterManager& cm,
+	          Comms& comm, const TileShape& tile, ThreadPool& pool)
+			: innerWidth(innerWidth), innerHeight(innerHeight), cm(cm), comm(comm), borderWidth(borderWidth),
+			  tile(tile), pool(pool)
 	{
-		outerSize = innerSize+2*borderWidth;
-		memorySize = outerSize*outerSize;
+		outerWidth = innerWidth+2*borderWidth;
+		outerHeight = innerHeight+2*borderWidth;
+		memorySize = outerWidth*outerHeight;
 
 		neigh = cm.getNeighbours();
 		initialize_buffers();
@@ -364,7 +506,101 @@ public:
 		return *elAddress(x,y,back);
 	}
 
-	Coord getInnerLength() {return innerSize;}
+	Coord getInnerWidth() {return innerWidth;}
+	Coord getInnerHeight() {return innerHeight;}
+
+	/**
+	 * Calls k(dst, src, stride, len) for every column of the area (tile after tile), where dst/src point to the
+	 * first point of the column in front/back buffer and stride is the distance to the same point in the next column
+	 */
+	template <typename K>
+	void iterate_over_spans(const AreaCoords& area, K k) {
+		pool.run_bands(area.bottomLeft.x, area.upperRight.x, [this, &area, &k](const Coord x_from, const Coord x_to) {
+			iterate_over_tiled_spans(area.bottomLeft.y, area.upperRight.y, x_from, x_to, tile,
+				[this, &k](const Coord y_idx, const Coord x_idx, const Coord len) {
+					k(elAddress(x_idx, y_idx, front), elAddress(x_idx, y_idx, back), outerHeight, len);
+				});
+		});
+	}
+
+	/**
+	 * Same as iterate_over_spans, only the calling thread (the one owning MPI, it gets the first band) lets p make
+	 * progress between rows
+	 */
+	template <typename K>
+	void iterate_over_spans(const AreaCoords& area, K k, ProgressEngine& p) {
+		pool.run_bands(area.bottomLeft.x, area.upperRight.x,
+		               [this, &area, &k, &p](const Coord x_from, const Coord x_to) {
+			const bool owner = x_from == area.bottomLeft.x;
+			iterate_over_tiled_spans(area.bottomLeft.y, area.upperRight.y, x_from, x_to, tile,
+				[this, &k, &p, owner](const Coord y_idx, const Coord x_idx, const Coord len) {
+					k(elAddress(x_idx, y_idx, front), elAddress(x_idx, y_idx, back), outerHeight, len);
+					if(owner) {
+						p.tick(len);
+					}
+				});
+		});
+	}
+
+	/**
+	 * Same as iterate_over_spans, but on calling thread only and without tiling - for TileScheduler tasks
+	 */
+	template <typename K>
+	void iterate_over_tile(const AreaCoords& area, K k) {
+		const auto len = area.upperRight.y - area.bottomLeft.y + 1;
+		for(Coord x_idx = area.bottomLeft.x; x_idx <= area.upperRight.x; x_idx++) {
+			k(elAddress(x_idx, area.bottomLeft.y, front), elAddress(x_idx, area.bottomLeft.y, back), outerHeight, len);
+		}
+	}
+
+	/**
+	 * Cuts area into tiles for TileScheduler - appends them to tiles, and bitmasks of neighbours whose halo each of
+	 * them reads to deps
+	 */
+	void split_for_scheduler(const AreaCoords& area, std::vector<AreaCoords>& tiles, std::vector<unsigned>& deps) {
+		iterate_over_tiles(area.bottomLeft.y, area.upperRight.y, area.bottomLeft.x, area.upperRight.x, tile,
+			[this, &tiles, &deps](const Coord y0, const Coord y1, const Coord x0, const Coord x1) {
+				tiles.push_back(AreaCoords(CSet(x0, y0), CSet(x1, y1)));
+				deps.push_back(halo_dependencies(tiles.back()));
+			});
+	}
+
+	/**
+	 * Doesn't block; halos which arrived since last call are copied into back buffer right away
+	 * @return bitmask of neighbours whose halo has already arrived
+	 */
+	unsigned arrived_halos() {
+		const auto completed = comm.test_receives();
+
+		unsigned arrived = 0;
+		for(int i = 0; i < recvCount; i++) {
+			if(completed & (1u << i)) {
+				arrived |= 1u << recvNeighbour[i];
+			}
+		}
+
+		for(int i = 0; i < 4; i++) {
+			if((arrived & ~copiedEdges) & (1u << i)) {
+				copy_outer_edge_to(static_cast<Neighbour>(i), back);
+			}
+		}
+		copiedEdges |= arrived;
+
+		return arrived;
+	}
+
+	/**
+	 * Doesn't block - lets MPI move transfers of current exchange forward (poll of ProgressEngine)
+	 * @return same as arrived_halos()
+	 */
+	unsigned progress() {
+		comm.test_sends();
+		return arrived_halos();
+	}
+
+	OverlapStats& overlap_stats() {
+		return overlap;
+	}
 
 	/*
 	 * All 4 functions are called before swap() is invoked!
@@ -372,11 +608,26 @@ public:
 	 */
 
 	void ensure_out_boundary_arrived() {
+		if(arrived_halos() != all_neighbours()) {
+			overlap.wait(OverlapStats::RECEIVES, [this]() { comm.wait_for_receives(); });
+		}
+		overlap.done(OverlapStats::RECEIVES);
+
 		comm.wait_for_receives();
-		copy_outer_buffer_to(back);
+		for(int i = 0; i < 4; i++) {
+			if(!(copiedEdges & (1u << i))) {
+				copy_outer_edge_to(static_cast<Neighbour>(i), back);
+			}
+		}
+		copiedEdges = 0;
 	}
 
 	void ensure_in_boundary_sent() {
+		if(!comm.test_sends()) {
+			overlap.wait(OverlapStats::SENDS, [this]() { comm.wait_for_send(); });
+		}
+		overlap.done(OverlapStats::SENDS);
+
 		comm.wait_for_send();
 	}
 
@@ -385,17 +636,21 @@ public:
 
 		for(int i = 0; i < 4; i++) {
 			if(neigh[i] != N_INVALID) {
-				comm.schedule_send(neigh[i], innerEdge[i]);
+				comm.schedule_send(neigh[i], innerEdge[i], edge_length(i));
 			}
 		}
+		comm.start_scheduled();
 	}
 
 	void start_wait_for_new_out_border() {
+		recvCount = 0;
 		for(int i = 0; i < 4; i++) {
 			if(neigh[i] != N_INVALID) {
-				comm.schedule_recv(neigh[i], outerEdge[i]);
+				comm.schedule_recv(neigh[i], outerEdge[i], edge_length(i));
+				recvNeighbour[recvCount++] = i;
 			}
 		}
+		comm.start_scheduled();
 	}
 
 	void swap() {
@@ -407,16 +662,29 @@ private:
 	Comms& comm;
 	int* neigh;
 
-	const Coord innerSize;
-	Coord outerSize;
+	const Coord innerWidth;
+	const Coord innerHeight;
+	Coord outerWidth;
+	Coord outerHeight;
 	Coord memorySize;
 
 	const Coord borderWidth;
+	const TileShape tile;
+	ThreadPool& pool;
+
+	/* which neighbour each of the outstanding receives (in order they were scheduled) comes from */
+	int recvNeighbour[4];
+	int recvCount = 0;
+
+	OverlapStats overlap;
+	/* bitmask of outer edges already copied into back buffer during current step */
+	unsigned copiedEdges = 0;
 
 	/* horizontal could be stored with main buffer, but for convenience both horizontals and
 	 * verticals are allocated separatelly (and writes mirrored) */
 	NumType* innerEdge[4];
-	/* all outer edges are allocated separatelly; their length is innerLength, not innerLength + 2 */
+	/* all outer edges are allocated separatelly; their length is innerHeight (left, right) or innerWidth (top,
+	 * bottom), without corners */
 	NumType* outerEdge[4];
 	NumType *front;
 	NumType *back;
@@ -433,8 +701,8 @@ private:
 		/* create inner buffer (as comm buffers) for  */
 		for(int i = 0; i < 4; i++) {
 			if(neigh[i] != N_INVALID) {
-				innerEdge[i] = new NumType[innerSize];
-				outerEdge[i] = new NumType[innerSize];
+				innerEdge[i] = new NumType[edge_length(i)];
+				outerEdge[i] = new NumType[edge_length(i)];
 			} else {
 				innerEdge[i] = nullptr;
 				outerEdge[i] = nullptr;
@@ -455,7 +723,11 @@ private:
 	}
 
 	NumType* elAddress(const Coord x, const Coord y, NumType* base) {
-		return base + outerSize*(borderWidth + x) + (borderWidth + y);
+		return base + outerHeight*(borderWidth + x) + (borderWidth + y);
+	}
+
+	Coord edge_length(const int edge) {
+		return (edge == LEFT || edge == RIGHT) ? innerHeight : innerWidth;
 	}
 
 	void swapBuffers() {
@@ -467,34 +739,81 @@ private:
 	void copy_from_x_to_inner_buffer(NumType *x) {
 		#define LOOP(EDGE, X, Y) \
 		if(neigh[EDGE] != N_INVALID) { \
-			for(Coord i = 0; i < innerSize; i++) { \
+			for(Coord i = 0; i < edge_length(EDGE); i++) { \
 				innerEdge[EDGE][i] = *elAddress(X,Y,x); \
 			} \
 		}
 
-		LOOP(TOP, i, innerSize-1)
+		LOOP(TOP, i, innerHeight-1)
 		LOOP(BOTTOM, i, 0)
 		LOOP(LEFT, 0, i)
-		LOOP(RIGHT, innerSize-1, i)
+		LOOP(RIGHT, innerWidth-1, i)
 
 		#undef LOOP
 	}
 
-	void copy_outer_buffer_to(NumType *target) {
+	void copy_outer_edge_to(const Neighbour edge, NumType *target) {
 		#define LOOP(EDGE, X, Y) \
-		if(neigh[EDGE] != N_INVALID) { \
-			for(Coord i = 0; i < innerSize; i++) { \
+		if(edge == EDGE && neigh[EDGE] != N_INVALID) { \
+			for(Coord i = 0; i < edge_length(EDGE); i++) { \
 				*elAddress(X,Y,target) = outerEdge[EDGE][i]; \
 			} \
 		}
 
-		LOOP(TOP, i, innerSize)
+		LOOP(TOP, i, innerHeight)
 		LOOP(BOTTOM, i, -1)
 		LOOP(LEFT, -1, i)
-		LOOP(RIGHT, innerSize, i)
+		LOOP(RIGHT, innerWidth, i)
 
 		#undef LOOP
 	}
+
+	/**
+	 * Halo of a neighbour in given direction along a dimension of innerLength points
+	 */
+	std::pair<Coord, Coord> halo_range(const int direction, const Coord innerLength) {
+		if(direction < 0) {
+			return std::make_pair(-borderWidth, -1LL);
+		} else if(direction > 0) {
+			return std::make_pair(innerLength, innerLength + borderWidth - 1);
+		} else {
+			return std::make_pair(0LL, innerLength - 1);
+		}
+	}
+
+	unsigned all_neighbours() {
+		unsigned mask = 0;
+		for(int i = 0; i < 4; i++) {
+			if(neigh[i] != N_INVALID) {
+				mask |= 1u << i;
+			}
+		}
+		return mask;
+	}
+
+	/**
+	 * Blocks until at least one more halo receive completes (see HaloArrival)
+	 */
+	void wait_some_halos() {
+		comm.wait_some_receives();
+	}
+
+	unsigned halo_dependencies(const AreaCoords& a) {
+		unsigned deps = 0;
+		for(int i = 0; i < 4; i++) {
+			if(neigh[i] == N_INVALID) {
+				continue;
+			}
+
+			const auto xr = halo_range(neighbourDirection[i][0], innerWidth);
+			const auto yr = halo_range(neighbourDirection[i][1], innerHeight);
+			if(stencil_reads(a.bottomLeft.x, a.upperRight.x, a.bottomLeft.y, a.upperRight.y,
+			                 xr.first, xr.second, yr.first, yr.second)) {
+				deps |= 1u << i;
+			}
+		}
+		return deps;
+	}
 };
 
 std::string filenameGenerator(int nodeId) {
@@ -510,18 +829,24 @@ int main(int argc, char **argv) {
 
 	auto conf = parse_cli(argc, argv);
 
-	ClusterManager cm(conf.N);
-	auto n_slice = cm.getPartitioner().get_n_slice();
+	/* conf.progress falls back to POLL if MPI can't do THREAD */
+	ClusterManager cm(conf.N, conf.decomposition, conf.placement, conf.progress);
+	Coord width, height;
+	std::tie(width, height) = cm.getInnerSize();
 	NumType x_offset, y_offset;
 	std::tie(x_offset, y_offset) = cm.getOffsets();
 	auto h = cm.getPartitioner().get_h();
 
-	Comms comm(n_slice);
-	Workspace w(n_slice, BOUNDARY_WIDTH, cm, comm);
-	WorkspaceMetainfo wi(n_slice, BOUNDARY_WIDTH);
+	require_halo_depth(conf.haloDepth, 1);
+	require_fixed_partition(conf.rebalanceEvery);
+	Comms comm(cm.getComm(), conf.haloExchange);
+	ThreadPool pool(conf.threads);
+	Workspace w(width, height, BOUNDARY_WIDTH, cm, comm, conf.tile, pool);
+	ProgressEngine progress(conf.progress, [&w]() { w.progress(); });
+	WorkspaceMetainfo wi(width, height, BOUNDARY_WIDTH);
 
 	FileDumper<Workspace> d(filenameGenerator(cm.getNodeId()),
-	                        n_slice,
+	                        width,
 	                        x_offset,
 	                        y_offset,
 	                        h,
@@ -535,6 +860,7 @@ int main(int argc, char **argv) {
 	auto ww_area = wi.working_workspace_area();
 	auto wi_area = wi.innies_space_area();
 	auto ws_area = wi.shared_areas();
+	auto wo_area = wi.outie_areas();
 
 	DL( "filling boundary condition" )
 
@@ -560,32 +886,54 @@ int main(int argc, char **argv) {
 
 	DL( "initial communication done" )
 
-	auto eq_f = [&w](const Coord x_idx, const Coord y_idx) {
-		// std::cerr << "Entering Y loop, x y " << y_idx << std::endl;
-
-		auto eq_val = equation(
-				w.elb(x_idx - 1, y_idx),
-				w.elb(x_idx, y_idx - 1),
-				w.elb(x_idx + 1, y_idx),
-				w.elb(x_idx, y_idx + 1)
-		);
-
-		w.set_elf(x_idx, y_idx, eq_val);
+	ConvergenceCheck conv(conf, cm.getComm());
+	auto eq_f = [&conv](NumType* dst, const NumType* src, const Coord stride, const Coord len) {
+		if(conv.measuring()) {
+			conv.add(equation_row_residual(dst, src, stride, len));
+		} else {
+			equation_row(dst, src, stride, len);
+		}
 	};
 
+	TileScheduler scheduler(pool);
+	/* polls for halos between tiles anyway, with Progress::POLL it moves sends forward too */
+	auto sched_poll = [&w, &conf]() { return conf.progress == Progress::POLL ? w.progress() : w.arrived_halos(); };
+	std::vector<AreaCoords> sched_tiles;
+	std::vector<unsigned> sched_deps;
+	if(conf.scheduledTiles) {
+		w.split_for_scheduler(wi_area, sched_tiles, sched_deps);
+		for(auto a: ws_area) {
+			w.split_for_scheduler(a, sched_tiles, sched_deps);
+		}
+	}
+
 	for(TimeStepCount ts = 0; ts < conf.timeSteps; ts++) {
 		DL( "Entering timestep loop, ts = " << ts )
 
-		iterate_over_area(wi_area, eq_f);
-		DL( "Innies iterated, ts = " << ts )
+		conv.begin_sweep(ts, ts);
 
-		w.ensure_out_boundary_arrived();
-		DL( "Out boundary arrived, ts = " << ts )
-		w.ensure_in_boundary_sent();
-		DL( "In boundary sent, ts = " << ts )
+		if(conf.scheduledTiles) {
+			scheduler.run(sched_deps,
+			              [&w, &sched_tiles, &eq_f](const int t) { w.iterate_over_tile(sched_tiles[t], eq_f); },
+			              sched_poll);
+			DL( "Scheduled tiles iterated, ts = " << ts )
 
-		for(auto a: ws_area) {
-			iterate_over_area(a, eq_f);
+			w.ensure_out_boundary_arrived();
+			w.ensure_in_boundary_sent();
+		} else {
+			progress.begin_overlap();
+			w.iterate_over_spans(wi_area, eq_f, progress);
+			progress.end_overlap();
+			DL( "Innies iterated, ts = " << ts )
+
+			w.ensure_in_boundary_sent();
+			DL( "In boundary sent, ts = " << ts )
+
+			w.iterate_as_halos_arrive(wo_area, [&w, &eq_f](const AreaCoords& a) {
+				w.iterate_over_spans(a, eq_f);
+			});
+			w.ensure_out_boundary_arrived();
+			DL( "Out boundary arrived, ts = " << ts )
 		}
 
 		DL( "Outies iterated, ts = " << ts )
@@ -602,13 +950,20 @@ int main(int argc, char **argv) {
 			d.dumpBackbuffer(w, ts);
 		}
 		DL( "After dump, ts = " << ts )
+
+		if(conv.end_sweep(ts + 1)) {
+			break;
+		}
 	}
 
 	MPI_Barrier(cm.getComm());
 	auto duration = timer.stop();
+	w.overlap_stats().reduce(cm.getComm());
 
 	if(cm.getNodeId() == 0) {
 		print_result("parallel_async", cm.getNodeCount(), duration, conf);
+		conv.report(std::cerr);
+		w.overlap_stats().report(std::cerr);
 		std::cerr << ((double)duration)/1000000000 << " s" << std::endl;
 	}
 
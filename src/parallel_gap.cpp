@@ -5,7 +5,19 @@
 #include <cmath>
 #include <cstring>
 #include <iomanip>
+#include <map>
+#include <tuple>
+#include <vector>
 #include "shared.h"
+#include "kernels.h"
+#include "Convergence.h"
+#include "ThreadPool.h"
+#include "TileScheduler.h"
+#include "HaloArrival.h"
+#include "Progress.h"
+#include "NodeWindow.h"
+#include "HaloCodec.h"
+#include "HaloPack.h"
 
 const int N_INVALID = -1;
 
@@ -16,24 +28,43 @@ enum Neighbour {
 	BOTTOM = 3,
 };
 
+/* [n][0] - x, [n][1] - y direction in which neighbour n (and its halo) lies */
+const int neighbourDirection[4][2] = {
+		{-1, +0}, // LEFT
+		{+0, +1}, // TOP
+		{+1, +0}, // RIGHT
+		{+0, -1}, // BOTTOM
+};
+
 class ClusterManager : private NonCopyable {
 public:
-	ClusterManager(const Coord N) : bitBucket(0) {
-		MPI_Init(nullptr, nullptr);
+	ClusterManager(const Coord N, const HaloShape halo, const Decomposition decomposition, const Placement placement,
+	               Progress& progress) : bitBucket(0) {
+		const int threadSupport = init_mpi_for_progress(progress);
+		MPI_Comm_size(MPI_COMM_WORLD, &nodeCount);
+
+		partitioner = new Partitioner(nodeCount, 0.0, 1.0, N, decomposition, halo);
+		gridRows = partitioner->get_nodes_grid_rows();
+		gridColumns = partitioner->get_nodes_grid_columns();
+		comm = placed_comm(placement, gridRows, gridColumns, std::cerr);
 		MPI_Comm_rank(comm, &nodeId);
-		MPI_Comm_size(comm, &nodeCount);
-
-		partitioner = new Partitioner(nodeCount, 0.0, 1.0, N);
-		sideLen = partitioner->get_nodes_grid_dimm();
 		std::tie(row, column) = partitioner->node_id_to_grid_pos(nodeId);
 
+		if(threadSupport < MPI_THREAD_FUNNELED) {
+			err_log() << "WARN: MPI library doesn't support MPI_THREAD_FUNNELED, use single thread per rank" << std::endl;
+		}
+
 		initNeighbours();
 
 		err_log() << "Cluster initialized successfully. I'm (" << row << "," << column << ")" << std::endl;
 	}
 
 	~ClusterManager() {
+		if(neighbourComm != MPI_COMM_NULL) {
+			MPI_Comm_free(&neighbourComm);
+		}
 		delete partitioner;
+		MPI_Comm_free(&comm);
 		MPI_Finalize();
 	}
 
@@ -42,6 +73,10 @@ public:
 	int getNodeCount() { return nodeCount; }
 	int getNodeId() { return nodeId; }
 	std::pair<NumType, NumType> getOffsets() { return partitioner->get_math_offset_node(row, column); };
+	/* points of this node along x and y */
+	std::pair<Coord, Coord> getInnerSize() {
+		return std::make_pair(partitioner->get_n_columns(column), partitioner->get_n_rows(row));
+	}
 	MPI_Comm getComm() { return comm; }
 
 	std::ostream& err_log() {
@@ -60,9 +95,50 @@ public:
 		return &neighbours[0];
 	}
 
+	/**
+	 * getInnerSize() of the neighbour in given direction
+	 */
+	std::pair<Coord, Coord> getInnerSizeAt(const int dx, const int dy) {
+		return std::make_pair(partitioner->get_n_columns(column + dx), partitioner->get_n_rows(row + dy));
+	}
+
+	/**
+	 * Red-black colour of point (x,y) is (x + y + parity) % 2 - parity of this node's (0,0) in global indexing,
+	 * so that colours agree across node boundaries
+	 */
+	int getColourParity() {
+		Coord x0, y0;
+		std::tie(x0, y0) = partitioner->get_index_offset_node(row, column);
+		return static_cast<int>((x0 + y0) % 2);
+	}
+
+	/**
+	 * Process grid as an MPI Cartesian topology for neighbourhood collectives, ranks keep their tiles (no
+	 * reordering). Dimension 0 is the row, so the topology lists neighbours as BOTTOM, TOP, LEFT, RIGHT - that's
+	 * what order is filled with.
+	 */
+	MPI_Comm getNeighbourComm(std::vector<int>& order) {
+		if(neighbourComm == MPI_COMM_NULL) {
+			int dims[2] = {gridRows, gridColumns};
+			int periods[2] = {0, 0};
+			MPI_Cart_create(comm, 2, dims, periods, 0, &neighbourComm);
+
+			int src, dst;
+			MPI_Cart_shift(neighbourComm, 0, 1, &src, &dst);
+			assert(src == (neighbours[BOTTOM] == N_INVALID ? MPI_PROC_NULL : neighbours[BOTTOM]));
+			assert(dst == (neighbours[TOP] == N_INVALID ? MPI_PROC_NULL : neighbours[TOP]));
+			MPI_Cart_shift(neighbourComm, 1, 1, &src, &dst);
+			assert(src == (neighbours[LEFT] == N_INVALID ? MPI_PROC_NULL : neighbours[LEFT]));
+			assert(dst == (neighbours[RIGHT] == N_INVALID ? MPI_PROC_NULL : neighbours[RIGHT]));
+		}
+
+		order = {BOTTOM, TOP, LEFT, RIGHT};
+		return neighbourComm;
+	}
 
 private:
-	const static auto comm = MPI_COMM_WORLD;
+	/* ranks renumbered so that rank is the node id, see placed_comm() */
+	MPI_Comm comm;
 
 	int nodeId;
 	int nodeCount;
@@ -71,22 +147,24 @@ private:
 
 	Partitioner *partitioner;
 
-	int sideLen;
+	int gridRows;
+	int gridColumns;
 	int neighbours[4];
+	MPI_Comm neighbourComm = MPI_COMM_NULL;
 
 	std::ostream bitBucket;
 
 	void initNeighbours() {
 		if(row == 0) { neighbours[Neighbour::BOTTOM] = N_INVALID; }
-		else { neighbours[Neighbour::BOTTOM] = nodeId-sideLen; }
+		else { neighbours[Neighbour::BOTTOM] = nodeId-gridColumns; }
 
-		if(row == sideLen-1) { neighbours[Neighbour::TOP] = N_INVALID; }
-		else { neighbours[Neighbour::TOP] = nodeId+sideLen; }
+		if(row == gridRows-1) { neighbours[Neighbour::TOP] = N_INVALID; }
+		else { neighbours[Neighbour::TOP] = nodeId+gridColumns; }
 
 		if(column == 0) { neighbours[Neighbour::LEFT] = N_INVALID; }
 		else { neighbours[Neighbour::LEFT] = nodeId-1; }
 
-		if(column == sideLen-1) { neighbours[Neighbour::RIGHT] = N_INVALID; }
+		if(column == gridColumns-1) { neighbours[Neighbour::RIGHT] = N_INVALID; }
 		else { neighbours[Neighbour::RIGHT] = nodeId+1; }
 
 		err_log() << "Neighbours: "
@@ -132,9 +210,36 @@ private:
  *
  */
 
+/**
+ * MPI_Ineighbor_alltoallw arguments - one entry per neighbour of comm's topology, in its order; displacements are
+ * in bytes from the start of the workspace buffer
+ */
+struct NeighbourhoodMsgs {
+	MPI_Comm comm = MPI_COMM_NULL;
+	std::vector<int> sendCounts, recvCounts;
+	std::vector<MPI_Aint> sendDispls, recvDispls;
+	std::vector<MPI_Datatype> sendTypes, recvTypes;
+};
+
+/**
+ * With HaloExchange::PERSISTENT every distinct (buffer, peer, datatype) gets MPI_Send_init/MPI_Recv_init request
+ * once, schedule_* only queue them and start_scheduled() starts the queue with MPI_Startall
+ */
 class Comms : private NonCopyable {
 public:
-	Comms() {
+	Comms(const MPI_Comm comm, const HaloExchange mode, const HaloPrecision precision = HaloPrecision::FULL,
+	      const HaloPacking packing = HaloPacking::AUTO, const int depth = 1)
+			: comm(comm), persistent(mode == HaloExchange::PERSISTENT),
+			  neighbourhood_(mode == HaloExchange::NEIGHBOUR), rma_(mode == HaloExchange::RMA),
+			  shm_(mode == HaloExchange::SHM),
+			  compressed_(mode == HaloExchange::COMPRESSED), wire_(precision), packing_(packing), depth_(depth) {
+		/* no diagonal neighbours, nothing to save with HaloExchange::TWO_PHASE */
+		require_halo_exchange(mode, {HaloExchange::P2P, HaloExchange::PERSISTENT, HaloExchange::NEIGHBOUR,
+		                             HaloExchange::RMA, HaloExchange::SHM, HaloExchange::COMPRESSED});
+		if(precision != HaloPrecision::FULL || depth > 1) {
+			/* values are converted and messages copied to their ring slot while packing, which only these modes do */
+			require_halo_exchange(mode, {HaloExchange::P2P, HaloExchange::COMPRESSED});
+		}
 		reset_rqb(send_rqb, false);
 		reset_rqb(recv_rqb, false);
 	}
@@ -142,42 +247,340 @@ public:
 	~Comms() {
 		// cancel outstanding receives
 		reset_rqb(recv_rqb, true);
+
+		for(auto& p: persistentRq) {
+			MPI_Request_free(&p.second);
+		}
 	}
 
 	void wait_for_send() {
 		wait_for_rqb(send_rqb);
 	}
 
+	/**
+	 * Doesn't block, but lets MPI move outstanding sends forward
+	 * @return true once all of them completed
+	 */
+	bool test_sends() {
+		int flag;
+		MPI_Testall(send_rqb.second, send_rqb.first, &flag, MPI_STATUSES_IGNORE);
+		return flag;
+	}
+
 	void wait_for_receives() {
+		if(exposed != MPI_WIN_NULL) {
+			MPI_Win_wait(exposed);
+			exposed = MPI_WIN_NULL;
+		}
+
 		wait_for_rqb(recv_rqb);
+		recv_completed = 0;
+	}
+
+	/**
+	 * Doesn't block
+	 * @return bitmask of receives (in order they were scheduled) which have already completed
+	 */
+	unsigned test_receives() {
+		if(exposed != MPI_WIN_NULL) {
+			int flag;
+			MPI_Win_test(exposed, &flag);
+			if(flag) {
+				exposed = MPI_WIN_NULL;
+				recv_completed |= 1u;
+			}
+		}
+
+		int count;
+		int indices[RQ_COUNT];
+		MPI_Testsome(recv_rqb.second, recv_rqb.first, &count, indices, MPI_STATUSES_IGNORE);
+		record_completed(count, indices);
+
+		return recv_completed;
+	}
+
+	/**
+	 * Blocks until at least one more receive completes (returns right away if none is outstanding)
+	 * @return same as test_receives()
+	 */
+	unsigned wait_some_receives() {
+		if(exposed != MPI_WIN_NULL) {
+			MPI_Win_wait(exposed);
+			exposed = MPI_WIN_NULL;
+			recv_completed |= 1u;
+			return recv_completed;
+		}
+
+		int count;
+		int indices[RQ_COUNT];
+		MPI_Waitsome(recv_rqb.second, recv_rqb.first, &count, indices, MPI_STATUSES_IGNORE);
+		record_completed(count, indices);
+
+		return recv_completed;
 	}
 
-	#define SCHEDULE_OP(OP, RQB) \
+	#define SCHEDULE_OP(OP, INIT_OP, RQB) \
 		auto idx = RQB.second; \
 		auto* rq = RQB.first + idx; \
-		OP(buffer, size, type, nodeId, 1, MPI_COMM_WORLD, rq); \
+		if(persistent) { \
+			auto key = std::make_tuple(&RQB == &send_rqb, buffer, nodeId, type, size); \
+			auto it = persistentRq.find(key); \
+			if(it == persistentRq.end()) { \
+				it = persistentRq.emplace(key, MPI_REQUEST_NULL).first; \
+				INIT_OP(buffer, size, type, nodeId, 1, comm, &it->second); \
+			} \
+			*rq = toStart[toStartCount++] = it->second; \
+		} else { \
+			OP(buffer, size, type, nodeId, 1, comm, rq); \
+		} \
 		RQB.second++;
 
 	void schedule_send(int nodeId, NumType *buffer, Coord size, MPI_Datatype type) {
 		DL( "schedule send to " << nodeId )
-		SCHEDULE_OP(MPI_Isend, send_rqb)
+		SCHEDULE_OP(MPI_Isend, MPI_Send_init, send_rqb)
 		DL( "rqb afterwards" << send_rqb.second )
 	}
 
 	void schedule_recv(int nodeId, NumType *buffer, Coord size, MPI_Datatype type) {
 		DL( "schedule receive from " << nodeId )
-		SCHEDULE_OP(MPI_Irecv, recv_rqb)
+		SCHEDULE_OP(MPI_Irecv, MPI_Recv_init, recv_rqb)
 		DL( "rqb afterwards" << recv_rqb.second )
 	}
 
 	#undef SCHEDULE_OP
 
+	bool neighbourhood() const {
+		return neighbourhood_;
+	}
+
+	/*
+	 * HaloExchange::RMA - neighbours MPI_Put straight into the halo of a window over the workspace buffer, with
+	 * post-start-complete-wait epochs instead of matched messages. Exposure epoch (until wait_for_receives() or
+	 * test_receives() sees it finished) counts as a single receive.
+	 */
+
+	bool rma() const {
+		return rma_;
+	}
+
+	/**
+	 * HaloExchange::SHM - halos of neighbours on the same host are copied by Workspace from their buffers (see
+	 * NodeWindow), only the rest goes through this class
+	 */
+	bool shm() const {
+		return shm_;
+	}
+
+	/**
+	 * HaloExchange::COMPRESSED - Workspace encodes halos into byte messages of varying length (receive buffers fit
+	 * the longest one)
+	 */
+	bool compressed() const {
+		return compressed_;
+	}
+
+	/**
+	 * Halo values travel in wire() format - NumType unless HaloPrecision says otherwise
+	 */
+	const HaloWireFormat& wire() const {
+		return wire_;
+	}
+
+	/**
+	 * Workspace packs halos into byte messages (post_send_bytes()) instead of sending its buffer - to compress
+	 * them, to change their precision or to keep more than one exchange in flight. Encoding overlaps the innies
+	 * sweep only with Progress::THREAD, whose helper does it (Workspace::defer_encoding()); otherwise it precedes
+	 * the sweep, and only decoding overlaps.
+	 */
+	bool packed() const {
+		return compressed_ || wire_.lossy() || depth_ > 1;
+	}
+
+	/**
+	 * Exchanges whose packed messages may be in flight at once - each has its own slot of a ring of message
+	 * buffers (and its own tag), so sends of an exchange don't wait for the previous ones to complete
+	 */
+	int halo_depth() const {
+		return depth_;
+	}
+
+	/**
+	 * How schedule_send()/schedule_recv() callers should pass strided messages
+	 */
+	HaloPacking strided_packing() const {
+		return packing_;
+	}
+
+	/**
+	 * schedule_send()/schedule_recv() carry halos - exchange modes with messages of their own (neighbourhood
+	 * collective, puts, packed) don't
+	 */
+	bool typed() const {
+		return !neighbourhood_ && !rma_ && !packed();
+	}
+
+	/*
+	 * Packed messages of exchange e go in ring slot e % halo_depth(), tagged with it. Their requests stay with the
+	 * caller: receives are posted up to halo_depth() exchanges ahead and handed over with adopt_recv() when their
+	 * exchange becomes the current one, sends are waited for only when their slot comes round again. Tags start
+	 * at HALO_RING_TAG, above tag 1 of typed messages (SCHEDULE_OP), so a packed message can't match a typed
+	 * receive or the other way round.
+	 */
+
+	MPI_Request post_send_bytes(int nodeId, uint8_t* buffer, Coord size, int slot) {
+		MPI_Request rq;
+		MPI_Isend(buffer, size, MPI_BYTE, nodeId, HALO_RING_TAG + slot, comm, &rq);
+		return rq;
+	}
+
+	MPI_Request post_recv_bytes(int nodeId, uint8_t* buffer, Coord size, int slot) {
+		MPI_Request rq;
+		MPI_Irecv(buffer, size, MPI_BYTE, nodeId, HALO_RING_TAG + slot, comm, &rq);
+		return rq;
+	}
+
+	/**
+	 * Makes rq one of the receives of current exchange (test_receives() and friends), leaves MPI_REQUEST_NULL
+	 * in its place
+	 */
+	void adopt_recv(MPI_Request& rq) {
+		recv_rqb.first[recv_rqb.second++] = rq;
+		rq = MPI_REQUEST_NULL;
+	}
+
+	/**
+	 * Doesn't block
+	 * @return true if rq completed (or is MPI_REQUEST_NULL)
+	 */
+	bool test_request(MPI_Request& rq) {
+		int flag;
+		MPI_Test(&rq, &flag, MPI_STATUS_IGNORE);
+		return flag;
+	}
+
+	void wait_request(MPI_Request& rq) {
+		MPI_Wait(&rq, MPI_STATUS_IGNORE);
+	}
+
+	/**
+	 * For receives of exchanges which won't happen
+	 */
+	void cancel_request(MPI_Request& rq) {
+		if(rq != MPI_REQUEST_NULL) {
+			MPI_Cancel(&rq);
+			MPI_Wait(&rq, MPI_STATUS_IGNORE);
+		}
+	}
+
+	/**
+	 * Collective - all ranks allocate their buffers in the same order, peers - ranks which put into them. Memory
+	 * comes from MPI_Win_allocate, so that the library can register it for RDMA.
+	 */
+	NumType* allocate_exposed(const Coord count, const std::vector<int>& peers) {
+		NumType* buffer;
+		MPI_Win win;
+		MPI_Win_allocate(count*sizeof(NumType), sizeof(NumType), MPI_INFO_NULL, comm, &buffer, &win);
+		windows[buffer] = win;
+
+		if(peerGroup == MPI_GROUP_NULL) {
+			MPI_Group all;
+			MPI_Comm_group(comm, &all);
+			MPI_Group_incl(all, static_cast<int>(peers.size()), peers.data(), &peerGroup);
+			MPI_Group_free(&all);
+		}
+
+		return buffer;
+	}
+
+	/**
+	 * Collective, frees the buffers too - exposure epoch must be over
+	 */
+	void free_windows() {
+		for(auto& w: windows) {
+			MPI_Win_free(&w.second);
+		}
+		windows.clear();
+
+		if(peerGroup != MPI_GROUP_NULL) {
+			MPI_Group_free(&peerGroup);
+		}
+	}
+
+	/**
+	 * Opens exposure epoch of buffer's window and access epoch to the same window of peers
+	 */
+	void begin_puts(NumType* buffer) {
+		exposed = windows.at(buffer);
+		MPI_Win_post(peerGroup, 0, exposed);
+		MPI_Win_start(peerGroup, 0, exposed);
+	}
+
+	/**
+	 * Offsets are in points from buffer start, targetType describes peer's buffer layout (its rows may be of
+	 * different length)
+	 */
+	void schedule_put(int nodeId, NumType* buffer, Coord offset, Coord targetOffset, Coord size, MPI_Datatype type,
+	                  MPI_Datatype targetType) {
+		DL( "schedule put to " << nodeId )
+		MPI_Put(buffer + offset, static_cast<int>(size), type, nodeId, targetOffset, static_cast<int>(size),
+		        targetType, exposed);
+	}
+
+	/**
+	 * Closes access epoch - puts are done with the origin buffer
+	 */
+	void end_puts() {
+		MPI_Win_complete(exposed);
+	}
+
+	/**
+	 * Sends and receives all halos of buffer at once - completes as a single receive
+	 */
+	void schedule_neighbourhood(const NeighbourhoodMsgs& m, NumType* buffer) {
+		DL( "schedule neighbourhood exchange" )
+		MPI_Ineighbor_alltoallw(buffer, m.sendCounts.data(), m.sendDispls.data(), m.sendTypes.data(),
+		                        buffer, m.recvCounts.data(), m.recvDispls.data(), m.recvTypes.data(),
+		                        m.comm, recv_rqb.first + recv_rqb.second);
+		recv_rqb.second++;
+	}
+
+	/**
+	 * Starts persistent requests scheduled since the last call, no-op for HaloExchange::P2P
+	 */
+	void start_scheduled() {
+		if(toStartCount > 0) {
+			MPI_Startall(toStartCount, toStart);
+			toStartCount = 0;
+		}
+	}
+
 private:
 	const static int RQ_COUNT = 4;
+	const static int HALO_RING_TAG = 16;
 	using RqBuffer = std::pair<MPI_Request[RQ_COUNT], int>; 
 	
 	RqBuffer send_rqb;
 	RqBuffer recv_rqb;
+	unsigned recv_completed = 0;
+
+	const MPI_Comm comm;
+	const bool persistent;
+	const bool neighbourhood_;
+	const bool rma_;
+	const bool shm_;
+	const bool compressed_;
+	const HaloWireFormat wire_;
+	const HaloPacking packing_;
+	const int depth_;
+	/* buffer -> window over it */
+	std::map<NumType*, MPI_Win> windows;
+	MPI_Group peerGroup = MPI_GROUP_NULL;
+	/* window whose exposure epoch hasn't been waited for yet */
+	MPI_Win exposed = MPI_WIN_NULL;
+	/* (is send, buffer, peer, datatype, count) -> inactive persistent request */
+	std::map<std::tuple<bool, NumType*, int, MPI_Datatype, Coord>, MPI_Request> persistentRq;
+	MPI_Request toStart[2*RQ_COUNT];
+	int toStartCount = 0;
 
 	void reset_rqb(RqBuffer& b, bool pendingWarn) {
 		for(int i = 0; i < RQ_COUNT; i++) {
@@ -190,7 +593,8 @@ private:
 				// MPI_Cancel(b.first + i);
 				b.first[i] = MPI_REQUEST_NULL;
 
-				if(pendingWarn) {
+				/* completed persistent requests stay allocated, only inactive */
+				if(pendingWarn && !persistent) {
 					std::cerr << "WARN: pending request left in the queue, cancelling it!" << std::endl;
 				}
 			}
@@ -198,6 +602,14 @@ private:
 		b.second = 0;
 	}
 	
+	void record_completed(const int count, const int* indices) {
+		if(count != MPI_UNDEFINED) {
+			for(int i = 0; i < count; i++) {
+				recv_completed |= 1u << indices[i];
+			}
+		}
+	}
+
 	void wait_for_rqb(RqBuffer& b) {
 		//DL( "waiting for rqb" )
 		for(int i = 0; i < b.second;  i++) {
@@ -238,34 +650,119 @@ enum border_side {
 	OUT = 4,
 };
 
+/* red-black SOR colours, point (x,y) is RED when (x + y + parity) is even (see ClusterManager::getColourParity) */
+enum Colour {
+	RED = 0,
+	BLACK = 1,
+};
+
 class NeighboursCommProxy {
 public:
+	/**
+	 * @param peer_sizes inner width and height of every neighbour's tile - they share our height (left, right) or
+	 * width (top, bottom), but not necessarily the other one
+	 */
 	NeighboursCommProxy(int* neigh_mapping, 
-	                    const Coord innerLength, 
+	                    const Coord innerWidth, 
+	                    const Coord innerHeight, 
 	                    const Coord gap_width, 
-	                    std::function<Coord(const Coord, const Coord)> cm) : inner_size(innerLength)
-			
+	                    const int colour_parity,
+	                    const std::pair<Coord, Coord>* peer_sizes,
+	                    std::function<Coord(const Coord, const Coord)> cm)
+			: inner_width(innerWidth), inner_height(innerHeight), gap_width(gap_width), offset_of(cm)
 	{
-		const auto outer_size = inner_size + 2*gap_width;
+		const auto outer_width = inner_width + 2*gap_width;
 		const auto nm = neigh_mapping;
+		for(int i = 0; i < 4; i++) {
+			peer_size[i] = peer_sizes[i];
+		}
 
-		MPI_Type_vector(inner_size, gap_width, outer_size, NUM_MPI_DT, &vert_dt);
+		MPI_Type_vector(inner_height, gap_width, outer_width, NUM_MPI_DT, &vert_dt);
 		MPI_Type_commit(&vert_dt);
+		vert_layout = StridedLayout{inner_height, gap_width, outer_width};
+
+		/* left and right neighbours' rows may be of different length - their side of a put needs its own types */
+		for(auto n: {LEFT, RIGHT}) {
+			const auto peer_outer_width = peer_size[n].first + 2*gap_width;
+			MPI_Type_vector(inner_height, gap_width, peer_outer_width, NUM_MPI_DT, &peer_vert_dt[n]);
+			MPI_Type_commit(&peer_vert_dt[n]);
+			MPI_Type_create_resized(NUM_MPI_DT, 0, 2*peer_outer_width*sizeof(NumType), &peer_vert_colour_dt[n]);
+			MPI_Type_commit(&peer_vert_colour_dt[n]);
+		}
 
 		/* put here coordinates of the beginning; since storage is flipped horizontally, (0,0) /x,y/
 		 * is stored at the beginning, then (1,0), (2,0), ... (0,1) and so on
 		 */
 		info[IN + LEFT] = comms_info(nm[LEFT], cm(0,0), vert_dt, 1);
-		info[IN + RIGHT] = comms_info(nm[RIGHT], cm(inner_size-gap_width, 0), vert_dt, 1);
-		info[IN + TOP] = comms_info(nm[TOP], cm(0,inner_size-1), NUM_MPI_DT, inner_size);
-		info[IN + BOTTOM] = comms_info(nm[BOTTOM], cm(0,0), NUM_MPI_DT, inner_size);
+		info[IN + RIGHT] = comms_info(nm[RIGHT], cm(inner_width-gap_width, 0), vert_dt, 1);
+		info[IN + TOP] = comms_info(nm[TOP], cm(0,inner_height-1), NUM_MPI_DT, inner_width);
+		info[IN + BOTTOM] = comms_info(nm[BOTTOM], cm(0,0), NUM_MPI_DT, inner_width);
 
 		info[OUT + LEFT] = comms_info(nm[LEFT], cm(-1,0), vert_dt, 1);
-		info[OUT + RIGHT] = comms_info(nm[RIGHT], cm(inner_size, 0), vert_dt, 1);
-		info[OUT + TOP] = comms_info(nm[TOP], cm(0,inner_size), NUM_MPI_DT, inner_size);
-		info[OUT + BOTTOM] = comms_info(nm[BOTTOM], cm(0,-1), NUM_MPI_DT, inner_size);
+		info[OUT + RIGHT] = comms_info(nm[RIGHT], cm(inner_width, 0), vert_dt, 1);
+		info[OUT + TOP] = comms_info(nm[TOP], cm(0,inner_height), NUM_MPI_DT, inner_width);
+		info[OUT + BOTTOM] = comms_info(nm[BOTTOM], cm(0,-1), NUM_MPI_DT, inner_width);
+
+		put_target[LEFT] = put_info(LEFT, 0, 0, peer_vert_dt[LEFT]);
+		put_target[RIGHT] = put_info(RIGHT, inner_width-gap_width, 0, peer_vert_dt[RIGHT]);
+		put_target[TOP] = put_info(TOP, 0, inner_height-1, NUM_MPI_DT);
+		put_target[BOTTOM] = put_info(BOTTOM, 0, 0, NUM_MPI_DT);
+
+		halo[LEFT] = HaloRect{-gap_width, 0, gap_width, inner_height};
+		halo[RIGHT] = HaloRect{inner_width, 0, gap_width, inner_height};
+		halo[TOP] = HaloRect{0, inner_height, inner_width, 1};
+		halo[BOTTOM] = HaloRect{0, -1, inner_width, 1};
+
+		/* what we send to neighbour lies just inside of its halo */
+		for(int i = 0; i < 4; i++) {
+			const auto dx = neighbourDirection[i][0];
+			const auto dy = neighbourDirection[i][1];
+			const auto& h = halo[i];
+			sent[i] = HaloRect{h.x - dx*h.w, h.y - dy*h.h, h.w, h.h};
+		}
+
+		/*
+		 * Single colour of one point wide border is every other point of it - datatypes with extent of 2 points
+		 * along the border, count depends on whether the first point is of given colour
+		 */
+		MPI_Type_create_resized(NUM_MPI_DT, 0, 2*sizeof(NumType), &horiz_colour_dt);
+		MPI_Type_commit(&horiz_colour_dt);
+		MPI_Type_create_resized(NUM_MPI_DT, 0, 2*outer_width*sizeof(NumType), &vert_colour_dt);
+		MPI_Type_commit(&vert_colour_dt);
 
-		DL( "inner_size = " << inner_size << ", gap_width = " << gap_width << ", outer_size = " << outer_size )
+		auto colour_skip = [=](const Coord x, const Coord y, const int colour) -> Coord {
+			return ((x + y + colour_parity) % 2 + 2) % 2 == colour ? 0 : 1;
+		};
+		auto colour_info = [=](const int nid, const Coord x, const Coord y, const bool vertical, const int colour) {
+			const auto skip = colour_skip(x, y, colour);
+			const auto offset = vertical ? cm(x, y + skip) : cm(x + skip, y);
+			const auto len = vertical ? inner_height : inner_width;
+			return comms_info(nid, offset, vertical ? vert_colour_dt : horiz_colour_dt, (len - skip + 1)/2);
+		};
+		auto colour_put = [=](const Neighbour n, const Coord x, const Coord y, const bool vertical, const int colour) {
+			const auto skip = colour_skip(x, y, colour);
+			return vertical ? put_info(n, x, y + skip, peer_vert_colour_dt[n])
+			                : put_info(n, x + skip, y, horiz_colour_dt);
+		};
+
+		for(int c = RED; c <= BLACK; c++) {
+			c_info[c][IN + LEFT] = colour_info(nm[LEFT], 0, 0, true, c);
+			c_info[c][IN + RIGHT] = colour_info(nm[RIGHT], inner_width-1, 0, true, c);
+			c_info[c][IN + TOP] = colour_info(nm[TOP], 0, inner_height-1, false, c);
+			c_info[c][IN + BOTTOM] = colour_info(nm[BOTTOM], 0, 0, false, c);
+
+			c_info[c][OUT + LEFT] = colour_info(nm[LEFT], -1, 0, true, c);
+			c_info[c][OUT + RIGHT] = colour_info(nm[RIGHT], inner_width, 0, true, c);
+			c_info[c][OUT + TOP] = colour_info(nm[TOP], 0, inner_height, false, c);
+			c_info[c][OUT + BOTTOM] = colour_info(nm[BOTTOM], 0, -1, false, c);
+
+			c_put_target[c][LEFT] = colour_put(LEFT, 0, 0, true, c);
+			c_put_target[c][RIGHT] = colour_put(RIGHT, inner_width-1, 0, true, c);
+			c_put_target[c][TOP] = colour_put(TOP, 0, inner_height-1, false, c);
+			c_put_target[c][BOTTOM] = colour_put(BOTTOM, 0, 0, false, c);
+		}
+
+		DL( "inner_width = " << inner_width << ", inner_height = " << inner_height << ", gap_width = " << gap_width )
 
 		#ifdef DEBUG
 		for(int i = 0; i < 8; i++) {
@@ -277,12 +774,23 @@ public:
 
 	~NeighboursCommProxy() {
 		MPI_Type_free(&vert_dt);
+		MPI_Type_free(&horiz_colour_dt);
+		MPI_Type_free(&vert_colour_dt);
+		for(auto n: {LEFT, RIGHT}) {
+			MPI_Type_free(&peer_vert_dt[n]);
+			MPI_Type_free(&peer_vert_colour_dt[n]);
+		}
 	}
 
 	void schedule_send(Comms& c, Neighbour n, NumType* buffer) {
 		auto& inf = info[IN + n];
 		DL( "proxy_send, neighbour: " << n << ", bs: " << bs << ", info_target: " << inf.node_id << ", offset: "
 		                              << inf.offset << ", type = " << ((inf.type == vert_dt) ? "vert_dt" : "num_type") )
+		if(stage[IN + n].active()) {
+			auto& st = stage[IN + n];
+			c.schedule_send(inf.node_id, st.gather(buffer + inf.offset), st.points(), NUM_MPI_DT);
+			return;
+		}
 		c.schedule_send(inf.node_id, buffer + inf.offset, inf.size, inf.type);
 	}
 
@@ -290,9 +798,148 @@ public:
 		auto& inf = info[OUT + n];
 		DL( "proxy_recv, neighbour: " << n << ", bs: " << bs << ", info_target: " << inf.node_id << ", offset: "
 		                              << inf.offset << ", type = " << ((inf.type == vert_dt) ? "vert_dt" : "num_type") )
+		if(stage[OUT + n].active()) {
+			auto& st = stage[OUT + n];
+			c.schedule_recv(inf.node_id, st.data(), st.points(), NUM_MPI_DT);
+			return;
+		}
+		c.schedule_recv(inf.node_id, buffer + inf.offset, inf.size, inf.type);
+	}
+
+	/* same as above, but only points of given colour (one point wide borders only) */
+
+	void schedule_send(Comms& c, Neighbour n, Colour colour, NumType* buffer) {
+		auto& inf = c_info[colour][IN + n];
+		c.schedule_send(inf.node_id, buffer + inf.offset, inf.size, inf.type);
+	}
+
+	void schedule_recv(Comms& c, Neighbour n, Colour colour, NumType* buffer) {
+		auto& inf = c_info[colour][OUT + n];
 		c.schedule_recv(inf.node_id, buffer + inf.offset, inf.size, inf.type);
 	}
 
+	/**
+	 * Turns the info tables into neighbourhood collective arguments for topology communicator nc, whose
+	 * neighbours are order[0], order[1], ...
+	 */
+	void init_neighbourhood(const MPI_Comm nc, const std::vector<int>& order) {
+		to_neighbourhood(nc, order, info, nbh);
+		for(int c = RED; c <= BLACK; c++) {
+			to_neighbourhood(nc, order, c_info[c], c_nbh[c]);
+		}
+	}
+
+	void schedule_exchange(Comms& c, NumType* buffer) {
+		c.schedule_neighbourhood(nbh, buffer);
+	}
+
+	void schedule_exchange(Comms& c, Colour colour, NumType* buffer) {
+		c.schedule_neighbourhood(c_nbh[colour], buffer);
+	}
+
+	/**
+	 * Inner border goes to the same global points in the neighbour's halo (see peer_offset())
+	 */
+	void schedule_put(Comms& c, Neighbour n, NumType* buffer) {
+		auto& inf = info[IN + n];
+		auto& t = put_target[n];
+		c.schedule_put(inf.node_id, buffer, inf.offset, t.offset, inf.size, inf.type, t.type);
+	}
+
+	/**
+	 * Comms::packed() - encodes what schedule_send() would send into out (message_bound() bytes at most), values
+	 * in wire format
+	 * @param rounding raised to the largest change of a value the wire format caused
+	 * @return message length
+	 */
+	Coord pack(Neighbour n, const NumType* buffer, uint8_t* out, const HaloWireFormat& wire, const bool compress,
+	           NumType& rounding) {
+		const auto& r = sent[n];
+		const bool lossy = wire.lossy();
+		NumType maxRounding = 0;
+		const auto length = encode_halo_message(out, r.w*r.h, wire, compress,
+		                                        [this, &r, buffer, &wire, lossy, &maxRounding](auto put) {
+			for(Coord y = r.y; y < r.y + r.h; y++) {
+				const auto* row = buffer + offset_of(r.x, y);
+				for(Coord i = 0; i < r.w; i++) {
+					const auto bits = wire.encode(row[i]);
+					if(lossy) {
+						maxRounding = std::max(maxRounding, std::abs(wire.decode(bits) - row[i]));
+					}
+					put(bits);
+				}
+			}
+		});
+		rounding = std::max(rounding, maxRounding);
+		return length;
+	}
+
+	/**
+	 * Decodes a message pack() produced into our halo on neighbour n's side
+	 */
+	void unpack(Neighbour n, NumType* buffer, const uint8_t* in, const HaloWireFormat& wire) {
+		const auto& r = halo[n];
+		decode_halo_message(in, wire, [this, &r, buffer, &wire](auto get) {
+			for(Coord y = r.y; y < r.y + r.h; y++) {
+				auto* row = buffer + offset_of(r.x, y);
+				for(Coord i = 0; i < r.w; i++) {
+					row[i] = wire.decode(get());
+				}
+			}
+		});
+	}
+
+	Coord halo_points(Neighbour n) const {
+		return halo[n].w*halo[n].h;
+	}
+
+	Coord message_bound(Neighbour n, const HaloWireFormat& wire) const {
+		return halo_message_bound(halo_points(n), wire);
+	}
+
+	/**
+	 * Fills our halo on neighbour n's side straight from neighbour's buffer (see peer_offset()).
+	 * Whole halo - for SOR the other colour is copied too, but it hasn't changed since the last exchange.
+	 */
+	void copy_halo(Neighbour n, NumType* buffer, const NumType* peer) {
+		const auto& r = halo[n];
+		for(Coord y = r.y; y < r.y + r.h; y++) {
+			std::memcpy(buffer + offset_of(r.x, y), peer + peer_offset(n, r.x, y), r.w*sizeof(NumType));
+		}
+	}
+
+	/**
+	 * Strided messages of datatypes manual packing wins (see choose_manual_packing()) go through contiguous
+	 * staging buffers from now on - schedule_send() gathers them, received ones wait for unstage(). Collective.
+	 */
+	void init_staging(const HaloPacking packing, const MPI_Comm comm, std::ostream& log) {
+		if(!choose_manual_packing(packing, vert_dt, vert_layout, "vert_dt", comm, log)) {
+			return;
+		}
+		for(int i = 0; i < 8; i++) {
+			if(info[i].type == vert_dt && info[i].node_id != N_INVALID) {
+				stage[i].init(vert_layout);
+			}
+		}
+	}
+
+	bool staged(Neighbour n) const {
+		return stage[OUT + n].active();
+	}
+
+	/**
+	 * Scatters a received staged message into our halo on neighbour n's side
+	 */
+	void unstage(Neighbour n, NumType* buffer) {
+		stage[OUT + n].scatter(buffer + info[OUT + n].offset);
+	}
+
+	void schedule_put(Comms& c, Neighbour n, Colour colour, NumType* buffer) {
+		auto& inf = c_info[colour][IN + n];
+		auto& t = c_put_target[colour][n];
+		c.schedule_put(inf.node_id, buffer, inf.offset, t.offset, inf.size, inf.type, t.type);
+	}
+
 private:
 	struct comms_info {
 		comms_info() {}
@@ -305,10 +952,78 @@ private:
 		Coord size;
 	};
 
-	const Coord inner_size;
+	const Coord inner_width;
+	const Coord inner_height;
+	const Coord gap_width;
 	comms_info info[8];
+	comms_info c_info[2][8];
+	NeighbourhoodMsgs nbh;
+	NeighbourhoodMsgs c_nbh[2];
+	/* inner width and height of neighbours' tiles */
+	std::pair<Coord, Coord> peer_size[4];
+
+	/* neighbour's side of a put - offset in its buffer and datatype of its layout */
+	struct put_target_info {
+		Coord offset;
+		MPI_Datatype type;
+	};
+	put_target_info put_target[4];
+	put_target_info c_put_target[2][4];
+
+	MPI_Datatype peer_vert_dt[4];
+	MPI_Datatype peer_vert_colour_dt[4];
+
+	/* halo on neighbour's side, (x, y) - bottom left point, w x h points */
+	struct HaloRect {
+		Coord x, y, w, h;
+	};
+
+	std::function<Coord(const Coord, const Coord)> offset_of;
+	HaloRect halo[4];
+	/* what we send to neighbour n */
+	HaloRect sent[4];
+
+	/* the same as MPI_Type_vector arguments of vert_dt */
+	StridedLayout vert_layout;
+	/* messages of info entries going through contiguous buffers instead of datatypes */
+	HaloStage stage[8];
+
+	/**
+	 * Where our point (x, y) is in neighbour n's buffer - the neighbour is our inner width (height) or its own one
+	 * away, in its direction, and rows of its buffer are as long as its width is
+	 */
+	Coord peer_offset(const Neighbour n, const Coord x, const Coord y) const {
+		const auto dx = neighbourDirection[n][0];
+		const auto dy = neighbourDirection[n][1];
+		const auto& p = peer_size[n];
+		const auto px = x - (dx > 0 ? inner_width : (dx < 0 ? -p.first : 0));
+		const auto py = y - (dy > 0 ? inner_height : (dy < 0 ? -p.second : 0));
+		return (p.first + 2*gap_width)*(gap_width + py) + (gap_width + px);
+	}
+
+	put_target_info put_info(const Neighbour n, const Coord x, const Coord y, const MPI_Datatype type) const {
+		return put_target_info{peer_offset(n, x, y), type};
+	}
+
+	/* missing neighbours (MPI_PROC_NULL in the topology) get empty messages */
+	static void to_neighbourhood(const MPI_Comm nc, const std::vector<int>& order, const comms_info* inf,
+	                             NeighbourhoodMsgs& m) {
+		m = NeighbourhoodMsgs();
+		m.comm = nc;
+		for(auto n: order) {
+			const bool valid = inf[IN + n].node_id != N_INVALID;
+			m.sendCounts.push_back(valid ? static_cast<int>(inf[IN + n].size) : 0);
+			m.sendDispls.push_back(inf[IN + n].offset*sizeof(NumType));
+			m.sendTypes.push_back(inf[IN + n].type);
+			m.recvCounts.push_back(valid ? static_cast<int>(inf[OUT + n].size) : 0);
+			m.recvDispls.push_back(inf[OUT + n].offset*sizeof(NumType));
+			m.recvTypes.push_back(inf[OUT + n].type);
+		}
+	}
 
 	MPI_Datatype vert_dt;
+	MPI_Datatype horiz_colour_dt;
+	MPI_Datatype vert_colour_dt;
 };
 
 
@@ -352,8 +1067,8 @@ struct AreaCoords {
  */
 class WorkspaceMetainfo : private NonCopyable {
 public:
-	WorkspaceMetainfo(const Coord innerSize, const Coord boundaryWidth) {
-		precalculate(innerSize, boundaryWidth);
+	WorkspaceMetainfo(const Coord innerWidth, const Coord innerHeight, const Coord boundaryWidth) {
+		precalculate(innerWidth, innerHeight, boundaryWidth);
 	}
 
 	const AreaCoords& working_workspace_area() const { return wwa; }
@@ -370,36 +1085,56 @@ public:
 	 * |_|_______|_|
 	 */
 	const std::array<AreaCoords, 4>& shared_areas() const { return sha; }
+
+	/**
+	 * Same points as shared_areas(), but left and right edges without corners - so every edge reads halo of
+	 * its own neighbour only and corners (last four) of the neighbours around them
+	 */
+	const std::array<AreaCoords, 8>& outie_areas() const { return oa; }
 	
 private:
 	AreaCoords wwa;
 	AreaCoords isa;
 	std::array<AreaCoords, 4> sha;
+	std::array<AreaCoords, 8> oa;
 	
-	void precalculate(const Coord innerSize, const Coord boundaryWidth) {
-		const auto lid = innerSize-1;
+	void precalculate(const Coord innerWidth, const Coord innerHeight, const Coord boundaryWidth) {
+		const auto lidx = innerWidth-1;
+		const auto lidy = innerHeight-1;
 		
 		wwa.bottomLeft.x = 0;
 		wwa.bottomLeft.y = 0;
-		wwa.upperRight.x = lid;
-		wwa.upperRight.y = lid;
+		wwa.upperRight.x = lidx;
+		wwa.upperRight.y = lidy;
 
 		isa.bottomLeft.x = boundaryWidth;
 		isa.bottomLeft.y = boundaryWidth;
-		isa.upperRight.x = lid - boundaryWidth;
-		isa.upperRight.y = lid - boundaryWidth;
+		isa.upperRight.x = lidx - boundaryWidth;
+		isa.upperRight.y = lidy - boundaryWidth;
 		
 		sha = {
-			AreaCoords(CSet(0, 0), CSet(boundaryWidth-1, lid)), // left
-			AreaCoords(CSet(innerSize - boundaryWidth, 0), CSet(lid, lid)), // right
-			AreaCoords(CSet(boundaryWidth, innerSize-boundaryWidth), CSet(lid-boundaryWidth, lid)), // top
-			AreaCoords(CSet(boundaryWidth, 0), CSet(lid-boundaryWidth, boundaryWidth-1)), // bottom
+			AreaCoords(CSet(0, 0), CSet(boundaryWidth-1, lidy)), // left
+			AreaCoords(CSet(innerWidth - boundaryWidth, 0), CSet(lidx, lidy)), // right
+			AreaCoords(CSet(boundaryWidth, innerHeight-boundaryWidth), CSet(lidx-boundaryWidth, lidy)), // top
+			AreaCoords(CSet(boundaryWidth, 0), CSet(lidx-boundaryWidth, boundaryWidth-1)), // bottom
+		};
+
+		const auto bw = boundaryWidth;
+		oa = {
+			AreaCoords(CSet(0, bw), CSet(bw-1, lidy-bw)), // left
+			AreaCoords(CSet(innerWidth-bw, bw), CSet(lidx, lidy-bw)), // right
+			sha[2],
+			sha[3],
+			AreaCoords(CSet(0, 0), CSet(bw-1, bw-1)), // corners
+			AreaCoords(CSet(0, innerHeight-bw), CSet(bw-1, lidy)),
+			AreaCoords(CSet(innerWidth-bw, 0), CSet(lidx, bw-1)),
+			AreaCoords(CSet(innerWidth-bw, innerHeight-bw), CSet(lidx, lidy)),
 		};
 	}
 };
 
 void test_wmi() {
-	WorkspaceMetainfo wmi(9, 2);
+	WorkspaceMetainfo wmi(9, 9, 2);
 
 	auto work_area = wmi.working_workspace_area();
 	auto innie = wmi.innies_space_area();
@@ -430,31 +1165,94 @@ void test_wmi() {
 	#undef STR
 }
 
-void iterate_over_area(AreaCoords area, std::function<void(const Coord, const Coord)> f) {
-	for(Coord x_idx = area.bottomLeft.x; x_idx <= area.upperRight.x; x_idx++) {
-		for(Coord y_idx = area.bottomLeft.y; y_idx <= area.upperRight.y; y_idx++) {
+/**
+ * Calls f(x,y) for every point of the area; y is the outer loop, because x is the contiguous dimension
+ * of Workspace (see Workspace::get_offset)
+ */
+template <typename F>
+inline void iterate_over_area(const AreaCoords& area, F f) {
+	for(Coord y_idx = area.bottomLeft.y; y_idx <= area.upperRight.y; y_idx++) {
+		for(Coord x_idx = area.bottomLeft.x; x_idx <= area.upperRight.x; x_idx++) {
 			f(x_idx, y_idx);
 		}
 	}
 }
 
-class Workspace : private NonCopyable {
+class Workspace : private NonCopyable, public HaloArrival<Workspace> {
+	friend class HaloArrival<Workspace>;
 public:
-	Workspace(const Coord innerSize, const Coord borderWidth, ClusterManager& cm, Comms& comm)
-			: innerSize(innerSize), cm(cm), comm(comm), borderWidth(borderWidth)
+	Workspace(const Coord innerWidth, const Coord innerHeight, const Coord borderWidth, ClusterManager& cm,
+	          Comms& comm, const TileShape& tile, ThreadPool& pool)
+			: innerWidth(innerWidth), innerHeight(innerHeight), cm(cm), comm(comm), borderWidth(borderWidth),
+			  tile(tile), pool(pool)
 	{
-		outerSize = innerSize+2*borderWidth;
-		memorySize = outerSize*outerSize;
+		outerWidth = innerWidth+2*borderWidth;
+		outerHeight = innerHeight+2*borderWidth;
+		memorySize = outerWidth*outerHeight;
 
 		neigh = cm.getNeighbours();
 		initialize_buffers();
 
-		comm_proxy = new NeighboursCommProxy(neigh, innerSize, borderWidth, [this](auto x, auto y) {
-			return this->get_offset(x,y);
-		});
-	}
+		colourParity = cm.getColourParity();
+		std::pair<Coord, Coord> peerSizes[4];
+		for(int i = 0; i < 4; i++) {
+			peerSizes[i] = cm.getInnerSizeAt(neighbourDirection[i][0], neighbourDirection[i][1]);
+		}
+		comm_proxy = new NeighboursCommProxy(neigh, innerWidth, innerHeight, borderWidth, colourParity, peerSizes,
+		                                     [this](auto x, auto y) { return this->get_offset(x,y); });
+
+		if(comm.neighbourhood()) {
+			std::vector<int> order;
+			const auto nc = cm.getNeighbourComm(order);
+			comm_proxy->init_neighbourhood(nc, order);
+		}
+
+		if(comm.typed()) {
+			comm_proxy->init_staging(comm.strided_packing(), cm.getComm(), cm.master_err_log());
+			for(int i = 0; i < 4; i++) {
+				unpacks = unpacks || comm_proxy->staged(static_cast<Neighbour>(i));
+			}
+		}
+
+		if(comm.packed()) {
+			unpacks = true;
+			if(comm.compressed()) {
+				compression = new HaloCompression(4);
+			}
+			const int depth = comm.halo_depth();
+			for(int i = 0; i < 4; i++) {
+				if(neigh[i] != N_INVALID) {
+					const auto n = static_cast<Neighbour>(i);
+					msgBound[i] = comm_proxy->message_bound(n, comm.wire());
+					sendMsg[i].resize(depth*msgBound[i]);
+					recvMsg[i].resize(depth*msgBound[i]);
+					sendRing[i].assign(depth, MPI_REQUEST_NULL);
+					recvRing[i].assign(depth, MPI_REQUEST_NULL);
+				}
+			}
+		}
+	}
 
 	~Workspace() {
+		/* neighbours wait for the last exchange below */
+		send_pending_encoding(true);
+
+		/* unlike point-to-point requests the last exchange can't be left pending - buffers, topology and windows go
+		 * away */
+		if(comm.neighbourhood() || comm.rma() || unpacks) {
+			comm.wait_for_receives();
+		}
+		/* neighbours' receives of the last exchange were posted long ago, those posted ahead will never match */
+		for(int i = 0; i < 4; i++) {
+			for(auto& rq: sendRing[i]) {
+				comm.wait_request(rq);
+			}
+			for(auto& rq: recvRing[i]) {
+				comm.cancel_request(rq);
+			}
+		}
+
+		delete compression;
 		delete comm_proxy;
 		freeBuffers();
 	}
@@ -467,7 +1265,169 @@ public:
 		return *elAddress(x,y,back);
 	}
 
-	Coord getInnerLength() {return innerSize;}
+	Coord getInnerWidth() {return innerWidth;}
+	Coord getInnerHeight() {return innerHeight;}
+
+	/**
+	 * Calls k(dst, src, stride, len) for every row of the area (tile after tile), where dst/src point to the first
+	 * point of the row in front/back buffer and stride is the distance to the same point in the next row
+	 */
+	template <typename K>
+	void iterate_over_spans(const AreaCoords& area, K k) {
+		pool.run_bands(area.bottomLeft.y, area.upperRight.y, [this, &area, &k](const Coord y_from, const Coord y_to) {
+			iterate_over_tiled_spans(area.bottomLeft.x, area.upperRight.x, y_from, y_to, tile,
+				[this, &k](const Coord x_idx, const Coord y_idx, const Coord len) {
+					k(elAddress(x_idx, y_idx, front), elAddress(x_idx, y_idx, back), outerWidth, len);
+				});
+		});
+	}
+
+	/**
+	 * Calls k(v, stride, len) for every row of the area, where v points to the first point of given colour in the
+	 * row, in back buffer (SOR updates in place), and points of that colour are v[0], v[2], ... v[len-1]
+	 */
+	template <typename K>
+	void iterate_over_colour(const AreaCoords& area, const Colour colour, K k) {
+		pool.run_bands(area.bottomLeft.y, area.upperRight.y, [=, &k](const Coord y_from, const Coord y_to) {
+			for(Coord y_idx = y_from; y_idx <= y_to; y_idx++) {
+				const auto x_idx = area.bottomLeft.x + ((area.bottomLeft.x + y_idx + colourParity + colour) & 1);
+				if(x_idx <= area.upperRight.x) {
+					k(elAddress(x_idx, y_idx, back), outerWidth, area.upperRight.x - x_idx + 1);
+				}
+			}
+		});
+	}
+
+	/**
+	 * Same as iterate_over_spans, only the calling thread (the one owning MPI, it gets the first band) lets p make
+	 * progress between rows
+	 */
+	template <typename K>
+	void iterate_over_spans(const AreaCoords& area, K k, ProgressEngine& p) {
+		pool.run_bands(area.bottomLeft.y, area.upperRight.y,
+		               [this, &area, &k, &p](const Coord y_from, const Coord y_to) {
+			const bool owner = y_from == area.bottomLeft.y;
+			iterate_over_tiled_spans(area.bottomLeft.x, area.upperRight.x, y_from, y_to, tile,
+				[this, &k, &p, owner](const Coord x_idx, const Coord y_idx, const Coord len) {
+					k(elAddress(x_idx, y_idx, front), elAddress(x_idx, y_idx, back), outerWidth, len);
+					if(owner) {
+						p.tick(len);
+					}
+				});
+		});
+	}
+
+	/**
+	 * iterate_over_colour counterpart of iterate_over_spans(area, k, p)
+	 */
+	template <typename K>
+	void iterate_over_colour(const AreaCoords& area, const Colour colour, K k, ProgressEngine& p) {
+		pool.run_bands(area.bottomLeft.y, area.upperRight.y, [=, &k, &p](const Coord y_from, const Coord y_to) {
+			const bool owner = y_from == area.bottomLeft.y;
+			for(Coord y_idx = y_from; y_idx <= y_to; y_idx++) {
+				const auto x_idx = area.bottomLeft.x + ((area.bottomLeft.x + y_idx + colourParity + colour) & 1);
+				if(x_idx <= area.upperRight.x) {
+					k(elAddress(x_idx, y_idx, back), outerWidth, area.upperRight.x - x_idx + 1);
+				}
+				if(owner) {
+					p.tick(area.upperRight.x - area.bottomLeft.x + 1);
+				}
+			}
+		});
+	}
+
+	/**
+	 * Same as iterate_over_spans, but on calling thread only and without tiling - for TileScheduler tasks
+	 */
+	template <typename K>
+	void iterate_over_tile(const AreaCoords& area, K k) {
+		const auto len = area.upperRight.x - area.bottomLeft.x + 1;
+		for(Coord y_idx = area.bottomLeft.y; y_idx <= area.upperRight.y; y_idx++) {
+			k(elAddress(area.bottomLeft.x, y_idx, front), elAddress(area.bottomLeft.x, y_idx, back), outerWidth, len);
+		}
+	}
+
+	/**
+	 * Cuts area into tiles for TileScheduler - appends them to tiles, and bitmasks of neighbours whose halo each of
+	 * them reads to deps
+	 */
+	void split_for_scheduler(const AreaCoords& area, std::vector<AreaCoords>& tiles, std::vector<unsigned>& deps) {
+		iterate_over_tiles(area.bottomLeft.x, area.upperRight.x, area.bottomLeft.y, area.upperRight.y, tile,
+			[this, &tiles, &deps](const Coord x0, const Coord x1, const Coord y0, const Coord y1) {
+				tiles.push_back(AreaCoords(CSet(x0, y0), CSet(x1, y1)));
+				deps.push_back(halo_dependencies(tiles.back()));
+			});
+	}
+
+	/**
+	 * Doesn't block
+	 * @return bitmask of neighbours whose halo has already arrived
+	 */
+	unsigned arrived_halos() {
+		const auto completed = comm.test_receives();
+
+		unsigned arrived = 0;
+		for(int i = 0; i < recvCount; i++) {
+			if(completed & (1u << i)) {
+				arrived |= recvNeighbours[i];
+			}
+		}
+
+		if(nodeWindow) {
+			copy_shared_halos();
+			arrived |= onNode & ~pendingShared;
+		}
+
+		if(unpacks) {
+			unpack_halos(arrived);
+		}
+		return arrived;
+	}
+
+	/**
+	 * Doesn't block - lets MPI move transfers of current exchange forward (poll of ProgressEngine)
+	 * @return same as arrived_halos()
+	 */
+	unsigned progress() {
+		send_pending_encoding(false);
+		comm.test_sends();
+		for(int i = 0; i < 4; i++) {
+			for(auto& rq: sendRing[i]) {
+				comm.test_request(rq);
+			}
+		}
+		return arrived_halos();
+	}
+
+	/**
+	 * Comms::packed(): send_in_boundary() leaves encoding to the next progress() - with Progress::THREAD that's
+	 * ProgressEngine's helper thread, so encoding runs behind the innies sweep instead of before it
+	 */
+	void defer_encoding(const bool defer) {
+		deferEncoding = defer;
+	}
+
+	OverlapStats& overlap_stats() {
+		return overlap;
+	}
+
+	/**
+	 * nullptr unless HaloExchange::COMPRESSED
+	 */
+	HaloCompression* halo_compression() {
+		return compression;
+	}
+
+	/**
+	 * Largest change of a halo value sent so far due to HaloPrecision
+	 */
+	NumType halo_rounding() const {
+		NumType r = 0;
+		for(auto v: haloRounding) {
+			r = std::max(r, v);
+		}
+		return r;
+	}
 
 	/*
 	 * All 4 functions are called before swap() is invoked!
@@ -475,27 +1435,189 @@ public:
 	 */
 
 	void ensure_out_boundary_arrived() {
-		comm.wait_for_receives();
+		auto wait = [this]() {
+			comm.wait_for_receives();
+
+			if(unpacks) {
+				unpack_halos(all_neighbours());
+			}
+
+			if(nodeWindow) {
+				NodeWindow::wait_until([this]() {
+					copy_shared_halos();
+					return pendingShared == 0;
+				});
+			}
+		};
+
+		if(arrived_halos() == all_neighbours()) {
+			wait();
+		} else {
+			overlap.wait(OverlapStats::RECEIVES, wait);
+		}
+		overlap.done(OverlapStats::RECEIVES);
 	}
 
 	void ensure_in_boundary_sent() {
-		comm.wait_for_send();
+		send_pending_encoding(true);
+
+		auto wait = [this]() {
+			comm.wait_for_send();
+
+			if(nodeWindow) {
+				NodeWindow::wait_until([this]() {
+					/* they may be waiting for us in here as well */
+					copy_shared_halos();
+					return shared_halos_consumed();
+				});
+			}
+		};
+
+		if(comm.test_sends() && shared_halos_consumed()) {
+			wait();
+		} else {
+			overlap.wait(OverlapStats::SENDS, wait);
+		}
+		overlap.done(OverlapStats::SENDS);
 	}
 
+	/*
+	 * With neighbourhood collective exchange sends go together with receives - in start_wait_for_new_out_border().
+	 * With RMA the puts (and neighbours' permission to put into this rank) are all done in send_in_boundary(), as
+	 * an access epoch can't be left open while waiting for the exposure one.
+	 * With shared memory "sending" to a neighbour on the same host is publishing that the buffer is ready, receiving
+	 * is copying from its buffer in arrived_halos()/ensure_out_boundary_arrived() and ensure_in_boundary_sent()
+	 * waits until all such neighbours copied.
+	 */
+
 	void send_in_boundary() {
+		if(comm.neighbourhood()) {
+			return;
+		}
+
+		if(comm.packed()) {
+			if(deferEncoding) {
+				pendingEncoding = front;
+			} else {
+				send_packed(front);
+			}
+			return;
+		}
+
+		if(comm.rma()) {
+			comm.begin_puts(front);
+			for(int i = 0; i < 4; i++) {
+				if(neigh[i] != N_INVALID) {
+					comm_proxy->schedule_put(comm, static_cast<Neighbour>(i), front);
+				}
+			}
+			comm.end_puts();
+			return;
+		}
+
 		for(int i = 0; i < 4; i++) {
-			if(neigh[i] != N_INVALID) {
+			if(via_comms(i)) {
 				comm_proxy->schedule_send(comm, static_cast<Neighbour>(i), front);
 			}
 		}
+		comm.start_scheduled();
+		publish_shared();
 	}
 
 	void start_wait_for_new_out_border() {
+		recvCount = 0;
+		if(comm.neighbourhood()) {
+			comm_proxy->schedule_exchange(comm, front);
+			recvNeighbours[recvCount++] = all_neighbours();
+			return;
+		}
+
+		if(comm.packed()) {
+			post_ring_receives();
+			recvSlot = static_cast<int>(awaitedExchanges++ % comm.halo_depth());
+			for(int i = 0; i < 4; i++) {
+				if(neigh[i] != N_INVALID) {
+					comm.adopt_recv(recvRing[i][recvSlot]);
+					recvNeighbours[recvCount++] = 1u << i;
+				}
+			}
+			unpacked = 0;
+			haloDst = front;
+			return;
+		}
+
+		if(comm.rma()) {
+			recvNeighbours[recvCount++] = all_neighbours();
+			return;
+		}
+
 		for(int i = 0; i < 4; i++) {
-			if(neigh[i] != N_INVALID) {
+			if(via_comms(i)) {
 				comm_proxy->schedule_recv(comm, static_cast<Neighbour>(i), front);
+				recvNeighbours[recvCount++] = 1u << i;
+			}
+		}
+		comm.start_scheduled();
+		pendingShared = onNode;
+		unpacked = 0;
+		haloDst = front;
+	}
+
+	/*
+	 * SOR counterparts of send_in_boundary/start_wait_for_new_out_border - back buffer, single colour
+	 */
+
+	void send_in_boundary(const Colour colour) {
+		if(comm.neighbourhood()) {
+			return;
+		}
+
+		if(comm.rma()) {
+			comm.begin_puts(back);
+			for(int i = 0; i < 4; i++) {
+				if(neigh[i] != N_INVALID) {
+					comm_proxy->schedule_put(comm, static_cast<Neighbour>(i), colour, back);
+				}
+			}
+			comm.end_puts();
+			return;
+		}
+
+		for(int i = 0; i < 4; i++) {
+			if(via_comms(i)) {
+				comm_proxy->schedule_send(comm, static_cast<Neighbour>(i), colour, back);
+			}
+		}
+		comm.start_scheduled();
+		publish_shared();
+	}
+
+	void start_wait_for_new_out_border(const Colour colour) {
+		recvCount = 0;
+		/* Comms::packed(): single colour of a border has every other point only, it goes as it is (uncompressed, in
+		 * full precision) */
+		unpacked = all_neighbours();
+
+		if(comm.neighbourhood()) {
+			comm_proxy->schedule_exchange(comm, colour, back);
+			recvNeighbours[recvCount++] = all_neighbours();
+			return;
+		}
+
+		if(comm.rma()) {
+			recvNeighbours[recvCount++] = all_neighbours();
+			return;
+		}
+
+		for(int i = 0; i < 4; i++) {
+			if(via_comms(i)) {
+				comm_proxy->schedule_recv(comm, static_cast<Neighbour>(i), colour, back);
+				recvNeighbours[recvCount++] = 1u << i;
 			}
 		}
+		comm.start_scheduled();
+		pendingShared = onNode;
+		haloDst = back;
 	}
 
 	void swap() {
@@ -505,10 +1627,10 @@ public:
 	void memory_dump(bool dump_front) {
 		auto* buffer = dump_front ? front : back;
 
-		for(Coord i = 0; i < outerSize; i++) {
+		for(Coord i = 0; i < outerHeight; i++) {
 
-			for(Coord j = 0; j < outerSize; j++) {
-				std::cerr << std::fixed << std::setprecision(2) << buffer[i*outerSize+j] << " ";
+			for(Coord j = 0; j < outerWidth; j++) {
+				std::cerr << std::fixed << std::setprecision(2) << buffer[i*outerWidth+j] << " ";
 			}
 
 			std::cerr << std::endl;
@@ -521,18 +1643,84 @@ private:
 	int* neigh;
 	NeighboursCommProxy* comm_proxy;
 
-	const Coord innerSize;
-	Coord outerSize;
+	const Coord innerWidth;
+	const Coord innerHeight;
+	Coord outerWidth;
+	Coord outerHeight;
 	Coord memorySize;
 
 	const Coord borderWidth;
+	const TileShape tile;
+	ThreadPool& pool;
+	int colourParity;
+
+	/* bitmask of neighbours each of the outstanding receives (in order they were scheduled) comes from */
+	unsigned recvNeighbours[4];
+	int recvCount = 0;
+
+	OverlapStats overlap;
+
+	/* Workspace (not MPI) writes halos of current exchange - packed messages or staged strided ones (see
+	 * NeighboursCommProxy::init_staging()) */
+	bool unpacks = false;
+	/* Comms::packed(): messages to and from every neighbour, neighbours whose message was decoded already; codec
+	 * policy with HaloExchange::COMPRESSED, largest rounding of values sent to each neighbour */
+	HaloCompression* compression = nullptr;
+	std::vector<uint8_t> sendMsg[4];
+	std::vector<uint8_t> recvMsg[4];
+	Coord sendLength[4];
+	unsigned unpacked = 0;
+	NumType haloRounding[4] = {};
+	/* Comms::packed(): messages are rings of Comms::halo_depth() slots msgBound apart, with requests of every slot
+	 * (posted receives of future exchanges, sends not known to be complete); exchanges sent, with receives posted
+	 * and awaited so far, slot of current exchange's messages */
+	Coord msgBound[4] = {};
+	std::vector<MPI_Request> sendRing[4];
+	std::vector<MPI_Request> recvRing[4];
+	long long sentExchanges = 0;
+	long long postedExchanges = 0;
+	long long awaitedExchanges = 0;
+	int recvSlot = 0;
+	/* defer_encoding() - buffer whose halos send_in_boundary() left to progress(), nullptr once they're sent */
+	bool deferEncoding = false;
+	const NumType* pendingEncoding = nullptr;
+
+	/* buffer halos of current exchange end up in, if Workspace (not MPI) writes them */
+	NumType* haloDst = nullptr;
+
+	/* HaloExchange::SHM: buffers of ranks on this host, bitmask of neighbours among them, those whose halo hasn't
+	 * been copied yet and exchanges published so far */
+	NodeWindow* nodeWindow = nullptr;
+	unsigned onNode = 0;
+	unsigned pendingShared = 0;
+	long long exchanges = 0;
 
 	NumType *front;
 	NumType *back;
 
 	void initialize_buffers() {
-		front = new NumType[memorySize];
-		back = new NumType[memorySize];
+		if(comm.rma()) {
+			std::vector<int> peers;
+			for(int i = 0; i < 4; i++) {
+				if(neigh[i] != N_INVALID) {
+					peers.push_back(neigh[i]);
+				}
+			}
+			front = comm.allocate_exposed(memorySize, peers);
+			back = comm.allocate_exposed(memorySize, peers);
+		} else if(comm.shm()) {
+			nodeWindow = new NodeWindow(cm.getComm(), memorySize, 2);
+			front = nodeWindow->buffer(0);
+			back = nodeWindow->buffer(1);
+			for(int i = 0; i < 4; i++) {
+				if(neigh[i] != N_INVALID && nodeWindow->on_node(neigh[i])) {
+					onNode |= 1u << i;
+				}
+			}
+		} else {
+			front = new NumType[memorySize];
+			back = new NumType[memorySize];
+		}
 
 		for(Coord i = 0; i < memorySize; i++) {
 			front[i] = 0.0;
@@ -541,14 +1729,210 @@ private:
 	}
 
 	void freeBuffers() {
-		delete[] front;
-		delete[] back;
+		if(comm.rma()) {
+			comm.free_windows();
+		} else if(nodeWindow) {
+			delete nodeWindow;
+		} else {
+			delete[] front;
+			delete[] back;
+		}
 	}
 
 	NumType* elAddress(const Coord x, const Coord y, NumType* base) {
 		return base + get_offset(x,y);
 	}
 
+	bool via_comms(const int i) {
+		return neigh[i] != N_INVALID && !(onNode & (1u << i));
+	}
+
+	/**
+	 * Encodes halos for all neighbours (in parallel on the pool, they're independent, or one after another on the
+	 * calling thread) into the next ring slot and sends them - waits only for sends which used that slot
+	 * Comms::halo_depth() exchanges ago
+	 */
+	void send_packed(const NumType* buffer, const bool onPool = true) {
+		const int slot = static_cast<int>(sentExchanges++ % comm.halo_depth());
+		for(int i = 0; i < 4; i++) {
+			if(neigh[i] != N_INVALID && !comm.test_request(sendRing[i][slot])) {
+				overlap.wait(OverlapStats::SENDS, [&]() { comm.wait_request(sendRing[i][slot]); });
+			}
+		}
+
+		auto encode = [this, buffer, slot](const int i) {
+			if(neigh[i] != N_INVALID) {
+				const auto n = static_cast<Neighbour>(i);
+				const auto& wire = comm.wire();
+				const bool tried = compression && compression->should_try(i);
+				sendLength[i] = comm_proxy->pack(n, buffer, sendMsg[i].data() + slot*msgBound[i], wire, tried,
+				                                 haloRounding[i]);
+				if(compression) {
+					compression->sent(i, halo_message_raw(comm_proxy->halo_points(n), wire), sendLength[i], tried);
+				}
+			}
+		};
+		if(onPool) {
+			pool.run(4, encode);
+		} else {
+			for(int i = 0; i < 4; i++) {
+				encode(i);
+			}
+		}
+
+		for(int i = 0; i < 4; i++) {
+			if(neigh[i] != N_INVALID) {
+				sendRing[i][slot] = comm.post_send_bytes(neigh[i], sendMsg[i].data() + slot*msgBound[i],
+				                                         sendLength[i], slot);
+			}
+		}
+	}
+
+	/**
+	 * Encodes and sends halos send_in_boundary() left to progress(), if any. Without block (progress(), possibly
+	 * on the helper thread while the pool runs the sweep) only once their ring slot is free, and without the pool.
+	 */
+	void send_pending_encoding(const bool block) {
+		if(pendingEncoding == nullptr) {
+			return;
+		}
+
+		if(!block) {
+			const int slot = static_cast<int>(sentExchanges % comm.halo_depth());
+			for(int i = 0; i < 4; i++) {
+				if(neigh[i] != N_INVALID && !comm.test_request(sendRing[i][slot])) {
+					return;
+				}
+			}
+		}
+
+		send_packed(pendingEncoding, block);
+		pendingEncoding = nullptr;
+	}
+
+	/**
+	 * Keeps receives of the next Comms::halo_depth() exchanges posted - slot of the previous one is free again,
+	 * it's been unpacked
+	 */
+	void post_ring_receives() {
+		const int depth = comm.halo_depth();
+		for(; postedExchanges < awaitedExchanges + depth; postedExchanges++) {
+			const int slot = static_cast<int>(postedExchanges % depth);
+			for(int i = 0; i < 4; i++) {
+				if(neigh[i] != N_INVALID) {
+					recvRing[i][slot] = comm.post_recv_bytes(neigh[i], recvMsg[i].data() + slot*msgBound[i],
+					                                         msgBound[i], slot);
+				}
+			}
+		}
+	}
+
+	/**
+	 * Decodes (or scatters, if staged) messages of neighbours in arrived which weren't decoded yet
+	 */
+	void unpack_halos(const unsigned arrived) {
+		for(int i = 0; i < 4; i++) {
+			if((arrived & ~unpacked) & (1u << i)) {
+				const auto n = static_cast<Neighbour>(i);
+				if(comm.packed()) {
+					comm_proxy->unpack(n, haloDst, recvMsg[i].data() + recvSlot*msgBound[i], comm.wire());
+				} else if(via_comms(i) && comm_proxy->staged(n)) {
+					comm_proxy->unstage(n, haloDst);
+				}
+				unpacked |= 1u << i;
+			}
+		}
+	}
+
+	bool shared_halos_consumed() {
+		for(int i = 0; i < 4; i++) {
+			if((onNode & (1u << i)) && nodeWindow->consumed(neigh[i]) < exchanges) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void publish_shared() {
+		if(nodeWindow) {
+			nodeWindow->publish(++exchanges);
+		}
+	}
+
+	/**
+	 * Copies halos of neighbours on this host which published current exchange already. Neighbours swap buffers in
+	 * lockstep with us, so the data is in their buffer of the same index as haloDst.
+	 */
+	void copy_shared_halos() {
+		if(pendingShared == 0) {
+			return;
+		}
+
+		const int index = haloDst == nodeWindow->buffer(0) ? 0 : 1;
+		for(int i = 0; i < 4; i++) {
+			if((pendingShared & (1u << i)) && nodeWindow->ready(neigh[i]) >= exchanges) {
+				comm_proxy->copy_halo(static_cast<Neighbour>(i), haloDst, nodeWindow->peer_buffer(neigh[i], index));
+				pendingShared &= ~(1u << i);
+			}
+		}
+
+		if(pendingShared == 0) {
+			nodeWindow->consume(exchanges);
+		}
+	}
+
+	unsigned all_neighbours() {
+		unsigned mask = 0;
+		for(int i = 0; i < 4; i++) {
+			if(neigh[i] != N_INVALID) {
+				mask |= 1u << i;
+			}
+		}
+		return mask;
+	}
+
+	/**
+	 * Halo of a neighbour in given direction along a dimension of innerLength points
+	 */
+	std::pair<Coord, Coord> halo_range(const int direction, const Coord innerLength) {
+		if(direction < 0) {
+			return std::make_pair(-borderWidth, -1LL);
+		} else if(direction > 0) {
+			return std::make_pair(innerLength, innerLength + borderWidth - 1);
+		} else {
+			return std::make_pair(0LL, innerLength - 1);
+		}
+	}
+
+	/**
+	 * Blocks until at least one more halo receive completes (see HaloArrival) - halos of neighbours on this host
+	 * are only polled for
+	 */
+	void wait_some_halos() {
+		if(pendingShared == 0) {
+			comm.wait_some_receives();
+		} else {
+			std::this_thread::yield();
+		}
+	}
+
+	unsigned halo_dependencies(const AreaCoords& a) {
+		unsigned deps = 0;
+		for(int i = 0; i < 4; i++) {
+			if(neigh[i] == N_INVALID) {
+				continue;
+			}
+
+			const auto xr = halo_range(neighbourDirection[i][0], innerWidth);
+			const auto yr = halo_range(neighbourDirection[i][1], innerHeight);
+			if(stencil_reads(a.bottomLeft.x, a.upperRight.x, a.bottomLeft.y, a.upperRight.y,
+			                 xr.first, xr.second, yr.first, yr.second)) {
+				deps |= 1u << i;
+			}
+		}
+		return deps;
+	}
+
 	/*
 	 * Because MPI reads (and writes) directy from front/back, memory layout is no longer arbitrary
 	 * I decided to store coordinate system in horizontally mirrored manner:
@@ -566,7 +1950,7 @@ private:
 	 *
 	 */
 	Coord get_offset(const Coord x, const Coord y) {
-		return outerSize*(borderWidth + y) + (borderWidth + x);
+		return outerWidth*(borderWidth + y) + (borderWidth + x);
 	}
 
 	void swapBuffers() {
@@ -584,36 +1968,65 @@ std::string filenameGenerator(int nodeId) {
 
 const Coord BOUNDARY_WIDTH = 1;
 
-int main(int argc, char **argv) {
-	std::cerr << __FILE__ << std::endl;
+/**
+ * Red-black SOR instead of Jacobi: each time step is a red and a black half-sweep, both updating back buffer in
+ * place. Only the colour just updated is exchanged (half of the border), and while it travels innies of the other
+ * colour are computed - they read no halo.
+ */
+TimeStepCount run_red_black_sor(Workspace& w, const AreaCoords& wi_area, const std::array<AreaCoords, 8>& wo_area,
+                                const Config& conf, ConvergenceCheck& conv, ProgressEngine& progress,
+                                FileDumper<Workspace>& d) {
+	auto sor_f = [&conv, &conf](NumType* v, const Coord stride, const Coord len) {
+		const auto res = sor_row(v, stride, len, conf.omega);
+		if(conv.measuring()) {
+			conv.add(res);
+		}
+	};
 
-	auto conf = parse_cli(argc, argv);
+	for(TimeStepCount ts = 0; ts < conf.timeSteps; ts++) {
+		DL( "Entering SOR timestep loop, ts = " << ts )
+		conv.begin_sweep(ts, ts);
 
-	ClusterManager cm(conf.N);
-	auto n_slice = cm.getPartitioner().get_n_slice();
-	NumType x_offset, y_offset;
-	std::tie(x_offset, y_offset) = cm.getOffsets();
-	auto h = cm.getPartitioner().get_h();
+		for(auto colour: {RED, BLACK}) {
+			progress.begin_overlap();
+			w.iterate_over_colour(wi_area, colour, sor_f, progress);
+			progress.end_overlap();
 
-	Comms comm;
-	Workspace w(n_slice, BOUNDARY_WIDTH, cm, comm);
-	WorkspaceMetainfo wi(n_slice, BOUNDARY_WIDTH);
+			w.ensure_in_boundary_sent();
 
-	FileDumper<Workspace> d(filenameGenerator(cm.getNodeId()),
-	                        n_slice,
-	                        x_offset,
-	                        y_offset,
-	                        h,
-	                        get_freq_sel(conf.timeSteps));
+			/* other colour, sent after previous half-sweep (both colours before the first one) */
+			w.iterate_as_halos_arrive(wo_area, [&w, colour, &sor_f](const AreaCoords& a) {
+				w.iterate_over_colour(a, colour, sor_f);
+			});
+			w.ensure_out_boundary_arrived();
 
-	Timer timer;
+			w.send_in_boundary(colour);
+			w.start_wait_for_new_out_border(colour);
+		}
 
-	MPI_Barrier(cm.getComm());
-	timer.start();
+		if (unlikely(conf.outputEnabled)) {
+			d.dumpBackbuffer(w, ts);
+		}
+
+		if(conv.end_sweep(ts + 1)) {
+			return ts + 1;
+		}
+	}
+	return conf.timeSteps;
+}
 
+/**
+ * Sets initial condition f on w and runs conf.timeSteps steps on it - Jacobi, red-black SOR with conf.omega - or
+ * fewer, if conv stops them
+ * @return steps done
+ */
+TimeStepCount run(Workspace& w, const WorkspaceMetainfo& wi, const Config& conf, ConvergenceCheck& conv,
+                  ProgressEngine& progress, ThreadPool& pool, FileDumper<Workspace>& d, const NumType x_offset,
+                  const NumType y_offset, const NumType h) {
 	auto ww_area = wi.working_workspace_area();
 	auto wi_area = wi.innies_space_area();
 	auto ws_area = wi.shared_areas();
+	auto wo_area = wi.outie_areas();
 
 	DL( "filling boundary condition" )
 
@@ -643,70 +2056,183 @@ int main(int argc, char **argv) {
 
 	DL( "initial communication done" )
 
-	auto eq_f = [&w](const Coord x_idx, const Coord y_idx) {
-		// std::cerr << "Entering Y loop, x y " << y_idx << std::endl;
+	auto eq_f = [&conv](NumType* dst, const NumType* src, const Coord stride, const Coord len) {
+		if(conv.measuring()) {
+			conv.add(equation_row_residual(dst, src, stride, len));
+		} else {
+			equation_row(dst, src, stride, len);
+		}
+	};
 
-		auto eq_val = equation(
-				w.elb(x_idx - 1, y_idx),
-				w.elb(x_idx, y_idx - 1),
-				w.elb(x_idx + 1, y_idx),
-				w.elb(x_idx, y_idx + 1)
-		);
+	TileScheduler scheduler(pool);
+	/* polls for halos between tiles anyway, with Progress::POLL it moves sends forward too */
+	auto sched_poll = [&w, &conf]() { return conf.progress == Progress::POLL ? w.progress() : w.arrived_halos(); };
+	std::vector<AreaCoords> sched_tiles;
+	std::vector<unsigned> sched_deps;
+	if(conf.scheduledTiles) {
+		w.split_for_scheduler(wi_area, sched_tiles, sched_deps);
+		for(auto a: ws_area) {
+			w.split_for_scheduler(a, sched_tiles, sched_deps);
+		}
+	}
 
-		w.set_elf(x_idx, y_idx, eq_val);
-	};
+	if(conf.omega > 0) {
+		return run_red_black_sor(w, wi_area, wo_area, conf, conv, progress, d);
+	} else {
+		for(TimeStepCount ts = 0; ts < conf.timeSteps; ts++) {
+			DL( "Entering timestep loop, ts = " << ts )
+
+			conv.begin_sweep(ts, ts);
+
+			DL( "front dump - before innies calculated" )
+			DBG_ONLY( w.memory_dump(true) )
+			DL ("back dump - before innies calculated")
+			DBG_ONLY( w.memory_dump(false) )
+
+			if(conf.scheduledTiles) {
+				scheduler.run(sched_deps,
+				              [&w, &sched_tiles, &eq_f](const int t) { w.iterate_over_tile(sched_tiles[t], eq_f); },
+				              sched_poll);
+				DL( "Scheduled tiles iterated, ts = " << ts )
+
+				w.ensure_out_boundary_arrived();
+				w.ensure_in_boundary_sent();
+			} else {
+				progress.begin_overlap();
+				w.iterate_over_spans(wi_area, eq_f, progress);
+				progress.end_overlap();
+				DL( "Innies iterated, ts = " << ts )
+
+				w.ensure_in_boundary_sent();
+				DL( "In boundary sent, ts = " << ts )
+
+				DL( "front dump - innies calculated" )
+				DBG_ONLY( w.memory_dump(true) )
+				DL ("back dump - innies calculated")
+				DBG_ONLY( w.memory_dump(false) )
+
+				w.iterate_as_halos_arrive(wo_area, [&w, &eq_f](const AreaCoords& a) {
+					w.iterate_over_spans(a, eq_f);
+				});
+				w.ensure_out_boundary_arrived();
+				DL( "Out boundary arrived, ts = " << ts )
+			}
 
-	for(TimeStepCount ts = 0; ts < conf.timeSteps; ts++) {
-		DL( "Entering timestep loop, ts = " << ts )
+			DL( "Outies iterated, ts = " << ts )
 
-		DL( "front dump - before innies calculated" )
-		DBG_ONLY( w.memory_dump(true) )
-		DL ("back dump - before innies calculated")
-		DBG_ONLY( w.memory_dump(false) )
+			DL( "front dump - outies calculated" )
+			DBG_ONLY( w.memory_dump(true) )
+			DL ("back dump - outies calculated")
+			DBG_ONLY( w.memory_dump(false) )
 
-		iterate_over_area(wi_area, eq_f);
-		DL( "Innies iterated, ts = " << ts )
+			w.send_in_boundary();
+			DL( "In boundary send scheduled, ts = " << ts )
+			w.start_wait_for_new_out_border();
 
-		w.ensure_out_boundary_arrived();
-		DL( "Out boundary arrived, ts = " << ts )
-		w.ensure_in_boundary_sent();
-		DL( "In boundary sent, ts = " << ts )
+			DL( "Entering file dump" )
+			if (unlikely(conf.outputEnabled)) {
+				d.dumpBackbuffer(w, ts);
+			}
 
-		DL( "front dump - innies calculated" )
-		DBG_ONLY( w.memory_dump(true) )
-		DL ("back dump - innies calculated")
-		DBG_ONLY( w.memory_dump(false) )
+			DL( "Before swap, ts = " << ts )
+			w.swap();
+			DL( "After swap, ts = " << ts )
 
-		for(auto a: ws_area) {
-			iterate_over_area(a, eq_f);
+			if(conv.end_sweep(ts + 1)) {
+				return ts + 1;
+			}
 		}
+		return conf.timeSteps;
+	}
+}
 
-		DL( "Outies iterated, ts = " << ts )
-
-		DL( "front dump - outies calculated" )
-		DBG_ONLY( w.memory_dump(true) )
-		DL ("back dump - outies calculated")
-		DBG_ONLY( w.memory_dump(false) )
+int main(int argc, char **argv) {
+	std::cerr << __FILE__ << std::endl;
 
-		w.send_in_boundary();
-		DL( "In boundary send scheduled, ts = " << ts )
-		w.start_wait_for_new_out_border();
+	auto conf = parse_cli(argc, argv);
 
-		DL( "Entering file dump" )
-		if (unlikely(conf.outputEnabled)) {
-			d.dumpBackbuffer(w, ts);
-		}
+	/* conf.progress falls back to POLL if MPI can't do THREAD */
+	ClusterManager cm(conf.N, HaloShape{BOUNDARY_WIDTH, false}, conf.decomposition, conf.placement, conf.progress);
+	Coord width, height;
+	std::tie(width, height) = cm.getInnerSize();
+	NumType x_offset, y_offset;
+	std::tie(x_offset, y_offset) = cm.getOffsets();
+	auto h = cm.getPartitioner().get_h();
 
-		DL( "Before swap, ts = " << ts )
-		w.swap();
-		DL( "After swap, ts = " << ts )
+	require_fixed_partition(conf.rebalanceEvery);
+	if(conf.omega > 0) {
+		/* single colour halos go typed, as they are - see Workspace::start_wait_for_new_out_border(Colour) */
+		require_halo_exchange(conf.haloExchange, {HaloExchange::P2P, HaloExchange::PERSISTENT, HaloExchange::NEIGHBOUR,
+		                                          HaloExchange::RMA, HaloExchange::SHM});
+		require_halo_depth(conf.haloDepth, 1);
+		require_full_halo_precision(conf.haloPrecision);
 	}
+	Comms comm(cm.getComm(), conf.haloExchange, conf.haloPrecision, conf.haloPacking, conf.haloDepth);
+	ThreadPool pool(conf.threads);
+	Workspace w(width, height, BOUNDARY_WIDTH, cm, comm, conf.tile, pool);
+	/* scheduled tiles poll for halos without progress() */
+	w.defer_encoding(conf.progress == Progress::THREAD && !conf.scheduledTiles);
+	ProgressEngine progress(conf.progress, [&w]() { w.progress(); });
+	WorkspaceMetainfo wi(width, height, BOUNDARY_WIDTH);
+
+	FileDumper<Workspace> d(filenameGenerator(cm.getNodeId()),
+	                        width,
+	                        x_offset,
+	                        y_offset,
+	                        h,
+	                        get_freq_sel(conf.timeSteps));
+
+	Timer timer;
+
+	MPI_Barrier(cm.getComm());
+	timer.start();
+
+	ConvergenceCheck conv(conf, cm.getComm());
+	const auto stepsDone = run(w, wi, conf, conv, progress, pool, d, x_offset, y_offset, h);
 
 	MPI_Barrier(cm.getComm());
 	auto duration = timer.stop();
+	w.overlap_stats().reduce(cm.getComm());
+	if(w.halo_compression()) {
+		w.halo_compression()->reduce(cm.getComm());
+	}
+
+	HaloPrecisionError haloError(conf.haloPrecision, stepsDone);
+	if(conf.haloPrecision != HaloPrecision::FULL) {
+		haloError.rounding(w.halo_rounding());
+
+		/* untimed - the same steps on a shadow workspace with full precision halos, over a communicator of its
+		 * own so that none of its messages meets those of w */
+		const auto shadowConf = HaloPrecisionError::shadow_config(conf, stepsDone);
+		MPI_Comm shadowMpiComm;
+		MPI_Comm_dup(cm.getComm(), &shadowMpiComm);
+		{
+			Comms shadowComm(shadowMpiComm, shadowConf.haloExchange, shadowConf.haloPrecision, shadowConf.haloPacking,
+			                 shadowConf.haloDepth);
+			Workspace shadow(width, height, BOUNDARY_WIDTH, cm, shadowComm, shadowConf.tile, pool);
+			ProgressEngine shadowProgress(shadowConf.progress, []() {});
+			ConvergenceCheck shadowConv(shadowConf);
+			run(shadow, wi, shadowConf, shadowConv, shadowProgress, pool, d, x_offset, y_offset, h);
+
+			iterate_over_area(wi.working_workspace_area(), [&w, &shadow, &haloError](const Coord x_idx,
+			                                                                          const Coord y_idx) {
+				haloError.compare(w.elb(x_idx, y_idx), shadow.elb(x_idx, y_idx));
+			});
+		}
+		MPI_Comm_free(&shadowMpiComm);
+		haloError.reduce(cm.getComm());
+	}
 
 	if(cm.getNodeId() == 0) {
-		print_result("parallel_gap", cm.getNodeCount(), duration, conf);
+		print_result(conf.omega > 0 ? "parallel_gap_sor" : "parallel_gap", cm.getNodeCount(), duration, conf);
+		conv.report(std::cerr);
+		w.overlap_stats().report(std::cerr);
+		if(w.halo_compression()) {
+			w.halo_compression()->report(std::cerr);
+		}
+		if(conf.haloPrecision != HaloPrecision::FULL) {
+			haloError.report(std::cerr);
+		}
 		std::cerr << ((double)duration)/1000000000 << " s" << std::endl;
 	}
 
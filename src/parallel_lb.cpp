@@ -4,7 +4,12 @@
 #include <iostream>
 #include <cmath>
 #include <cstring>
+#include <memory>
+#include <vector>
 #include "shared.h"
+#include "kernels.h"
+#include "Convergence.h"
+#include "ThreadPool.h"
 
 const int N_INVALID = -1;
 
@@ -15,17 +20,33 @@ enum Neighbour {
 	BOTTOM = 3,
 };
 
+/* rebalance only when the slowest column (row) takes this many times longer than the fastest one */
+const double REBALANCE_THRESHOLD = 1.1;
+
+/* inner points of a node within the whole point grid - first one and size */
+struct NodeBlock {
+	Coord x, y, width, height;
+};
+
 class ClusterManager {
 public:
-	ClusterManager(const Coord N) : bitBucket(0) {
-		MPI_Init(nullptr, nullptr);
+	ClusterManager(const Coord N, const Decomposition decomposition, const Placement placement) : bitBucket(0) {
+		/* workspace sweeps may be split across a ThreadPool, but MPI is called only from the main thread */
+		int threadSupport;
+		MPI_Init_thread(nullptr, nullptr, MPI_THREAD_FUNNELED, &threadSupport);
+		MPI_Comm_size(MPI_COMM_WORLD, &nodeCount);
+
+		partitioner = new Partitioner(nodeCount, 0.0, 1.0, N, decomposition);
+		gridRows = partitioner->get_nodes_grid_rows();
+		gridColumns = partitioner->get_nodes_grid_columns();
+		comm = placed_comm(placement, gridRows, gridColumns, std::cerr);
 		MPI_Comm_rank(comm, &nodeId);
-		MPI_Comm_size(comm, &nodeCount);
-
-		partitioner = new Partitioner(nodeCount, 0.0, 1.0, N);
-		sideLen = partitioner->get_nodes_grid_dimm();
 		std::tie(row, column) = partitioner->node_id_to_grid_pos(nodeId);
 
+		if(threadSupport < MPI_THREAD_FUNNELED) {
+			err_log() << "WARN: MPI library doesn't support MPI_THREAD_FUNNELED, use single thread per rank" << std::endl;
+		}
+
 		initNeighbours();
 
 		err_log() << "Cluster initialized successfully. I'm (" << row << "," << column << ")" << std::endl;
@@ -33,6 +54,7 @@ public:
 
 	~ClusterManager() {
 		delete partitioner;
+		MPI_Comm_free(&comm);
 		MPI_Finalize();
 	}
 
@@ -41,6 +63,10 @@ public:
 	int getNodeCount() { return nodeCount; }
 	int getNodeId() { return nodeId; }
 	std::pair<NumType, NumType> getOffsets() { return partitioner->get_math_offset_node(row, column); };
+	/* points of this node along x and y */
+	std::pair<Coord, Coord> getInnerSize() {
+		return std::make_pair(partitioner->get_n_columns(column), partitioner->get_n_rows(row));
+	}
 	MPI_Comm getComm() { return comm; }
 
 	std::ostream& err_log() {
@@ -61,9 +87,48 @@ public:
 		return &neighbours[0];
 	}
 
+	std::vector<NodeBlock> getNodeBlocks() {
+		std::vector<NodeBlock> blocks;
+		for(int node = 0; node < nodeCount; node++) {
+			int r, c;
+			std::tie(r, c) = partitioner->node_id_to_grid_pos(node);
+			Coord x, y;
+			std::tie(x, y) = partitioner->get_index_offset_node(r, c);
+			blocks.push_back(NodeBlock{x, y, partitioner->get_n_columns(c), partitioner->get_n_rows(r)});
+		}
+		return blocks;
+	}
+
+	/**
+	 * Moves partition boundaries (see Partitioner::rebalance()) by computeTime of every node, averaged over grid
+	 * columns and rows, when they differ by more than REBALANCE_THRESHOLD. Collective.
+	 * @return whether the boundaries moved
+	 */
+	bool rebalance(const double computeTime) {
+		std::vector<double> times(gridColumns + gridRows, 0);
+		times[column] = computeTime;
+		times[gridColumns + row] = computeTime;
+		MPI_Allreduce(MPI_IN_PLACE, times.data(), static_cast<int>(times.size()), MPI_DOUBLE, MPI_SUM, comm);
+
+		std::vector<double> columnTimes(times.begin(), times.begin() + gridColumns);
+		std::vector<double> rowTimes(times.begin() + gridColumns, times.end());
+		for(auto& t: columnTimes) { t /= gridRows; }
+		for(auto& t: rowTimes) { t /= gridColumns; }
+
+		auto imbalance = [](const std::vector<double>& v) {
+			const auto mm = std::minmax_element(v.begin(), v.end());
+			return *mm.first > 0 ? *mm.second / *mm.first : 1.0;
+		};
+		if(std::max(imbalance(columnTimes), imbalance(rowTimes)) < REBALANCE_THRESHOLD) {
+			return false;
+		}
+
+		return partitioner->rebalance(columnTimes, rowTimes);
+	}
 
 private:
-	const static auto comm = MPI_COMM_WORLD;
+	/* ranks renumbered so that rank is the node id, see placed_comm() */
+	MPI_Comm comm;
 
 	int nodeId;
 	int nodeCount;
@@ -72,22 +137,23 @@ private:
 
 	Partitioner *partitioner;
 
-	int sideLen;
+	int gridRows;
+	int gridColumns;
 	int neighbours[4];
 
 	std::ostream bitBucket;
 
 	void initNeighbours() {
 		if(row == 0) { neighbours[Neighbour::BOTTOM] = N_INVALID; }
-		else { neighbours[Neighbour::BOTTOM] = nodeId-sideLen; }
+		else { neighbours[Neighbour::BOTTOM] = nodeId-gridColumns; }
 
-		if(row == sideLen-1) { neighbours[Neighbour::TOP] = N_INVALID; }
-		else { neighbours[Neighbour::TOP] = nodeId+sideLen; }
+		if(row == gridRows-1) { neighbours[Neighbour::TOP] = N_INVALID; }
+		else { neighbours[Neighbour::TOP] = nodeId+gridColumns; }
 
 		if(column == 0) { neighbours[Neighbour::LEFT] = N_INVALID; }
 		else { neighbours[Neighbour::LEFT] = nodeId-1; }
 
-		if(column == sideLen-1) { neighbours[Neighbour::RIGHT] = N_INVALID; }
+		if(column == gridColumns-1) { neighbours[Neighbour::RIGHT] = N_INVALID; }
 		else { neighbours[Neighbour::RIGHT] = nodeId+1; }
 
 		err_log() << "Neighbours: "
@@ -133,20 +199,47 @@ private:
  *
  */
 
+/**
+ * With HaloExchange::PERSISTENT exchange() only records the requests - built on the first step, as neighbours and
+ * edge buffers never change - and wait() starts them all at once
+ */
 class Comms {
 public:
-	Comms(const Coord innerLength) : innerLength(innerLength) {
+	Comms(const MPI_Comm comm, const HaloExchange mode)
+			: comm(comm), persistent(mode == HaloExchange::PERSISTENT), initialized(0) {
+		require_halo_exchange(mode, {HaloExchange::P2P, HaloExchange::PERSISTENT});
+
+		for(int i = 0; i < RQ_COUNT; i++) {
+			rq[i] = MPI_REQUEST_NULL;
+		}
 		reset();
 	}
 
-	void exchange(int targetId, NumType* sendBuffer, NumType* receiveBuffer) {
-		MPI_Isend(sendBuffer, innerLength, NUM_MPI_DT, targetId, 1, MPI_COMM_WORLD, rq + nextId);
-		MPI_Irecv(receiveBuffer, innerLength, NUM_MPI_DT, targetId, MPI_ANY_TAG, MPI_COMM_WORLD, rq + nextId + 1);
+	~Comms() {
+		for(int i = 0; i < initialized; i++) {
+			MPI_Request_free(rq + i);
+		}
+	}
+
+	void exchange(int targetId, NumType* sendBuffer, NumType* receiveBuffer, const Coord length) {
+		if(!persistent) {
+			MPI_Isend(sendBuffer, length, NUM_MPI_DT, targetId, 1, comm, rq + nextId);
+			MPI_Irecv(receiveBuffer, length, NUM_MPI_DT, targetId, MPI_ANY_TAG, comm, rq + nextId + 1);
+		} else if(nextId == initialized) {
+			MPI_Send_init(sendBuffer, length, NUM_MPI_DT, targetId, 1, comm, rq + nextId);
+			MPI_Recv_init(receiveBuffer, length, NUM_MPI_DT, targetId, MPI_ANY_TAG, comm,
+			              rq + nextId + 1);
+			initialized += 2;
+		}
 
 		nextId += 2;
 	}
 
 	void wait() {
+		if(persistent) {
+			MPI_Startall(nextId, rq);
+		}
+
 		DL( "NextId: " << nextId )
 		for(int i = 0; i < nextId; i++) {
 			int finished;
@@ -156,28 +249,47 @@ public:
 		DL( "Wait finished" )
 	}
 
+	/**
+	 * Edge buffers are different now - persistent requests are built anew on the next step
+	 */
+	void rebuild() {
+		for(int i = 0; i < initialized; i++) {
+			MPI_Request_free(rq + i);
+		}
+		initialized = 0;
+		reset();
+	}
+
 	void reset() {
-		for(int i = 0; i < RQ_COUNT; i++) {
-			rq[i] = MPI_REQUEST_NULL;
+		if(!persistent) {
+			for(int i = 0; i < RQ_COUNT; i++) {
+				rq[i] = MPI_REQUEST_NULL;
+			}
 		}
 		nextId = 0;
 	}
 
 private:
 	const static int RQ_COUNT = 8;
-	const Coord innerLength;
+	const MPI_Comm comm;
+	const bool persistent;
 	MPI_Request rq[RQ_COUNT];
 	int nextId;
+	/* persistent requests built so far */
+	int initialized;
 };
 
 
 class Workspace {
 public:
-	Workspace(const Coord innerSize, const Coord borderWidth, ClusterManager& cm, Comms& comm)
-			: innerSize(innerSize), cm(cm), comm(comm), borderWidth(borderWidth)
+	Workspace(const Coord innerWidth, const Coord innerHeight, const Coord borderWidth, ClusterManager& cm,
+	          Comms& comm, const TileShape& tile, ThreadPool& pool)
+			: innerWidth(innerWidth), innerHeight(innerHeight), cm(cm), comm(comm), borderWidth(borderWidth),
+			  tile(tile), pool(pool)
 	{
-		outerSize = innerSize+2*borderWidth;
-		memorySize = outerSize*outerSize;
+		outerWidth = innerWidth+2*borderWidth;
+		outerHeight = innerHeight+2*borderWidth;
+		memorySize = outerWidth*outerHeight;
 
 		neigh = cm.getNeighbours();
 		initialize_buffers();
@@ -195,7 +307,23 @@ public:
 		return *elAddress(x,y,back);
 	}
 
-	Coord getInnerLength() {return innerSize;}
+	Coord getInnerWidth() {return innerWidth;}
+	Coord getInnerHeight() {return innerHeight;}
+
+	/**
+	 * Calls k(dst, src, stride, len) for every column of the work area (tile after tile), where dst/src point to
+	 * the first point of the column in front/back buffer and stride is the distance to the same point in the next
+	 * column
+	 */
+	template <typename K>
+	void iterate_over_spans(K k) {
+		pool.run_bands(0, innerWidth-1, [this, &k](const Coord x_from, const Coord x_to) {
+			iterate_over_tiled_spans(0, innerHeight-1, x_from, x_to, tile,
+				[this, &k](const Coord y_idx, const Coord x_idx, const Coord len) {
+					k(elAddress(x_idx, y_idx, front), elAddress(x_idx, y_idx, back), outerHeight, len);
+				});
+		});
+	}
 
 	void swap(bool comms = true) {
 		if(comms) {
@@ -205,7 +333,7 @@ public:
 			for(int i = 0; i < 4; i++) {
 				auto iThNeigh = neigh[i];
 				if(iThNeigh != N_INVALID) {
-					comm.exchange(iThNeigh, innerEdge[i], outerEdge[i]);
+					comm.exchange(iThNeigh, innerEdge[i], outerEdge[i], edge_length(i));
 				}
 			}
 			comm.wait();
@@ -221,16 +349,21 @@ private:
 	Comms& comm;
 	int* neigh;
 
-	const Coord innerSize;
-	Coord outerSize;
+	const Coord innerWidth;
+	const Coord innerHeight;
+	Coord outerWidth;
+	Coord outerHeight;
 	Coord memorySize;
 
 	const Coord borderWidth;
+	const TileShape tile;
+	ThreadPool& pool;
 
 	/* horizontal could be stored with main buffer, but for convenience both horizontals and
 	 * verticals are allocated separatelly (and writes mirrored) */
 	NumType* innerEdge[4];
-	/* all outer edges are allocated separatelly; their length is innerLength, not innerLength + 2 */
+	/* all outer edges are allocated separatelly; their length is innerHeight (left, right) or innerWidth (top,
+	 * bottom), without corners */
 	NumType* outerEdge[4];
 	NumType *front;
 	NumType *back;
@@ -247,8 +380,8 @@ private:
 		/* create inner buffer (as comm buffers) for  */
 		for(int i = 0; i < 4; i++) {
 			if(neigh[i] != N_INVALID) {
-				innerEdge[i] = new NumType[innerSize];
-				outerEdge[i] = new NumType[innerSize];
+				innerEdge[i] = new NumType[edge_length(i)];
+				outerEdge[i] = new NumType[edge_length(i)];
 			} else {
 				innerEdge[i] = nullptr;
 				outerEdge[i] = nullptr;
@@ -269,7 +402,11 @@ private:
 	}
 
 	NumType* elAddress(const Coord x, const Coord y, NumType* base) {
-		return base + outerSize*(borderWidth + x) + (borderWidth + y);
+		return base + outerHeight*(borderWidth + x) + (borderWidth + y);
+	}
+
+	Coord edge_length(const int edge) {
+		return (edge == LEFT || edge == RIGHT) ? innerHeight : innerWidth;
 	}
 
 	void swapBuffers() {
@@ -281,15 +418,15 @@ private:
 	void copyInnerEdgesToBuffers() {
 		#define LOOP(EDGE, X, Y) \
 		if(neigh[EDGE] != N_INVALID) { \
-			for(Coord i = 0; i < innerSize; i++) { \
+			for(Coord i = 0; i < edge_length(EDGE); i++) { \
 				innerEdge[EDGE][i] = *elAddress(X,Y,front); \
 			} \
 		}
 
-		LOOP(TOP, i, innerSize-1)
+		LOOP(TOP, i, innerHeight-1)
 		LOOP(BOTTOM, i, 0)
 		LOOP(LEFT, 0, i)
-		LOOP(RIGHT, innerSize-1, i)
+		LOOP(RIGHT, innerWidth-1, i)
 
 		#undef LOOP
 	}
@@ -297,20 +434,75 @@ private:
 	void copy_outer_buffer_to(NumType *target) {
 		#define LOOP(EDGE, X, Y) \
 		if(neigh[EDGE] != N_INVALID) { \
-			for(Coord i = 0; i < innerSize; i++) { \
+			for(Coord i = 0; i < edge_length(EDGE); i++) { \
 				*elAddress(X,Y,target) = outerEdge[EDGE][i]; \
 			} \
 		}
 
-		LOOP(TOP, i, innerSize)
+		LOOP(TOP, i, innerHeight)
 		LOOP(BOTTOM, i, -1)
 		LOOP(LEFT, -1, i)
-		LOOP(RIGHT, innerSize, i)
+		LOOP(RIGHT, innerWidth, i)
 
 		#undef LOOP
 	}
 };
 
+/**
+ * Inner points of the old partition (before) in to's front buffer at places of the new one (after) - every node
+ * sends to every other one the part of its old block their new block overlaps, neighbours mostly, unless boundaries
+ * moved by more than a block. Collective.
+ */
+void migrate(ClusterManager& cm, const std::vector<NodeBlock>& before, const std::vector<NodeBlock>& after,
+             Workspace& from, Workspace& to) {
+	auto overlap = [](const NodeBlock& a, const NodeBlock& b) {
+		NodeBlock o;
+		o.x = std::max(a.x, b.x);
+		o.y = std::max(a.y, b.y);
+		o.width = std::max<Coord>(std::min(a.x + a.width, b.x + b.width) - o.x, 0);
+		o.height = std::max<Coord>(std::min(a.y + a.height, b.y + b.height) - o.y, 0);
+		return o;
+	};
+
+	const auto me = cm.getNodeId();
+	const auto count = cm.getNodeCount();
+	std::vector<int> sendCounts(count), sendDispls(count), recvCounts(count), recvDispls(count);
+
+	std::vector<NumType> sent;
+	for(int node = 0; node < count; node++) {
+		const auto o = overlap(before[me], after[node]);
+		sendDispls[node] = static_cast<int>(sent.size());
+		for(Coord x = o.x; x < o.x + o.width; x++) {
+			for(Coord y = o.y; y < o.y + o.height; y++) {
+				sent.push_back(from.elb(x - before[me].x, y - before[me].y));
+			}
+		}
+		sendCounts[node] = static_cast<int>(sent.size()) - sendDispls[node];
+	}
+
+	Coord total = 0;
+	for(int node = 0; node < count; node++) {
+		const auto o = overlap(before[node], after[me]);
+		recvCounts[node] = static_cast<int>(o.width*o.height);
+		recvDispls[node] = static_cast<int>(total);
+		total += o.width*o.height;
+	}
+
+	std::vector<NumType> received(total);
+	MPI_Alltoallv(sent.data(), sendCounts.data(), sendDispls.data(), NUM_MPI_DT,
+	              received.data(), recvCounts.data(), recvDispls.data(), NUM_MPI_DT, cm.getComm());
+
+	Coord i = 0;
+	for(int node = 0; node < count; node++) {
+		const auto o = overlap(before[node], after[me]);
+		for(Coord x = o.x; x < o.x + o.width; x++) {
+			for(Coord y = o.y; y < o.y + o.height; y++) {
+				to.set_elf(x - after[me].x, y - after[me].y, received[i++]);
+			}
+		}
+	}
+}
+
 std::string filenameGenerator(int nodeId) {
 	std::ostringstream oss;
 	oss << "./results/" << nodeId << "_t";
@@ -322,17 +514,20 @@ int main(int argc, char **argv) {
 
 	auto conf = parse_cli(argc, argv);
 
-	ClusterManager cm(conf.N);
-	auto n_slice = cm.getPartitioner().get_n_slice();
+	ClusterManager cm(conf.N, conf.decomposition, conf.placement);
+	Coord width, height;
+	std::tie(width, height) = cm.getInnerSize();
 	NumType x_offset, y_offset;
 	std::tie(x_offset, y_offset) = cm.getOffsets();
 	auto h = cm.getPartitioner().get_h();
 
-	Comms comm(n_slice);
-	Workspace w(n_slice, 1, cm, comm);
+	require_halo_depth(conf.haloDepth, 1);
+	Comms comm(cm.getComm(), conf.haloExchange);
+	ThreadPool pool(conf.threads);
+	std::unique_ptr<Workspace> w(new Workspace(width, height, 1, cm, comm, conf.tile, pool));
 
 	FileDumper<Workspace> d(filenameGenerator(cm.getNodeId()),
-	                        n_slice,
+	                        width,
 	                        x_offset,
 	                        y_offset,
 	                        h,
@@ -343,12 +538,12 @@ int main(int argc, char **argv) {
 	MPI_Barrier(cm.getComm());
 	timer.start();
 
-	for(Coord x_idx = 0; x_idx < n_slice; x_idx++) {
-		for(Coord y_idx = 0; y_idx < n_slice; y_idx++) {
+	for(Coord x_idx = 0; x_idx < width; x_idx++) {
+		for(Coord y_idx = 0; y_idx < height; y_idx++) {
 			auto x = x_offset + x_idx*h;
 			auto y = y_offset + y_idx*h;
 			auto val = f(x,y);
-			w.set_elf(x_idx,y_idx, val);
+			w->set_elf(x_idx,y_idx, val);
 
 			#ifdef DEBUG
 			std::cerr << "[" << x_idx << "," << y_idx <<"] "
@@ -358,39 +553,62 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	w.swap();
+	w->swap();
 
-	for(TimeStepCount ts = 0; ts < conf.timeSteps; ts++) {
-		DL( "Entering timestep loop, ts = " << ts )
+	ConvergenceCheck conv(conf, cm.getComm());
+	auto eq_f = [&conv](NumType* dst, const NumType* src, const Coord stride, const Coord len) {
+		if(conv.measuring()) {
+			conv.add(equation_row_residual(dst, src, stride, len));
+		} else {
+			equation_row(dst, src, stride, len);
+		}
+	};
 
-		for(Coord x_idx = 0; x_idx < n_slice; x_idx++) {
-			DL( "Entering X loop, x = " << x_idx )
+	/* sweeps only - waiting for neighbours is what a rebalance should get rid of */
+	Timer computeTimer;
+	Duration computeTime = 0;
 
-			for(Coord y_idx = 0; y_idx < n_slice; y_idx++) {
-				DL( "Entering Y loop, x y " << y_idx )
+	for(TimeStepCount ts = 0; ts < conf.timeSteps; ts++) {
+		DL( "Entering timestep loop, ts = " << ts )
 
-				auto eq_val = equation(
-						w.elb(x_idx - 1, y_idx),
-						w.elb(x_idx, y_idx - 1),
-						w.elb(x_idx + 1, y_idx),
-						w.elb(x_idx, y_idx + 1)
-				);
-
-				w.set_elf(x_idx, y_idx, eq_val);
-			}
-		}
+		conv.begin_sweep(ts, ts);
+		computeTimer.start();
+		w->iterate_over_spans(eq_f);
+		computeTime += computeTimer.stop();
 
 		DL( "Before swap, ts = " << ts )
 
-		w.swap();
+		w->swap();
 
 		DL( "Entering file dump" )
 
 		if (unlikely(conf.outputEnabled)) {
-			d.dumpBackbuffer(w, ts);
+			d.dumpBackbuffer(*w, ts);
 		}
 
 		DL( "After dump, ts = " << ts )
+
+		if(conv.end_sweep(ts + 1)) {
+			break;
+		}
+
+		if(conf.rebalanceEvery > 0 && (ts + 1) % conf.rebalanceEvery == 0 && ts + 1 < conf.timeSteps) {
+			const auto before = cm.getNodeBlocks();
+			if(cm.rebalance(static_cast<double>(computeTime))) {
+				std::tie(width, height) = cm.getInnerSize();
+				std::unique_ptr<Workspace> next(new Workspace(width, height, 1, cm, comm, conf.tile, pool));
+				migrate(cm, before, cm.getNodeBlocks(), *w, *next);
+				comm.rebuild();
+				w = std::move(next);
+				/* halos of the new blocks, just like after filling the initial condition */
+				w->swap();
+
+				std::tie(x_offset, y_offset) = cm.getOffsets();
+				d.setOffsets(x_offset, y_offset);
+				cm.err_log() << "Rebalanced after step " << ts << ", block " << width << "x" << height << std::endl;
+			}
+			computeTime = 0;
+		}
 	}
 
 	MPI_Barrier(cm.getComm());
@@ -398,6 +616,7 @@ int main(int argc, char **argv) {
 
 	if(cm.getNodeId() == 0) {
 		print_result("parallel_lb", cm.getNodeCount(), duration, conf);
+		conv.report(std::cerr);
 		std::cerr << ((double)duration)/1000000000 << " s" << std::endl;
 	}
 
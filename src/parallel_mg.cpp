@@ -0,0 +1,854 @@
+#include <mpi.h>
+#include <exception>
+#include <iostream>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "shared.h"
+#include "kernels.h"
+#include "Convergence.h"
+#include "ThreadPool.h"
+
+const int N_INVALID = -1;
+
+enum Neighbour {
+	LEFT = 0,
+	TOP = 1,
+	RIGHT = 2,
+	BOTTOM = 3,
+};
+
+class ClusterManager : private NonCopyable {
+public:
+	ClusterManager(const Coord N, const Coord minTile, const Decomposition decomposition, const Placement placement)
+			: bitBucket(0) {
+		/* level sweeps may be split across a ThreadPool, but MPI is called only from the main thread */
+		int threadSupport;
+		MPI_Init_thread(nullptr, nullptr, MPI_THREAD_FUNNELED, &threadSupport);
+		MPI_Comm_size(MPI_COMM_WORLD, &nodeCount);
+
+		partitioner = new Partitioner(nodeCount, 0.0, 1.0, N, decomposition, HaloShape(), minTile);
+		gridRows = partitioner->get_nodes_grid_rows();
+		gridColumns = partitioner->get_nodes_grid_columns();
+		comm = placed_comm(placement, gridRows, gridColumns, std::cerr);
+		MPI_Comm_rank(comm, &nodeId);
+		std::tie(row, column) = partitioner->node_id_to_grid_pos(nodeId);
+
+		if(threadSupport < MPI_THREAD_FUNNELED) {
+			err_log() << "WARN: MPI library doesn't support MPI_THREAD_FUNNELED, use single thread per rank" << std::endl;
+		}
+
+		initNeighbours();
+
+		err_log() << "Cluster initialized successfully. I'm (" << row << "," << column << ")" << std::endl;
+	}
+
+	~ClusterManager() {
+		delete partitioner;
+		MPI_Comm_free(&comm);
+		MPI_Finalize();
+	}
+
+	Partitioner& getPartitioner() {return *partitioner;}
+
+	int getNodeCount() { return nodeCount; }
+	int getNodeId() { return nodeId; }
+	std::pair<NumType, NumType> getOffsets() { return partitioner->get_math_offset_node(row, column); };
+	/* points of this node along x and y */
+	std::pair<Coord, Coord> getInnerSize() {
+		return std::make_pair(partitioner->get_n_columns(column), partitioner->get_n_rows(row));
+	}
+	MPI_Comm getComm() { return comm; }
+
+	std::ostream& err_log() {
+		return std::cerr;
+	}
+
+	std::ostream& master_err_log() {
+		if(nodeId == 0) {
+			return std::cerr;
+		} else {
+			return bitBucket;
+		}
+	}
+
+	int* getNeighbours() {
+		return &neighbours[0];
+	}
+
+private:
+	/* ranks renumbered so that rank is the node id, see placed_comm() */
+	MPI_Comm comm;
+
+	int nodeId;
+	int nodeCount;
+	int row;
+	int column;
+
+	Partitioner *partitioner;
+
+	int gridRows;
+	int gridColumns;
+	int neighbours[4];
+
+	std::ostream bitBucket;
+
+	void initNeighbours() {
+		if(row == 0) { neighbours[Neighbour::BOTTOM] = N_INVALID; }
+		else { neighbours[Neighbour::BOTTOM] = nodeId-gridColumns; }
+
+		if(row == gridRows-1) { neighbours[Neighbour::TOP] = N_INVALID; }
+		else { neighbours[Neighbour::TOP] = nodeId+gridColumns; }
+
+		if(column == 0) { neighbours[Neighbour::LEFT] = N_INVALID; }
+		else { neighbours[Neighbour::LEFT] = nodeId-1; }
+
+		if(column == gridColumns-1) { neighbours[Neighbour::RIGHT] = N_INVALID; }
+		else { neighbours[Neighbour::RIGHT] = nodeId+1; }
+
+		err_log() << "Neighbours: "
+		          << " LEFT: " << neighbours[LEFT]
+		          << " TOP: " << neighbours[TOP]
+		          << " RIGHT: " << neighbours[RIGHT]
+		          << " BOTTOM: " << neighbours[BOTTOM] << std::endl;
+	}
+};
+
+/*
+ * Geometric multigrid for the steady state of the same problem the other variants time-step (Laplace equation,
+ * zero boundary, f() as the initial guess); one time step of -t is one V/W-cycle.
+ *
+ * Operator on every level is L u = 4u - (sum of 4 neighbours), i.e. h^2 scaled Laplacian, so equation() is its
+ * Jacobi update for zero right hand side. Coarsening goes along each axis of the whole level: an even length is
+ * cell-centred - coarse point I covers fine points 2I, 2I+1 and restriction sums them - an odd one vertex-centred -
+ * coarse point I sits on fine point 2I+1 and restriction weighs 2I..2I+2 by 1/2, 1, 1/2 (see restriction_taps()).
+ * Either way weights sum up to 2 per axis, restriction is average times (2h/h)^2; prolongation is linear along
+ * both axes. Every coarse point belongs to the rank of the fine point it starts at (coarse_cut()).
+ *
+ * The wall stays where the finest level has it - one fine step past the outermost point - so on coarse levels it
+ * no longer lies half way to the halo. Zero halo would move it outwards on every level and W/V-cycles with more
+ * than two levels diverge; instead the halo is extrapolated linearly through zero at the wall (wall_factor()).
+ *
+ * Distributed levels keep Partitioner's block decomposition and coarsen while every block keeps at least
+ * GATHER_BELOW points along each side. One more restriction goes onto a transfer level, which isn't smoothed - its
+ * residual is gathered onto rank 0, which continues on serial levels down to COARSEST_SIZE and solves the coarsest
+ * one with CG; other ranks wait for the scattered correction. Finest blocks have at least SMALLEST_BLOCK points
+ * along each side, so every block still owns points of the transfer level and the whole fine grid is never
+ * gathered.
+ */
+
+/* damped Jacobi - plain one doesn't reduce checkerboard error at all */
+const AccType SMOOTHER_DAMPING = 0.8;
+const int PRE_SMOOTHING = 2;
+const int POST_SMOOTHING = 2;
+const Coord GATHER_BELOW = 16;
+/* fewest points of a block along each side, enough for a coarse point of its own */
+const Coord SMALLEST_BLOCK = 2;
+const Coord COARSEST_SIZE = 8;
+
+/**
+ * Halo beyond the wall = factor * outermost point, when the outermost point lies distance steps of its level from
+ * the wall
+ */
+inline AccType wall_factor(const AccType distance) {
+	return (distance - 1)/distance;
+}
+
+/**
+ * First coarse point at or after fine point x, along an axis of length points - at x = length it's the coarse
+ * length, length/2 either way
+ */
+inline Coord coarse_cut(const Coord x, const Coord length) {
+	return length % 2 == 0 ? (x + 1)/2 : x/2;
+}
+
+/**
+ * Wall distance of the outermost coarse point, in coarse steps, from the one of the outermost fine point
+ */
+inline AccType coarse_wall(const AccType distance, const Coord length) {
+	return length % 2 == 0 ? (distance + 0.5)/2 : (distance + 1)/2;
+}
+
+/* points of the other level and their weights that make up one point - 3 at most */
+struct Taps {
+	Coord index[3];
+	AccType weight[3];
+	int count;
+};
+
+/**
+ * Fine points (from fineStart on) whose residuals coarse points coarseStart..coarseStart+coarseLen-1 sum up, along
+ * an axis of length fine points
+ */
+inline std::vector<Taps> restriction_taps(const Coord fineStart, const Coord length, const Coord coarseStart,
+                                          const Coord coarseLen) {
+	std::vector<Taps> taps(coarseLen);
+	for(Coord i = 0; i < coarseLen; i++) {
+		const Coord first = 2*(coarseStart + i) - fineStart;
+		if(length % 2 == 0) {
+			taps[i] = Taps{{first, first + 1, 0}, {1, 1, 0}, 2};
+		} else {
+			taps[i] = Taps{{first, first + 1, first + 2}, {0.5, 1, 0.5}, 3};
+		}
+	}
+	return taps;
+}
+
+/**
+ * Coarse points (from coarseStart on, -1 and past the end are halo) interpolated into fine points
+ * fineStart..fineStart+fineLen-1, along an axis of length fine points
+ */
+inline std::vector<Taps> prolongation_taps(const Coord fineStart, const Coord fineLen, const Coord length,
+                                           const Coord coarseStart) {
+	std::vector<Taps> taps(fineLen);
+	for(Coord i = 0; i < fineLen; i++) {
+		const Coord g = fineStart + i;
+		if(length % 2 == 0) {
+			const Coord c = g/2 - coarseStart;
+			taps[i] = Taps{{c, g % 2 ? c + 1 : c - 1, 0}, {0.75, 0.25, 0}, 2};
+		} else if(g % 2) {
+			taps[i] = Taps{{(g - 1)/2 - coarseStart, 0, 0}, {1, 0, 0}, 1};
+		} else {
+			const Coord c = g/2 - coarseStart;
+			taps[i] = Taps{{c - 1, c, 0}, {0.5, 0.5, 0}, 2};
+		}
+	}
+	return taps;
+}
+
+/**
+ * One grid of the hierarchy as seen by this rank: width x height block with one point wide halo, x is the
+ * contiguous dimension. u - approximation (correction on coarse levels), b - right hand side, r - residual.
+ * Halo is exchanged with neighbours, on the wall sides it's extrapolated - walls[side] times the outermost point.
+ */
+class Level : private NonCopyable {
+public:
+	/* block of a rank within its level - first point and size */
+	struct Block {
+		Coord x, y, width, height;
+	};
+
+	Level(const Block& block, const Coord levelWidth, const Coord levelHeight, const std::array<AccType, 4>& walls,
+	      const int* neighbours, const MPI_Comm comm, ThreadPool& pool)
+			: width(block.width), height(block.height), outer(width + 2), x0(block.x), y0(block.y),
+			  levelWidth(levelWidth), levelHeight(levelHeight), walls(walls), comm(comm), pool(pool)
+	{
+		distributed = false;
+		for(int i = 0; i < 4; i++) {
+			neigh[i] = neighbours != nullptr ? neighbours[i] : N_INVALID;
+			distributed = distributed || neigh[i] != N_INVALID;
+		}
+
+		for(auto** buf: {&u, &tmp, &b, &r}) {
+			*buf = new NumType[outer*(height + 2)];
+			std::fill(*buf, *buf + outer*(height + 2), static_cast<NumType>(0));
+		}
+
+		MPI_Type_vector(height, 1, outer, NUM_MPI_DT, &col_dt);
+		MPI_Type_commit(&col_dt);
+	}
+
+	~Level() {
+		MPI_Type_free(&col_dt);
+		for(auto* buf: {u, tmp, b, r}) {
+			delete[] buf;
+		}
+	}
+
+	Coord getInnerWidth() { return width; }
+	Coord getInnerHeight() { return height; }
+
+	bool isDistributed() { return distributed; }
+
+	void set_u(const Coord x, const Coord y, const NumType value) {
+		*at(x, y, u) = value;
+	}
+
+	NumType elb(const Coord x, const Coord y) {
+		return *at(x, y, u);
+	}
+
+	void zero_u() {
+		std::fill(u, u + outer*(height + 2), static_cast<NumType>(0));
+	}
+
+	/**
+	 * Damped Jacobi: u += SMOOTHER_DAMPING*((sum of neighbours + b)/4 - u)
+	 */
+	void smooth(const int sweeps) {
+		for(int s = 0; s < sweeps; s++) {
+			exchange(u);
+			pool.run_bands(0, height-1, [this](const Coord y_from, const Coord y_to) {
+				for(Coord y = y_from; y <= y_to; y++) {
+					NumType* t = at(0, y, tmp);
+					const NumType* v = at(0, y, u);
+					const NumType* rhs = at(0, y, b);
+
+					equation_row(t, v, outer, width);
+					for(Coord x = 0; x < width; x++) {
+						t[x] = v[x] + SMOOTHER_DAMPING*(static_cast<AccType>(t[x]) + 0.25*rhs[x] - v[x]);
+					}
+				}
+			});
+			std::swap(u, tmp);
+		}
+	}
+
+	/**
+	 * r = b - L u
+	 * @return max |r|
+	 */
+	AccType residual() {
+		exchange(u);
+
+		std::vector<AccType> rowMax(height, 0);
+		pool.run_bands(0, height-1, [this, &rowMax](const Coord y_from, const Coord y_to) {
+			for(Coord y = y_from; y <= y_to; y++) {
+				NumType* res = at(0, y, r);
+				const NumType* v = at(0, y, u);
+				const NumType* rhs = at(0, y, b);
+
+				equation_row(res, v, outer, width);
+				AccType m = 0;
+				for(Coord x = 0; x < width; x++) {
+					res[x] = rhs[x] + 4*(static_cast<AccType>(res[x]) - v[x]);
+					m = std::max<AccType>(m, std::abs(res[x]));
+				}
+				rowMax[y] = m;
+			}
+		});
+
+		return *std::max_element(rowMax.begin(), rowMax.end());
+	}
+
+	/**
+	 * Coarse right hand side from this level's residual, coarse u zeroed. With residualHalo - on every rank, when
+	 * coarse points of some take fine ones of their neighbours - residual halo is exchanged first.
+	 */
+	void restrict_to(Level& c, const bool residualHalo) {
+		const auto xTaps = restriction_taps(x0, levelWidth, c.x0, c.width);
+		const auto yTaps = restriction_taps(y0, levelHeight, c.y0, c.height);
+		if(residualHalo) {
+			exchange(r);
+		}
+
+		c.zero_u();
+		pool.run_bands(0, c.height-1, [this, &c, &xTaps, &yTaps](const Coord y_from, const Coord y_to) {
+			for(Coord y = y_from; y <= y_to; y++) {
+				NumType* cb = c.at(0, y, c.b);
+				for(Coord x = 0; x < c.width; x++) {
+					cb[x] = weighted(xTaps[x], yTaps[y], r);
+				}
+			}
+		});
+	}
+
+	/**
+	 * u += interpolation of coarse u, linear along both axes (hence halo corners)
+	 */
+	void prolong_from(Level& c) {
+		c.exchange(c.u);
+		const auto xTaps = prolongation_taps(x0, width, levelWidth, c.x0);
+		const auto yTaps = prolongation_taps(y0, height, levelHeight, c.y0);
+
+		pool.run_bands(0, height-1, [this, &c, &xTaps, &yTaps](const Coord y_from, const Coord y_to) {
+			for(Coord y = y_from; y <= y_to; y++) {
+				NumType* v = at(0, y, u);
+				for(Coord x = 0; x < width; x++) {
+					v[x] += c.weighted(xTaps[x], yTaps[y], c.u);
+				}
+			}
+		});
+	}
+
+	/**
+	 * Solves L u = b with conjugate gradients (serial levels only)
+	 */
+	void solve_cg() {
+		const Coord size = width*height;
+		std::vector<AccType> x(size, 0), res(size), p(size), q(size);
+
+		for(Coord y = 0; y < height; y++) {
+			for(Coord i = 0; i < width; i++) {
+				res[y*width + i] = *at(i, y, b);
+			}
+		}
+		p = res;
+
+		auto dot = [size](const std::vector<AccType>& a, const std::vector<AccType>& c) {
+			AccType s = 0;
+			for(Coord i = 0; i < size; i++) {
+				s += a[i]*c[i];
+			}
+			return s;
+		};
+
+		auto rr = dot(res, res);
+		const auto stop = rr*1e-12;
+		for(Coord it = 0; it < 4*size && rr > stop; it++) {
+			for(Coord y = 0; y < height; y++) {
+				for(Coord i = 0; i < width; i++) {
+					const auto pi = p[y*width + i];
+					auto s = 4*pi;
+					s -= i > 0 ? p[y*width + i - 1] : walls[LEFT]*pi;
+					s -= i < width-1 ? p[y*width + i + 1] : walls[RIGHT]*pi;
+					s -= y > 0 ? p[(y-1)*width + i] : walls[BOTTOM]*pi;
+					s -= y < height-1 ? p[(y+1)*width + i] : walls[TOP]*pi;
+					q[y*width + i] = s;
+				}
+			}
+
+			const auto alpha = rr/dot(p, q);
+			for(Coord i = 0; i < size; i++) {
+				x[i] += alpha*p[i];
+				res[i] -= alpha*q[i];
+			}
+
+			const auto rr_next = dot(res, res);
+			for(Coord i = 0; i < size; i++) {
+				p[i] = res[i] + (rr_next/rr)*p[i];
+			}
+			rr = rr_next;
+		}
+
+		for(Coord y = 0; y < height; y++) {
+			for(Coord i = 0; i < width; i++) {
+				*at(i, y, u) = x[y*width + i];
+			}
+		}
+	}
+
+	/*
+	 * Agglomeration: block of every rank goes to blocks[rank] of the serial level on rank 0
+	 */
+
+	void gather_residual_to(Level* serial, const int root, const std::vector<Block>& blocks) {
+		std::vector<NumType> block(width*height);
+		pack(r, block.data());
+
+		std::vector<int> counts, displs;
+		const auto total = block_layout(blocks, counts, displs);
+		std::vector<NumType> all(serial != nullptr ? total : 0);
+		MPI_Gatherv(block.data(), static_cast<int>(width*height), NUM_MPI_DT, all.data(), counts.data(),
+		            displs.data(), NUM_MPI_DT, root, comm);
+
+		if(serial != nullptr) {
+			for(size_t node = 0; node < blocks.size(); node++) {
+				const auto& bl = blocks[node];
+				serial->unpack(all.data() + displs[node], serial->b, bl.x, bl.y, bl.width, bl.height);
+			}
+			serial->zero_u();
+		}
+	}
+
+	void scatter_correction_from(Level* serial, const int root, const std::vector<Block>& blocks) {
+		std::vector<int> counts, displs;
+		const auto total = block_layout(blocks, counts, displs);
+		std::vector<NumType> all(serial != nullptr ? total : 0);
+		if(serial != nullptr) {
+			for(size_t node = 0; node < blocks.size(); node++) {
+				const auto& bl = blocks[node];
+				serial->pack_block(serial->u, all.data() + displs[node], bl.x, bl.y, bl.width, bl.height);
+			}
+		}
+
+		std::vector<NumType> block(width*height);
+		MPI_Scatterv(all.data(), counts.data(), displs.data(), NUM_MPI_DT, block.data(),
+		             static_cast<int>(width*height), NUM_MPI_DT, root, comm);
+
+		for(Coord y = 0; y < height; y++) {
+			NumType* v = at(0, y, u);
+			for(Coord x = 0; x < width; x++) {
+				v[x] += block[y*width + x];
+			}
+		}
+	}
+
+private:
+	const Coord width;
+	const Coord height;
+	const Coord outer;
+	/* first point of the block and size of the whole level */
+	const Coord x0;
+	const Coord y0;
+	const Coord levelWidth;
+	const Coord levelHeight;
+	const std::array<AccType, 4> walls;
+	const MPI_Comm comm;
+	ThreadPool& pool;
+
+	int neigh[4];
+	bool distributed;
+	MPI_Datatype col_dt;
+
+	NumType* u;
+	NumType* tmp;
+	NumType* b;
+	NumType* r;
+
+	NumType* at(const Coord x, const Coord y, NumType* base) {
+		return base + outer*(y + 1) + (x + 1);
+	}
+
+	AccType weighted(const Taps& xTaps, const Taps& yTaps, NumType* base) {
+		AccType sum = 0;
+		for(int j = 0; j < yTaps.count; j++) {
+			const NumType* row = at(0, yTaps.index[j], base);
+			AccType rowSum = 0;
+			for(int i = 0; i < xTaps.count; i++) {
+				rowSum += xTaps.weight[i]*row[xTaps.index[i]];
+			}
+			sum += yTaps.weight[j]*rowSum;
+		}
+		return sum;
+	}
+
+	/**
+	 * Two phases, so that halo corners are filled too: columns to LEFT/RIGHT first, then rows including the
+	 * just received halo points to TOP/BOTTOM. Wall sides are extrapolated in the same order, so wall corners get
+	 * the factor twice.
+	 */
+	void exchange(NumType* buf) {
+		if(!distributed && std::all_of(walls.begin(), walls.end(), [](const AccType w) { return w == 0; })) {
+			return;
+		}
+
+		MPI_Request rq[4];
+		int count = 0;
+
+		/* LEN points STEP apart */
+		#define EXCHANGE(NEIGH, SEND, RECV, SIZE, TYPE, LEN, STEP) \
+		if(neigh[NEIGH] != N_INVALID) { \
+			MPI_Isend(SEND, SIZE, TYPE, neigh[NEIGH], 1, comm, rq + count++); \
+			MPI_Irecv(RECV, SIZE, TYPE, neigh[NEIGH], 1, comm, rq + count++); \
+		} else { \
+			extrapolate(SEND, RECV, LEN, STEP, walls[NEIGH]); \
+		}
+
+		EXCHANGE(LEFT, at(0, 0, buf), at(-1, 0, buf), 1, col_dt, height, outer)
+		EXCHANGE(RIGHT, at(width-1, 0, buf), at(width, 0, buf), 1, col_dt, height, outer)
+		MPI_Waitall(count, rq, MPI_STATUSES_IGNORE);
+
+		count = 0;
+		EXCHANGE(BOTTOM, at(-1, 0, buf), at(-1, -1, buf), outer, NUM_MPI_DT, outer, 1)
+		EXCHANGE(TOP, at(-1, height-1, buf), at(-1, height, buf), outer, NUM_MPI_DT, outer, 1)
+		MPI_Waitall(count, rq, MPI_STATUSES_IGNORE);
+
+		#undef EXCHANGE
+	}
+
+	void extrapolate(const NumType* edge, NumType* halo, const Coord len, const Coord step, const AccType wall) {
+		if(wall == 0) {
+			return;
+		}
+
+		for(Coord i = 0; i < len; i++) {
+			halo[i*step] = wall*edge[i*step];
+		}
+	}
+
+	void pack(NumType* base, NumType* dst) {
+		pack_block(base, dst, 0, 0, width, height);
+	}
+
+	void pack_block(NumType* base, NumType* dst, const Coord x0, const Coord y0, const Coord w, const Coord h) {
+		for(Coord y = 0; y < h; y++) {
+			std::memcpy(dst + y*w, at(x0, y0 + y, base), w*sizeof(NumType));
+		}
+	}
+
+	void unpack(const NumType* src, NumType* base, const Coord x0, const Coord y0, const Coord w, const Coord h) {
+		for(Coord y = 0; y < h; y++) {
+			std::memcpy(at(x0, y0 + y, base), src + y*w, w*sizeof(NumType));
+		}
+	}
+
+	/**
+	 * MPI_Gatherv/MPI_Scatterv arguments of blocks, packed one after another
+	 * @return points of all blocks
+	 */
+	static Coord block_layout(const std::vector<Block>& blocks, std::vector<int>& counts, std::vector<int>& displs) {
+		Coord total = 0;
+		for(const auto& bl: blocks) {
+			counts.push_back(static_cast<int>(bl.width*bl.height));
+			displs.push_back(static_cast<int>(total));
+			total += bl.width*bl.height;
+		}
+		return total;
+	}
+};
+
+class Multigrid : private NonCopyable {
+public:
+	Multigrid(ClusterManager& cm, const int cycleGamma, ThreadPool& pool)
+			: cm(cm), gamma(cycleGamma), pool(pool)
+	{
+		auto& p = cm.getPartitioner();
+		int row, column;
+		std::tie(row, column) = p.node_id_to_grid_pos(cm.getNodeId());
+
+		Axis x{{}, 1, 1}, y{{}, 1, 1};
+		for(int c = 0; c < p.get_nodes_grid_columns(); c++) {
+			x.cuts.push_back(p.get_index_offset_node(0, c).first);
+		}
+		x.cuts.push_back(x.cuts.back() + p.get_n_columns(p.get_nodes_grid_columns() - 1));
+		for(int r = 0; r < p.get_nodes_grid_rows(); r++) {
+			y.cuts.push_back(p.get_index_offset_node(r, 0).second);
+		}
+		y.cuts.push_back(y.cuts.back() + p.get_n_rows(p.get_nodes_grid_rows() - 1));
+
+		/* distributed levels - the whole level coarsens, so every one keeps the grid of nodes */
+		while(true) {
+			levels.emplace_back(new_level(x, y, column, row, cm.getNeighbours()));
+			residualHalo.push_back(!on_even_points(x) || !on_even_points(y));
+
+			const auto cx = coarser(x);
+			const auto cy = coarser(y);
+			if(shortest(cx) < GATHER_BELOW || shortest(cy) < GATHER_BELOW) {
+				break;
+			}
+			x = cx;
+			y = cy;
+		}
+
+		/* transfer level - every block keeps a point, as blocks of the finest one had SMALLEST_BLOCK */
+		if(cm.getNodeCount() > 1) {
+			assert(shortest(coarser(x)) > 0 && shortest(coarser(y)) > 0);
+			x = coarser(x);
+			y = coarser(y);
+			levels.emplace_back(new_level(x, y, column, row, cm.getNeighbours()));
+			transfer = true;
+		}
+		distributedCount = levels.size();
+
+		for(int node = 0; node < cm.getNodeCount(); node++) {
+			int r, c;
+			std::tie(r, c) = p.node_id_to_grid_pos(node);
+			serialBlocks.push_back(Level::Block{x.cuts[c], y.cuts[r], x.cuts[c+1] - x.cuts[c],
+			                                    y.cuts[r+1] - y.cuts[r]});
+		}
+
+		/* serial levels, rank 0 only - the first one is the last distributed level gathered */
+		if(cm.getNodeId() == 0) {
+			x = Axis{{0, x.cuts.back()}, x.lowWall, x.highWall};
+			y = Axis{{0, y.cuts.back()}, y.lowWall, y.highWall};
+			if(cm.getNodeCount() > 1) {
+				levels.emplace_back(new_level(x, y, 0, 0, nullptr));
+			}
+
+			while(std::min(x.cuts.back(), y.cuts.back())/2 >= COARSEST_SIZE) {
+				x = coarser(x);
+				y = coarser(y);
+				levels.emplace_back(new_level(x, y, 0, 0, nullptr));
+			}
+
+			for(size_t l = 0; l < levels.size(); l++) {
+				cm.master_err_log() << "Level " << l << ": " << levels[l]->getInnerWidth() << "x"
+				                    << levels[l]->getInnerHeight() << " points, "
+				                    << (l < distributedCount ? (transfer && l + 1 == distributedCount
+				                                                ? "transfer" : "distributed") : "serial")
+				                    << std::endl;
+			}
+		}
+	}
+
+	Level& finest() {
+		return *levels[0];
+	}
+
+	/**
+	 * One V- (gamma = 1) or W-cycle (gamma = 2); max |equation(u) - u| of the finest level after pre-smoothing is
+	 * reported to conv when it's measuring
+	 */
+	void cycle(ConvergenceCheck& conv) {
+		visit(0, conv);
+	}
+
+private:
+	/**
+	 * One axis of a level - first point of every column (row) of nodes and level length at the end, distances of the
+	 * outermost points from the walls in steps of the level
+	 */
+	struct Axis {
+		std::vector<Coord> cuts;
+		AccType lowWall;
+		AccType highWall;
+	};
+
+	ClusterManager& cm;
+	const int gamma;
+	ThreadPool& pool;
+	std::vector<std::unique_ptr<Level>> levels;
+	size_t distributedCount;
+	/* whether restriction from a distributed level needs residual halo */
+	std::vector<bool> residualHalo;
+	/* whether the last distributed level is only restricted onto and gathered, not smoothed */
+	bool transfer = false;
+	/* where blocks of the last distributed level go on the first serial one */
+	std::vector<Level::Block> serialBlocks;
+
+	static Axis coarser(const Axis& a) {
+		const auto length = a.cuts.back();
+		Axis c{{}, coarse_wall(a.lowWall, length), coarse_wall(a.highWall, length)};
+		for(auto cut: a.cuts) {
+			c.cuts.push_back(coarse_cut(cut, length));
+		}
+		return c;
+	}
+
+	/**
+	 * Whether every block along a starts and ends at an even point of an even length - then coarse points take
+	 * only fine points of their own block
+	 */
+	static bool on_even_points(const Axis& a) {
+		for(auto cut: a.cuts) {
+			if(cut % 2 != 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	static Coord shortest(const Axis& a) {
+		Coord len = a.cuts.back();
+		for(size_t i = 1; i < a.cuts.size(); i++) {
+			len = std::min(len, a.cuts[i] - a.cuts[i-1]);
+		}
+		return len;
+	}
+
+	Level* new_level(const Axis& x, const Axis& y, const int column, const int row, const int* neighbours) {
+		const Level::Block block{x.cuts[column], y.cuts[row], x.cuts[column+1] - x.cuts[column],
+		                         y.cuts[row+1] - y.cuts[row]};
+		std::array<AccType, 4> walls;
+		walls[LEFT] = wall_factor(x.lowWall);
+		walls[RIGHT] = wall_factor(x.highWall);
+		walls[BOTTOM] = wall_factor(y.lowWall);
+		walls[TOP] = wall_factor(y.highWall);
+		return new Level(block, x.cuts.back(), y.cuts.back(), walls, neighbours, cm.getComm(), pool);
+	}
+
+	void visit(const size_t l, ConvergenceCheck& conv) {
+		auto& level = *levels[l];
+		const bool gathering = l + 1 == distributedCount && cm.getNodeCount() > 1;
+
+		if(!gathering && l + 1 == levels.size()) {
+			level.solve_cg();
+			return;
+		}
+
+		if(gathering && transfer) {
+			/* smoothed on rank 0 only, as the first serial level */
+			level.residual();
+			gather_and_solve(l, conv);
+			return;
+		}
+
+		level.smooth(PRE_SMOOTHING);
+		const auto res = level.residual();
+		if(l == 0 && conv.measuring()) {
+			conv.add(res/4);
+		}
+
+		if(gathering) {
+			gather_and_solve(l, conv);
+		} else {
+			auto& coarse = *levels[l + 1];
+			level.restrict_to(coarse, residualHalo[l]);
+			for(int g = 0; g < gamma; g++) {
+				visit(l + 1, conv);
+			}
+			level.prolong_from(coarse);
+		}
+
+		level.smooth(POST_SMOOTHING);
+	}
+
+	void gather_and_solve(const size_t l, ConvergenceCheck& conv) {
+		Level* serial = cm.getNodeId() == 0 ? levels[l + 1].get() : nullptr;
+		levels[l]->gather_residual_to(serial, 0, serialBlocks);
+		if(serial != nullptr) {
+			visit(l + 1, conv);
+		}
+		levels[l]->scatter_correction_from(serial, 0, serialBlocks);
+	}
+};
+
+std::string filenameGenerator(int nodeId) {
+	std::ostringstream oss;
+	oss << "./results/" << nodeId << "_t";
+	return oss.str();
+}
+
+int main(int argc, char **argv) {
+	std::cerr << __FILE__ << std::endl;
+
+	auto conf = parse_cli(argc, argv);
+	/* levels exchange their halos on their own */
+	require_halo_exchange(conf.haloExchange, {HaloExchange::P2P});
+	require_halo_depth(conf.haloDepth, 1);
+	require_fixed_partition(conf.rebalanceEvery);
+
+	ClusterManager cm(conf.N, SMALLEST_BLOCK, conf.decomposition, conf.placement);
+	Coord width, height;
+	std::tie(width, height) = cm.getInnerSize();
+	NumType x_offset, y_offset;
+	std::tie(x_offset, y_offset) = cm.getOffsets();
+	auto h = cm.getPartitioner().get_h();
+
+	ThreadPool pool(conf.threads);
+	Multigrid mg(cm, conf.mgCycle, pool);
+	auto& w = mg.finest();
+
+	FileDumper<Level> d(filenameGenerator(cm.getNodeId()),
+	                    width,
+	                    x_offset,
+	                    y_offset,
+	                    h,
+	                    get_freq_sel(conf.timeSteps));
+
+	Timer timer;
+
+	MPI_Barrier(cm.getComm());
+	timer.start();
+
+	DL( "filling initial guess" )
+
+	for(Coord x_idx = 0; x_idx < width; x_idx++) {
+		for(Coord y_idx = 0; y_idx < height; y_idx++) {
+			w.set_u(x_idx, y_idx, f(x_offset + x_idx*h, y_offset + y_idx*h));
+		}
+	}
+
+	ConvergenceCheck conv(conf, cm.getComm());
+
+	for(TimeStepCount cycle = 0; cycle < conf.timeSteps; cycle++) {
+		DL( "Entering cycle loop, cycle = " << cycle )
+
+		conv.begin_sweep(cycle, cycle);
+		mg.cycle(conv);
+
+		if (unlikely(conf.outputEnabled)) {
+			d.dumpBackbuffer(w, cycle);
+		}
+
+		if(conv.end_sweep(cycle + 1)) {
+			break;
+		}
+	}
+
+	MPI_Barrier(cm.getComm());
+	auto duration = timer.stop();
+
+	if(cm.getNodeId() == 0) {
+		print_result("parallel_mg", cm.getNodeCount(), duration, conf);
+		conv.report(std::cerr);
+		std::cerr << ((double)duration)/1000000000 << " s" << std::endl;
+	}
+
+	DL( "Terminating" )
+
+	return 0;
+}
@@ -3,6 +3,8 @@
 #include <cstddef>
 #include <string>
 #include "shared.h"
+#include "kernels.h"
+#include "Convergence.h"
 
 /**
  * Work area is indexed from 0 to size-1
@@ -13,7 +15,8 @@
  */
 class Workspace {
 public:
-	Workspace(const Coord size) :
+	Workspace(const Coord size, const TileShape& tile = TileShape()) :
+			tile(tile),
 			innerLength(size),
 			outerLength(size+2),
 			actualSize(outerLength*outerLength),
@@ -49,7 +52,41 @@ public:
 		}
 	}
 
-	Coord getInnerLength() {return innerLength;}
+	Coord getInnerWidth() {return innerLength;}
+	Coord getInnerHeight() {return innerLength;}
+
+	/**
+	 * Calls k(dst, src, stride, len) for every column of the work area (tile after tile), where dst/src point to
+	 * the first point of the column in front/back buffer and stride is the distance to the same point in the next
+	 * column
+	 */
+	template <typename K>
+	void iterate_over_spans(K k) {
+		iterate_over_tiled_spans(0, innerLength-1, 0, innerLength-1, tile,
+			[this, &k](const Coord y_idx, const Coord x_idx, const Coord len) {
+				k(&elf(x_idx, y_idx), &elb(x_idx, y_idx), outerLength, len);
+			});
+	}
+
+	/**
+	 * Advances work area by `levels` time steps using time skewed tiles (see iterate_over_time_skewed_tiles),
+	 * calling k the same way iterate_over_spans does. Leaves newest values in back buffer, just like `levels`
+	 * sweeps each followed by swap()
+	 */
+	template <typename K>
+	void iterate_over_time_tiles(const Coord levels, K k) {
+		iterate_over_time_skewed_tiles(0, innerLength-1, 0, innerLength-1, levels, 0, tile,
+			[this, &k](const Coord level, const Coord y_idx, const Coord x_idx, const Coord len) {
+				/* odd levels read back and write front, even ones the other way round */
+				NumType* dst = (level % 2) ? front : back;
+				NumType* src = (level % 2) ? back : front;
+				k(dst + coords(x_idx, y_idx), src + coords(x_idx, y_idx), outerLength, len);
+			});
+
+		if(levels % 2) {
+			swap();
+		}
+	}
 
 	void swap() {
 		NumType* tmp = front;
@@ -58,6 +95,7 @@ public:
 	}
 
 private:
+	const TileShape tile;
 	const Coord zeroOffset;
 	const Coord innerLength;
 	const Coord outerLength;
@@ -80,10 +118,10 @@ int main(int argc, char **argv) {
 
 	/* calculate helper values */
 	const NumType h = p.get_h();
-	const Coord n = p.partition_inner_size();
+	const Coord n = p.get_n_columns(0);
 
 	Timer timer;
-	Workspace w(conf.N);
+	Workspace w(conf.N, conf.tile);
 	NumType x_off, y_off;
 	std::tie(x_off, y_off) = p.get_math_offset_node(0,0);
 
@@ -108,26 +146,32 @@ int main(int argc, char **argv) {
 
 	w.swap();
 
-	for(TimeStepCount step = 0; step < conf.timeSteps; step++) {
-		for(Coord x_idx = 0; x_idx < n; x_idx++) {
-			for(Coord y_idx = 0; y_idx < n; y_idx++) {
-				w.elf(x_idx, y_idx) = equation(
-					 w.elb(x_idx-1 ,y_idx),
-					 w.elb(x_idx ,y_idx-1),
-					 w.elb(x_idx+1 ,y_idx),
-					 w.elb(x_idx ,y_idx+1)
-				);
-			}
+	ConvergenceCheck conv(conf);
+	auto eq_f = [&conv](NumType* dst, const NumType* src, const Coord stride, const Coord len) {
+		if(conv.measuring()) {
+			conv.add(equation_row_residual(dst, src, stride, len));
+		} else {
+			equation_row(dst, src, stride, len);
 		}
+	};
+
+	for(TimeStepCount step = 0; step < conf.timeSteps; step += conf.timeBlock) {
+		const auto levels = std::min(conf.timeBlock, conf.timeSteps - step);
+		conv.begin_sweep(step, step + levels - 1);
+		w.iterate_over_time_tiles(levels, eq_f);
 
-		w.swap();
 		if (unlikely(conf.outputEnabled)) {
-			d.dumpBackbuffer(w, step);
+			d.dumpBackbuffer(w, step + levels - 1);
+		}
+
+		if(conv.end_sweep(step + levels)) {
+			break;
 		}
 	}
 
 	auto duration = timer.stop();
 	print_result("seq", 1, duration, conf);
+	conv.report(std::cerr);
 	std::cerr << ((double)duration)/1000000000 << " s" << std::endl;
 
 	return 0;
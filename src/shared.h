@@ -13,7 +13,12 @@
 #include <iostream>
 #include <sstream>
 #include <functional>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <tuple>
 #include <fstream>
+#include <unistd.h>
 #include "NonCopyable.h"
 
 // #define DEBUG
@@ -28,14 +33,125 @@
 
 using Coord = long long;
 using TimeStepCount = size_t;
+
+/*
+ * Precision is chosen at build time (cmake -DPRECISION=double|float|mixed). NumType is what workspaces store and
+ * halos carry, AccType is what equation() adds in - mixed keeps float storage and messages, but double arithmetic.
+ */
+#if defined(PRECISION_FLOAT)
+using NumType = float;
+using AccType = float;
+const MPI_Datatype NUM_MPI_DT = MPI_FLOAT;
+const MPI_Datatype ACC_MPI_DT = MPI_FLOAT;
+const char* const PRECISION_NAME = "float";
+#elif defined(PRECISION_MIXED)
+using NumType = float;
+using AccType = double;
+const MPI_Datatype NUM_MPI_DT = MPI_FLOAT;
+const MPI_Datatype ACC_MPI_DT = MPI_DOUBLE;
+const char* const PRECISION_NAME = "mixed";
+#else
 using NumType = double;
+using AccType = double;
 const MPI_Datatype NUM_MPI_DT = MPI_DOUBLE;
+const MPI_Datatype ACC_MPI_DT = MPI_DOUBLE;
+const char* const PRECISION_NAME = "double";
+#endif
+
 const auto NumPrecision = std::numeric_limits<NumType>::max_digits10;
 using Duration = long long;
 
 const Coord KEEP_X_POINTS = 25;
 const TimeStepCount KEEP_X_TIMEFRAMES = 100;
 
+/**
+ * How Partitioner lays nodes out: BLOCKS - grid as close to square as node count allows, STRIPS - single column of
+ * full width row strips (two contiguous halo messages per step, no columns), AUTO - whichever of the two
+ * halo_exchange_cost() estimates cheaper
+ */
+enum class Decomposition {
+	BLOCKS,
+	STRIPS,
+	AUTO,
+};
+
+const char* decomposition_name(const Decomposition d) {
+	switch(d) {
+		case Decomposition::BLOCKS: return "blocks";
+		case Decomposition::STRIPS: return "strips";
+		case Decomposition::AUTO: return "auto";
+	}
+	return "?";
+}
+
+Decomposition parse_decomposition(const std::string& s) {
+	for(auto d: {Decomposition::BLOCKS, Decomposition::STRIPS, Decomposition::AUTO}) {
+		if(s == decomposition_name(d)) {
+			return d;
+		}
+	}
+	throw std::runtime_error("unknown decomposition: " + s);
+}
+
+/**
+ * Which rank gets which tile: LINEAR - rank r is node r of the grid, NODE - ranks sharing a host
+ * (MPI_COMM_TYPE_SHARED) take compact blocks of neighbouring tiles, see placed_comm()
+ */
+enum class Placement {
+	LINEAR,
+	NODE,
+};
+
+const char* placement_name(const Placement p) {
+	switch(p) {
+		case Placement::LINEAR: return "linear";
+		case Placement::NODE: return "node";
+	}
+	return "?";
+}
+
+Placement parse_placement(const std::string& s) {
+	for(auto p: {Placement::LINEAR, Placement::NODE}) {
+		if(s == placement_name(p)) {
+			return p;
+		}
+	}
+	throw std::runtime_error("unknown placement: " + s);
+}
+
+/**
+ * Halo a variant exchanges - width points deep, and whether it takes corners from diagonal neighbours too
+ */
+struct HaloShape {
+	Coord width = 1;
+	bool corners = false;
+};
+
+/* rough interconnect figures for halo_exchange_cost() - per message, per byte, and how much more a byte of
+ * a strided column costs than one of a contiguous row */
+const double HALO_MESSAGE_LATENCY = 2e-6;
+const double HALO_BANDWIDTH = 5e9;
+const double HALO_STRIDED_PENALTY = 2;
+
+/**
+ * Estimated time of one halo exchange of an interior node of a rows x columns grid over N x N points - latency of
+ * its messages plus their bytes over bandwidth, strided ones (columns, corners) HALO_STRIDED_PENALTY times dearer.
+ * Compute time doesn't depend on the layout, so it's left out.
+ *
+ * Strips move 2*width*N points per node, blocks 2*width*N*(1/columns + penalty/rows). With the penalty of 2 that's
+ * no fewer for any node count up to 9, so there strips always win on latency; past that blocks win once N is
+ * large enough for the bytes they save to outweigh their extra messages (sooner for deeper halos).
+ */
+inline double halo_exchange_cost(const Coord N, const int rows, const int columns, const HaloShape halo) {
+	const bool diagonals = halo.corners && rows > 1 && columns > 1;
+	const int messages = (rows > 1 ? 2 : 0) + (columns > 1 ? 2 : 0) + (diagonals ? 4 : 0);
+	const double rowBytes = rows > 1 ? 2.0*halo.width*N/columns*sizeof(NumType) : 0;
+	const double columnBytes = columns > 1 ? 2.0*halo.width*N/rows*sizeof(NumType) : 0;
+	const double cornerBytes = diagonals ? 4.0*halo.width*halo.width*sizeof(NumType) : 0;
+	return messages*HALO_MESSAGE_LATENCY
+	       + (rowBytes + HALO_STRIDED_PENALTY*(columnBytes + cornerBytes))/HALO_BANDWIDTH;
+}
+
 /* 0                       1
  *    _*_*_*_*_ _*_*_*_*_
  * * | * * * * | * * * * | *
@@ -74,84 +190,672 @@ class Partitioner : private NonCopyable {
 	/* Responsibilities
 	 * - check for partitioning correctness
 	 * - get index and numerical offsets
+	 *
+	 * Nodes form a rows x columns grid, as close to square as node count allows (what MPI_Dims_create picks for
+	 * 2 dimensions, rows >= columns) or a single column (see Decomposition), numbered row after row. Points are
+	 * split as evenly as possible - when they don't divide, first grid_dimm % columns columns (grid_dimm % rows
+	 * rows) get a point more - until rebalance() moves the boundaries. No node gets fewer points along either axis than
+	 * min_tile or the width of its halo; grids which don't allow it are refused.
 	 */
 public:
-	Partitioner(const Coord node_count, const NumType lower_b, NumType upper_b, const Coord grid_dimm)
-			: nodeCount(node_count), lowerB(lower_b), upperB(upper_b), grid_dimm(grid_dimm)
+	Partitioner(const Coord node_count, const NumType lower_b, NumType upper_b, const Coord grid_dimm,
+	            const Decomposition decomposition = Decomposition::BLOCKS, const HaloShape halo = HaloShape(),
+	            const Coord min_tile = 1)
+			: nodeCount(node_count), decomposition(decomposition), lowerB(lower_b), upperB(upper_b),
+			  grid_dimm(grid_dimm), halo(halo), minTile(std::max(min_tile, halo.width))
 	{
 		h = (upperB - lowerB)/(grid_dimm+1);
 		verify_values();
 	}
 
-	int get_n_slice() {
-		return mh;
+	/**
+	 * Points along x of nodes in given column
+	 */
+	Coord get_n_columns(const int node_column) {
+		return columnCuts[node_column+1] - columnCuts[node_column];
 	}
 
-	Coord partition_inner_size() {
-		return grid_dimm/sideLen;
+	/**
+	 * Points along y of nodes in given row
+	 */
+	Coord get_n_rows(const int node_row) {
+		return rowCuts[node_row+1] - rowCuts[node_row];
 	}
 
 	NumType get_h() {
 		return h;
 	}
 
+	/**
+	 * Index of the first point of node within the whole point grid
+	 */
+	std::pair<Coord, Coord> get_index_offset_node(const int node_row, const int node_column) {
+		return std::make_pair(columnCuts[node_column], rowCuts[node_row]);
+	}
 
 	/**
 	 * Math offsets across point grid
 	 */
 	std::pair<NumType, NumType> get_math_offset_node(const int node_row, const int node_column) {
-		auto x = (node_column*mh + 1)*h;
-		auto y = (node_row*mh + 1)*h;
-		return std::make_pair(x,y);
+		Coord x_idx, y_idx;
+		std::tie(x_idx, y_idx) = get_index_offset_node(node_row, node_column);
+		return std::make_pair((x_idx + 1)*h, (y_idx + 1)*h);
 	};
 
 	std::pair<int, int> node_id_to_grid_pos(int nodeId) {
-		const auto row = nodeId/sideLen;
-		const auto column = nodeId%sideLen;
+		const auto row = nodeId/columns;
+		const auto column = nodeId%columns;
 		return std::make_pair(row, column);
 	};
 
-	int get_nodes_grid_dimm() {
-		return sideLen;
+	int get_nodes_grid_rows() {
+		return rows;
+	}
+
+	int get_nodes_grid_columns() {
+		return columns;
+	}
+
+	/**
+	 * Moves boundaries between columns and rows so that each gets points in proportion to the speed it went
+	 * through its current ones at - columnTimes[i] (rowTimes[i]) is how long column (row) i took, e.g. average
+	 * time of its nodes. Every column and row keeps at least minLen points, and never fewer than min_tile.
+	 * @return whether any boundary moved
+	 */
+	bool rebalance(const std::vector<double>& columnTimes, const std::vector<double>& rowTimes,
+	               const Coord minLen = 1) {
+		auto newColumns = balanced_cuts(columnCuts, columnTimes, std::max(minLen, minTile));
+		auto newRows = balanced_cuts(rowCuts, rowTimes, std::max(minLen, minTile));
+		const bool moved = newColumns != columnCuts || newRows != rowCuts;
+		columnCuts = newColumns;
+		rowCuts = newRows;
+		return moved;
 	}
 
 private:
 	/* characteristics of node grid */
 	const int nodeCount;
-	int sideLen;
-	Coord row;
-	Coord column;
-
-	/* qualities linking both worlds */
-	int mh;
+	const Decomposition decomposition;
+	int rows;
+	int columns;
 
 	/* characteristics of stored values and point grids */
 	const NumType lowerB;
 	const NumType upperB;
 	const Coord grid_dimm;
+	const HaloShape halo;
+	const Coord minTile;
 	NumType h;
+	/* first point of every column (row), grid_dimm at the end */
+	std::vector<Coord> columnCuts;
+	std::vector<Coord> rowCuts;
+
+	std::vector<Coord> even_cuts(const int count) {
+		std::vector<Coord> cuts;
+		for(int idx = 0; idx <= count; idx++) {
+			cuts.push_back(idx*(grid_dimm/count) + std::min<Coord>(idx, grid_dimm % count));
+		}
+		return cuts;
+	}
+
+	/**
+	 * Lengths proportional to points per second of every slice, rounded by largest remainder; slices without
+	 * a measurement keep their speed at the average
+	 */
+	std::vector<Coord> balanced_cuts(const std::vector<Coord>& cuts, const std::vector<double>& times,
+	                                 const Coord minLen) {
+		const auto count = cuts.size() - 1;
+		if(count < 2 || grid_dimm < minLen*static_cast<Coord>(count)) {
+			return cuts;
+		}
+
+		std::vector<double> speed(count, 0);
+		double known = 0;
+		size_t measured = 0;
+		for(size_t i = 0; i < count; i++) {
+			if(times[i] > 0) {
+				speed[i] = (cuts[i+1] - cuts[i])/times[i];
+				known += speed[i];
+				measured++;
+			}
+		}
+		if(measured == 0) {
+			return cuts;
+		}
+		for(size_t i = 0; i < count; i++) {
+			if(times[i] <= 0) {
+				speed[i] = known/measured;
+			}
+		}
+
+		/* minLen points for everyone, the rest by speed */
+		const auto spare = grid_dimm - minLen*static_cast<Coord>(count);
+		double total = 0;
+		for(auto v: speed) {
+			total += v;
+		}
+
+		std::vector<Coord> len(count);
+		std::vector<std::pair<double, size_t>> remainder;
+		Coord given = 0;
+		for(size_t i = 0; i < count; i++) {
+			const double share = spare*speed[i]/total;
+			len[i] = minLen + static_cast<Coord>(share);
+			given += len[i];
+			remainder.push_back(std::make_pair(share - std::floor(share), i));
+		}
+		std::sort(remainder.begin(), remainder.end(), [](const std::pair<double, size_t>& a,
+		                                                const std::pair<double, size_t>& b) {
+			return a.first > b.first || (a.first == b.first && a.second < b.second);
+		});
+		for(size_t i = 0; given < grid_dimm; i++, given++) {
+			len[remainder[i % count].second]++;
+		}
+
+		std::vector<Coord> result(1, 0);
+		for(auto l: len) {
+			result.push_back(result.back() + l);
+		}
+		return result;
+	}
 
 	void verify_values() {
-		auto sqr = static_cast<long>(std::sqrt(nodeCount));
-		if(sqr*sqr != nodeCount) {
-			throw std::runtime_error("numer of nodes must be square");
-		} else {
-			sideLen = sqr;
+		if(nodeCount < 1) {
+			throw std::runtime_error("number of nodes must be positive");
 		}
 
-		if(grid_dimm % sideLen != 0) {
-			throw std::runtime_error("point grid len must be evenly divisible by machine grid len");
-		} else {
-			mh = grid_dimm/sideLen;
+		/* largest divisor not above square root - the most square grid */
+		columns = static_cast<int>(std::sqrt(nodeCount));
+		while(nodeCount % columns != 0) {
+			columns--;
+		}
+		rows = nodeCount/columns;
+
+		/* strips as thin as their halo at least */
+		const bool stripsFit = grid_dimm >= nodeCount*minTile;
+		const bool stripsCheaper = halo_exchange_cost(grid_dimm, nodeCount, 1, halo)
+		                           < halo_exchange_cost(grid_dimm, rows, columns, halo);
+		if(decomposition == Decomposition::STRIPS
+		   || (decomposition == Decomposition::AUTO && stripsFit && stripsCheaper)) {
+			rows = nodeCount;
+			columns = 1;
+		}
+
+		/* rows >= columns, so the rows are the thinnest */
+		if(grid_dimm < rows*minTile) {
+			throw std::runtime_error("point grid len must be at least " + std::to_string(minTile)
+			                         + " times as large as machine grid len");
+		}
+
+		columnCuts = even_cuts(columns);
+		rowCuts = even_cuts(rows);
+	}
+};
+
+/**
+ * Grid positions (numbered row after row) in the order placed_comm() hands them out - bands of bandWidth columns
+ * from left to right, each walked row after row - so that a run of consecutive positions forms a compact block
+ */
+inline std::vector<int> banded_order(const int rows, const int columns, const int bandWidth) {
+	std::vector<int> order;
+	for(int first = 0; first < columns; first += bandWidth) {
+		const int last = std::min(first + bandWidth, columns);
+		for(int row = 0; row < rows; row++) {
+			for(int column = first; column < last; column++) {
+				order.push_back(row*columns + column);
+			}
+		}
+	}
+	return order;
+}
+
+/**
+ * Pairs of neighbouring grid positions on the same host, hostOf[position] being the host of each
+ */
+inline int intra_host_pairs(const std::vector<int>& hostOf, const int rows, const int columns) {
+	int pairs = 0;
+	for(int row = 0; row < rows; row++) {
+		for(int column = 0; column < columns; column++) {
+			const auto host = hostOf[row*columns + column];
+			if(column + 1 < columns && hostOf[row*columns + column + 1] == host) {
+				pairs++;
+			}
+			if(row + 1 < rows && hostOf[(row + 1)*columns + column] == host) {
+				pairs++;
+			}
+		}
+	}
+	return pairs;
+}
+
+/**
+ * Communicator of all ranks in which rank r is node r of the rows x columns grid. With Placement::NODE the ranks
+ * of each host (hosts ordered by their lowest rank) take a run of banded_order() of whichever band width keeps
+ * most neighbour pairs on one host; ties go to the widest band, so on a single host it's the LINEAR order.
+ * Collective over MPI_COMM_WORLD, free with MPI_Comm_free.
+ */
+inline MPI_Comm placed_comm(const Placement placement, const int rows, const int columns, std::ostream& log) {
+	int worldRank, worldSize;
+	MPI_Comm_rank(MPI_COMM_WORLD, &worldRank);
+	MPI_Comm_size(MPI_COMM_WORLD, &worldSize);
+	assert(rows*columns == worldSize);
+
+	int position = worldRank;
+	if(placement == Placement::NODE) {
+		/* host id - its lowest rank */
+		MPI_Comm local;
+		MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, worldRank, MPI_INFO_NULL, &local);
+		int host;
+		MPI_Allreduce(&worldRank, &host, 1, MPI_INT, MPI_MIN, local);
+		MPI_Comm_free(&local);
+		std::vector<int> hosts(worldSize);
+		MPI_Allgather(&host, 1, MPI_INT, &hosts[0], 1, MPI_INT, MPI_COMM_WORLD);
+
+		std::vector<int> ranks(worldSize);
+		for(int r = 0; r < worldSize; r++) {
+			ranks[r] = r;
+		}
+		std::stable_sort(ranks.begin(), ranks.end(), [&hosts](const int a, const int b) {
+			return hosts[a] < hosts[b];
+		});
+
+		std::vector<int> best;
+		int bestPairs = -1;
+		for(int bandWidth = columns; bandWidth >= 1; bandWidth--) {
+			const auto order = banded_order(rows, columns, bandWidth);
+			std::vector<int> hostOf(worldSize);
+			for(int i = 0; i < worldSize; i++) {
+				hostOf[order[i]] = hosts[ranks[i]];
+			}
+			const auto pairs = intra_host_pairs(hostOf, rows, columns);
+			if(pairs > bestPairs) {
+				bestPairs = pairs;
+				best = order;
+			}
+		}
+		for(int i = 0; i < worldSize; i++) {
+			if(ranks[i] == worldRank) {
+				position = best[i];
+			}
+		}
+
+		if(worldRank == 0) {
+			log << "[0] Placement: " << bestPairs << " of " << rows*(columns - 1) + (rows - 1)*columns
+			    << " neighbour pairs share a host, " << intra_host_pairs(hosts, rows, columns) << " if linear"
+			    << std::endl;
 		}
 	}
+
+	if(worldRank == 0) {
+		log << "[0] Node grid: " << rows << " rows x " << columns << " columns" << std::endl;
+	}
+
+	MPI_Comm comm;
+	MPI_Comm_split(MPI_COMM_WORLD, 0, position, &comm);
+	return comm;
+}
+
+/**
+ * Shape of a cache block used when sweeping a workspace area
+ * - span - points along the contiguous dimension
+ * - rows - spans per tile
+ * 0 in both means no tiling (area is swept span after span)
+ */
+struct TileShape {
+	Coord span = 0;
+	Coord rows = 0;
+
+	bool enabled() const { return span > 0 && rows > 0; }
+
+	const std::string toStr() const {
+		std::ostringstream oss;
+		oss << span << "x" << rows;
+		return oss.str();
+	}
 };
 
+/**
+ * Three back buffer rows and one front buffer row of a tile should fit in half of L1 (so the stencil reuses rows
+ * without going to L2), whole tile of both buffers should fit in half of L2
+ */
+TileShape default_tile_shape() {
+	auto l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+	auto l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+	if(l1 <= 0) { l1 = 32*1024; }
+	if(l2 <= 0) { l2 = 256*1024; }
+
+	TileShape t;
+	t.span = std::max<Coord>(l1/2/(4*sizeof(NumType)), 64);
+	t.span -= t.span % 8;
+	t.rows = std::max<Coord>(l2/2/(2*t.span*sizeof(NumType)), 8);
+	return t;
+}
+
+/**
+ * Parses "<span>x<rows>"; "0" turns tiling off
+ */
+TileShape parse_tile_shape(const std::string& s) {
+	TileShape t;
+	auto sep = s.find('x');
+	if(sep == std::string::npos) {
+		t.span = t.rows = std::stoull(s);
+	} else {
+		t.span = std::stoull(s.substr(0, sep));
+		t.rows = std::stoull(s.substr(sep+1));
+	}
+	return t;
+}
+
+/**
+ * How Comms moves halos: P2P - MPI_Isend/MPI_Irecv posted every step, PERSISTENT - requests built once with
+ * MPI_Send_init/MPI_Recv_init and restarted every step with MPI_Startall, NEIGHBOUR - whole exchange as a single
+ * MPI_Ineighbor_alltoallw on a communicator with the process grid topology, RMA - MPI_Put into
+ * neighbours' halos with post-start-complete-wait synchronisation, SHM - halos of neighbours on the same host
+ * copied straight from their buffers in a shared memory window, P2P for the rest, COMPRESSED - P2P of variable
+ * length messages, halos encoded with a lossless codec (see HaloCodec.h), TWO_PHASE - P2P without diagonal
+ * messages: columns first, then rows as wide as the workspace, corners included (parallel_ts only)
+ */
+enum class HaloExchange {
+	P2P,
+	PERSISTENT,
+	NEIGHBOUR,
+	RMA,
+	SHM,
+	COMPRESSED,
+	TWO_PHASE,
+};
+
+const char* halo_exchange_name(const HaloExchange mode) {
+	switch(mode) {
+		case HaloExchange::P2P: return "p2p";
+		case HaloExchange::PERSISTENT: return "persistent";
+		case HaloExchange::NEIGHBOUR: return "neighbour";
+		case HaloExchange::RMA: return "rma";
+		case HaloExchange::SHM: return "shm";
+		case HaloExchange::COMPRESSED: return "compressed";
+		case HaloExchange::TWO_PHASE: return "twophase";
+	}
+	return "?";
+}
+
+const std::initializer_list<HaloExchange> ALL_HALO_EXCHANGES = {
+		HaloExchange::P2P, HaloExchange::PERSISTENT, HaloExchange::NEIGHBOUR, HaloExchange::RMA,
+		HaloExchange::SHM, HaloExchange::COMPRESSED, HaloExchange::TWO_PHASE
+};
+
+HaloExchange parse_halo_exchange(const std::string& s) {
+	for(auto mode: ALL_HALO_EXCHANGES) {
+		if(s == halo_exchange_name(mode)) {
+			return mode;
+		}
+	}
+	throw std::runtime_error("unknown halo exchange: " + s);
+}
+
+/**
+ * Not every variant implements every mode
+ */
+void require_halo_exchange(const HaloExchange mode, const std::initializer_list<HaloExchange> supported) {
+	for(auto m: supported) {
+		if(m == mode) {
+			return;
+		}
+	}
+	throw std::runtime_error(std::string("halo exchange not supported by this variant: ") + halo_exchange_name(mode));
+}
+
+/**
+ * Throws if halo depth (-l) is more than variant keeps in flight
+ */
+void require_halo_depth(const int depth, const int deepest) {
+	if(depth > deepest) {
+		throw std::runtime_error("halo depth not supported by this variant: " + std::to_string(depth));
+	}
+}
+
+/**
+ * Throws if rebalancing (-m) was asked for - for variants whose partition stays as Partitioner laid it out
+ */
+void require_fixed_partition(const TimeStepCount rebalanceEvery) {
+	if(rebalanceEvery > 0) {
+		throw std::runtime_error("rebalancing not supported by this variant: every " + std::to_string(rebalanceEvery)
+		                         + " steps");
+	}
+}
+
+/**
+ * Precision halo values travel in when Workspace stays in NumType - FULL (NumType), FLOAT or BF16 (bfloat16: float
+ * with 8 bit mantissa)
+ */
+enum class HaloPrecision {
+	FULL,
+	FLOAT,
+	BF16,
+};
+
+const char* halo_precision_name(const HaloPrecision precision) {
+	switch(precision) {
+		case HaloPrecision::FULL: return "full";
+		case HaloPrecision::FLOAT: return "float";
+		case HaloPrecision::BF16: return "bf16";
+	}
+	return "?";
+}
+
+HaloPrecision parse_halo_precision(const std::string& s) {
+	for(auto precision: {HaloPrecision::FULL, HaloPrecision::FLOAT, HaloPrecision::BF16}) {
+		if(s == halo_precision_name(precision)) {
+			return precision;
+		}
+	}
+	throw std::runtime_error("unknown halo precision: " + s);
+}
+
+/**
+ * Throws if reduced halo precision (-q) was asked for - for halos which go in NumType as they are
+ */
+void require_full_halo_precision(const HaloPrecision precision) {
+	if(precision != HaloPrecision::FULL) {
+		throw std::runtime_error(std::string("halo precision not supported by this variant: ")
+		                         + halo_precision_name(precision));
+	}
+}
+
+/**
+ * How strided halo messages (columns, corners) get to MPI - as MPI derived datatypes, copied into contiguous
+ * buffers by hand (MANUAL) or whichever of the two a startup micro-benchmark finds faster (AUTO)
+ */
+enum class HaloPacking {
+	AUTO,
+	DATATYPE,
+	MANUAL,
+};
+
+const char* halo_packing_name(const HaloPacking packing) {
+	switch(packing) {
+		case HaloPacking::AUTO: return "auto";
+		case HaloPacking::DATATYPE: return "datatype";
+		case HaloPacking::MANUAL: return "manual";
+	}
+	return "?";
+}
+
+HaloPacking parse_halo_packing(const std::string& s) {
+	for(auto packing: {HaloPacking::AUTO, HaloPacking::DATATYPE, HaloPacking::MANUAL}) {
+		if(s == halo_packing_name(packing)) {
+			return packing;
+		}
+	}
+	throw std::runtime_error("unknown halo packing: " + s);
+}
+
+/**
+ * Who keeps halo transfers moving while the innies are computed (see ProgressEngine): NONE - MPI alone, which with
+ * many implementations means only inside the waits, POLL - the sweep tests outstanding requests every few rows,
+ * THREAD - helper thread tests them
+ */
+enum class Progress {
+	NONE,
+	POLL,
+	THREAD,
+};
+
+const char* progress_name(const Progress mode) {
+	switch(mode) {
+		case Progress::NONE: return "none";
+		case Progress::POLL: return "poll";
+		case Progress::THREAD: return "thread";
+	}
+	return "?";
+}
+
+Progress parse_progress(const std::string& s) {
+	for(auto mode: {Progress::NONE, Progress::POLL, Progress::THREAD}) {
+		if(s == progress_name(mode)) {
+			return mode;
+		}
+	}
+	throw std::runtime_error("unknown progress mode: " + s);
+}
+
+/**
+ * Calls f(inner_from, inner_to, outer_from, outer_to) (inclusive) for every tile of [inner_from, inner_to] x
+ * [outer_from, outer_to]; whole area is a single tile when tiling is disabled
+ */
+template <typename F>
+inline void iterate_over_tiles(const Coord inner_from, const Coord inner_to,
+                               const Coord outer_from, const Coord outer_to,
+                               const TileShape& tile,
+                               F f) {
+	if(!tile.enabled()) {
+		if(inner_from <= inner_to && outer_from <= outer_to) {
+			f(inner_from, inner_to, outer_from, outer_to);
+		}
+		return;
+	}
+
+	for(Coord to = outer_from; to <= outer_to; to += tile.rows) {
+		const auto to_end = std::min(to + tile.rows - 1, outer_to);
+		for(Coord ti = inner_from; ti <= inner_to; ti += tile.span) {
+			f(ti, std::min(ti + tile.span - 1, inner_to), to, to_end);
+		}
+	}
+}
+
+/**
+ * Calls span(inner, outer, len) for every span of [inner_from, inner_to] x [outer_from, outer_to] (inclusive,
+ * inner is the contiguous dimension), tile after tile if tiling is enabled
+ */
+template <typename S>
+inline void iterate_over_tiled_spans(const Coord inner_from, const Coord inner_to,
+                                     const Coord outer_from, const Coord outer_to,
+                                     const TileShape& tile,
+                                     S span) {
+	if(!tile.enabled()) {
+		for(Coord o = outer_from; o <= outer_to; o++) {
+			span(inner_from, o, inner_to - inner_from + 1);
+		}
+		return;
+	}
+
+	iterate_over_tiles(inner_from, inner_to, outer_from, outer_to, tile,
+		[&span](const Coord i0, const Coord i1, const Coord o0, const Coord o1) {
+			for(Coord o = o0; o <= o1; o++) {
+				span(i0, o, i1 - i0 + 1);
+			}
+		});
+}
+
+/**
+ * Time skewing - advances [inner_from, inner_to] x [outer_from, outer_to] (inclusive, inner is the contiguous
+ * dimension) by `levels` time steps tile after tile, calling span(level, inner, outer, len) for level = 1..levels
+ *
+ * Domain shrinks by `shrink` points on every side with every level (trapezoid; parallel_ts areas lose one ghost
+ * point per step, seq has fixed domain -> 0). Inside the domain tiles are parallelograms - each level is shifted by
+ * one point towards the origin, first/last tile in each dimension is clipped to the domain instead:
+ *
+ *  level 3   |xx|xxx|xxx|xxxxx|
+ *  level 2   |xxx|xxx|xxx|xxxx|
+ *  level 1   |xxxx|xxx|xxx|xxx|
+ *
+ * Tiles go in lexicographic order, so whatever level l needs from level l-1 is either already computed (tiles
+ * below/left of the skew) or not yet overwritten by level l+1 (tiles above/right) - front/back buffers are enough.
+ */
+template <typename S>
+inline void iterate_over_time_skewed_tiles(const Coord inner_from, const Coord inner_to,
+                                           const Coord outer_from, const Coord outer_to,
+                                           const Coord levels,
+                                           const Coord shrink,
+                                           const TileShape& tile,
+                                           S span) {
+	const auto tile_span = tile.enabled() ? tile.span : std::max<Coord>(inner_to - inner_from + 1, 1);
+	const auto tile_rows = tile.enabled() ? tile.rows : std::max<Coord>(outer_to - outer_from + 1, 1);
+
+	for(Coord to = outer_from; to <= outer_to; to += tile_rows) {
+		const bool first_o = to == outer_from;
+		const bool last_o = to + tile_rows > outer_to;
+
+		for(Coord ti = inner_from; ti <= inner_to; ti += tile_span) {
+			const bool first_i = ti == inner_from;
+			const bool last_i = ti + tile_span > inner_to;
+
+			for(Coord l = 0; l < levels; l++) {
+				const auto d_o0 = outer_from + l*shrink;
+				const auto d_o1 = outer_to - l*shrink;
+				const auto d_i0 = inner_from + l*shrink;
+				const auto d_i1 = inner_to - l*shrink;
+
+				const auto o0 = first_o ? d_o0 : std::max(to - l, d_o0);
+				const auto o1 = last_o ? d_o1 : std::min(to + tile_rows - 1 - l, d_o1);
+				const auto i0 = first_i ? d_i0 : std::max(ti - l, d_i0);
+				const auto i1 = last_i ? d_i1 : std::min(ti + tile_span - 1 - l, d_i1);
+
+				if(i1 < i0) {
+					continue;
+				}
+
+				for(Coord o = o0; o <= o1; o++) {
+					span(l+1, i0, o, i1 - i0 + 1);
+				}
+			}
+		}
+	}
+}
+
 /* for nice plot: N = 40, timeSteps = 400 */
 struct Config {
 	Coord N = 40;
 	TimeStepCount timeSteps = 400;
 	bool outputEnabled = false;
+	TileShape tile = default_tile_shape();
+	/* time steps advanced per tile before moving to the next one (temporal blocking), 1 - off */
+	TimeStepCount timeBlock = 1;
+	/* compute threads per rank */
+	int threads = 1;
+	/* innies and outies as tiles of a work-stealing scheduler (edge tiles start as soon as their halo arrives) */
+	bool scheduledTiles = false;
+	/* stop once max |change| of a time step drops to this value, 0 - always run all timeSteps */
+	AccType tolerance = 0;
+	/* time steps between convergence checks */
+	TimeStepCount checkEvery = 10;
+	/* red-black SOR relaxation factor (parallel_gap only), 0 - Jacobi */
+	AccType omega = 0;
+	/* coarse level visits per multigrid level (parallel_mg only), 1 - V-cycle, 2 - W-cycle */
+	int mgCycle = 1;
+	HaloExchange haloExchange = HaloExchange::P2P;
+	/* halo values on the wire (parallel_gap and parallel_ts only, with p2p or compressed exchange) */
+	HaloPrecision haloPrecision = HaloPrecision::FULL;
+	/* strided halos of p2p and persistent exchange (parallel_gap and parallel_ts only) */
+	HaloPacking haloPacking = HaloPacking::AUTO;
+	/* exchanges whose halos may be in flight at once (parallel_gap and parallel_ts only, with p2p or compressed
+	 * exchange), 1 - every send waits for the previous one */
+	int haloDepth = 1;
+	/* MPI progress during the innies sweep (parallel_async, parallel_gap and parallel_ts only) */
+	Progress progress = Progress::NONE;
+	Decomposition decomposition = Decomposition::BLOCKS;
+	Placement placement = Placement::NODE;
+	/* time steps between moving partition boundaries by measured compute times (parallel_lb only), 0 - never */
+	TimeStepCount rebalanceEvery = 0;
 };
 
 Config parse_cli(int argc, char **argv) {
@@ -159,7 +863,7 @@ Config parse_cli(int argc, char **argv) {
 
 	int c;
 	while (1) {
-		c = getopt(argc, argv, "n:t:o");
+		c = getopt(argc, argv, "n:t:ob:k:p:se:i:w:g:c:r:q:d:l:m:a:j:");
 		if (c == -1)
 			break;
 
@@ -173,11 +877,68 @@ Config parse_cli(int argc, char **argv) {
 			case 'o':
 				conf.outputEnabled = true;
 				break;
+			case 'b':
+				conf.tile = parse_tile_shape(optarg);
+				break;
+			case 'k':
+				conf.timeBlock = std::max(std::stoull(optarg), 1ULL);
+				break;
+			case 'p':
+				conf.threads = std::max(std::stoi(optarg), 1);
+				break;
+			case 's':
+				conf.scheduledTiles = true;
+				break;
+			case 'e':
+				conf.tolerance = std::stod(optarg);
+				break;
+			case 'i':
+				conf.checkEvery = std::max(std::stoull(optarg), 1ULL);
+				break;
+			case 'w':
+				conf.omega = std::stod(optarg);
+				break;
+			case 'g':
+				conf.mgCycle = std::max(std::stoi(optarg), 1);
+				break;
+			case 'c':
+				conf.haloExchange = parse_halo_exchange(optarg);
+				break;
+			case 'r':
+				conf.progress = parse_progress(optarg);
+				break;
+			case 'q':
+				conf.haloPrecision = parse_halo_precision(optarg);
+				break;
+			case 'd':
+				conf.haloPacking = parse_halo_packing(optarg);
+				break;
+			case 'l':
+				conf.haloDepth = std::max(std::stoi(optarg), 1);
+				break;
+			case 'm':
+				conf.rebalanceEvery = std::stoull(optarg);
+				break;
+			case 'a':
+				conf.decomposition = parse_decomposition(optarg);
+				break;
+			case 'j':
+				conf.placement = parse_placement(optarg);
+				break;
 		}
 	}
 
 	std::cerr << "N = " << conf.N << ", timeSteps = " << conf.timeSteps << ", output = " << conf.outputEnabled
-	          << std::endl;
+	          << ", tile = " << conf.tile.toStr() << ", timeBlock = " << conf.timeBlock
+	          << ", threads = " << conf.threads << ", scheduledTiles = " << conf.scheduledTiles
+	          << ", precision = " << PRECISION_NAME << ", tolerance = " << conf.tolerance
+	          << ", checkEvery = " << conf.checkEvery << ", omega = " << conf.omega << ", mgCycle = " << conf.mgCycle
+	          << ", haloExchange = " << halo_exchange_name(conf.haloExchange)
+	          << ", haloPrecision = " << halo_precision_name(conf.haloPrecision)
+	          << ", haloPacking = " << halo_packing_name(conf.haloPacking) << ", haloDepth = " << conf.haloDepth
+	          << ", progress = " << progress_name(conf.progress) << ", rebalanceEvery = " << conf.rebalanceEvery
+	          << ", decomposition = " << decomposition_name(conf.decomposition)
+	          << ", placement = " << placement_name(conf.placement) << std::endl;
 
 	return conf;
 }
@@ -220,25 +981,37 @@ public:
 			: prefix(prefix), N(n_partition), offset_x(offset_x), offset_y(offset_y), step(step), sel(selector),
 			  nextDumpId(0) {}
 
+	/**
+	 * Workspace of the node starts somewhere else now (partition boundaries moved)
+	 */
+	void setOffsets(const NumType x, const NumType y) {
+		offset_x = x;
+		offset_y = y;
+	}
+
 	void dumpBackbuffer(W& w, const TimeStepCount it_time, const Coord keep_snapshots = KEEP_X_POINTS) {
 
 		if(!sel(it_time)) {
 			return;
 		}
 
-		auto edgeLen  = w.getInnerLength();
-		auto step = std::max(edgeLen/keep_snapshots, static_cast<long long int>(1));
+		auto width = w.getInnerWidth();
+		auto height = w.getInnerHeight();
+		auto step_x = std::max(width/keep_snapshots, static_cast<long long int>(1));
+		auto step_y = std::max(height/keep_snapshots, static_cast<long long int>(1));
 
 		#ifdef DEBUG
-		std::cerr << "edgeLen: " << edgeLen
+		std::cerr << "width: " << width
+		          << " height: " << height
 				  << "keep_snapshots" << keep_snapshots
-		          << " step: " << step
+		          << " step_x: " << step_x
+		          << " step_y: " << step_y
 		          << " offset_x: " << offset_x
 		          << " offset_y: " << offset_y
 		          << std::endl;
 		#endif
 
-		if(step < 1) {
+		if(step_x < 1 || step_y < 1) {
 			throw std::runtime_error("FileDumper: step == 0 -> infinite iteration");
 		}
 
@@ -252,8 +1025,8 @@ public:
 
 		DL( "dumping" )
 
-		loop(edgeLen, step, [=, &w, &file](const Coord i) {
-			loop(edgeLen, step, [=, &w, &file](const Coord j) {
+		loop(width, step_x, [=, &w, &file](const Coord i) {
+			loop(height, step_y, [=, &w, &file](const Coord j) {
 				auto x = vr_x(i);
 				auto y = vr_y(j);
 				file << x << " " << y << " " << it_time << " " << w.elb(i,j) << std::endl;
@@ -278,8 +1051,8 @@ private:
 	std::function<bool(TimeStepCount)> sel;
 	size_t nextDumpId;
 
-	const NumType offset_x;
-	const NumType offset_y;
+	NumType offset_x;
+	NumType offset_y;
 	const NumType step;
 
 	void loop(const Coord limit, const Coord step, std::function<void(const Coord)> f) {
@@ -373,7 +1146,7 @@ NumType f(NumType x, NumType y) {
 }
 
 NumType equation(const NumType v_i_j, const NumType vi_j, const NumType v_ij, const NumType vij) {
-	auto val = 0.25*(v_i_j + v_ij + vi_j + vij);
+	auto val = static_cast<AccType>(0.25)*(static_cast<AccType>(v_i_j) + v_ij + vi_j + vij);
 	// DL( "(" << v_i_j << "," << vi_j << "," << v_ij << "," << vij  << "," << val << ")" )
 	return val;
 }